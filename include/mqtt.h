@@ -6,6 +6,14 @@
 #include "mqtt_config.h"
 #include "mqtt_msg.h"
 #include "ringbuf.h"
+#include "mqtt_outbox.h"
+#include "mqtt_inflight.h"
+#include "mqtt_store.h"
+#include "mqtt_alias.h"
+#include "mqtt_pool.h"
+#include "mqtt_trie.h"
+#include "mqtt_dns.h"
+#include "mqtt_backoff.h"
 
 #if defined(CONFIG_MQTT_SECURITY_ON)
 #include "openssl/ssl.h"
@@ -14,6 +22,14 @@
 typedef struct mqtt_client mqtt_client;
 typedef struct mqtt_event_data_t mqtt_event_data_t;
 
+#define MQTT_MAX_SEGMENTS 8
+
+typedef struct mqtt_segment_t
+{
+  const void* data;
+  int len;
+} mqtt_segment_t;
+
 /**
  * \return True on connect success, false on error
  */
@@ -35,7 +51,51 @@ typedef int (* mqtt_read_callback)(mqtt_client *client, void *buffer, int len, i
  * \return Number of bytes written, less than 0 on error
  */
 typedef int (* mqtt_write_callback)(mqtt_client *client, const void *buffer, int len, int timeout_ms);
+/**
+ * \param[in] segments Buffers to write back to back, e.g. packet header and payload
+ * \param[in] count Number of segments
+ * \param[in] timeout_ms Time to wait for completion, or 0 for no timeout
+ * \return Number of bytes written across the segments, less than 0 on error
+ */
+typedef int (* mqtt_writev_callback)(mqtt_client *client, const mqtt_segment_t *segments, int count, int timeout_ms);
+/**
+ * \param[in] host Server name, or address literal
+ * \param[out] addrs Addresses to connect to, IPv4 or IPv6, port left to the client
+ * \param[in] max Room in addrs
+ * \param[out] ttl_s Seconds the addresses may be reused for, 0 for this connection only
+ * \return Number of addresses, 0 if host could not be resolved
+ */
+typedef int (* mqtt_resolve_callback)(mqtt_client *client, const char *host, struct sockaddr_storage *addrs,
+                                      int max, uint32_t *ttl_s);
 typedef void (* mqtt_event_callback)(mqtt_client *client, mqtt_event_data_t *event_data);
+/**
+ * \param[in] high True once the send queue reaches high_watermark, false
+ *                 once it is back down to low_watermark
+ * Called from the task that queued or sent the packet crossing the mark.
+ */
+typedef void (* mqtt_watermark_callback)(mqtt_client *client, bool high);
+/**
+ * \return Uniformly distributed number, e.g. to jitter reconnect delays
+ */
+typedef uint32_t (* mqtt_random_callback)(mqtt_client *client);
+
+typedef enum mqtt_status_t
+{
+  MQTT_OK = 0,
+  MQTT_WOULD_BLOCK,          /**< No room in the send queue, in-flight window or store, try again later */
+  MQTT_DROPPED,              /**< Will never be sent, e.g. too large or evicted */
+  MQTT_INVALID               /**< Could not be encoded, e.g. empty topic */
+} mqtt_status_t;
+
+/**
+ * What mqtt_publish and mqtt_subscribe do when the send queue is full
+ */
+typedef enum mqtt_overflow_policy_t
+{
+  MQTT_OVERFLOW_BLOCK = 0,   /**< Wait up to overflow_timeout_ms for room */
+  MQTT_OVERFLOW_FAIL,        /**< Return MQTT_WOULD_BLOCK right away */
+  MQTT_OVERFLOW_DROP_OLDEST  /**< Evict the oldest queued publishes of at most overflow_drop_qos */
+} mqtt_overflow_policy_t;
 
 typedef struct mqtt_settings {
     mqtt_connect_callback connect_cb;
@@ -43,13 +103,15 @@ typedef struct mqtt_settings {
 
     mqtt_read_callback read_cb;
     mqtt_write_callback write_cb;
+    mqtt_writev_callback writev_cb;
+    mqtt_resolve_callback resolve_cb;
 
     mqtt_event_callback connected_cb;
     mqtt_event_callback disconnected_cb;
 
     mqtt_event_callback subscribe_cb;
     mqtt_event_callback publish_cb;
-    mqtt_event_callback data_cb;
+    mqtt_event_callback data_cb;      /**< Messages matching no filter subscribed with a callback */
 
     char host[CONFIG_MQTT_MAX_HOST_LEN];
     uint32_t port;
@@ -63,7 +125,18 @@ typedef struct mqtt_settings {
     uint32_t lwt_retain;
     uint32_t clean_session;
     uint32_t keepalive;
+    uint32_t inflight_window;   /**< QoS 1 and 2 publishes awaiting ack, 0 for CONFIG_MQTT_INFLIGHT_WINDOW */
+    mqtt_overflow_policy_t overflow_policy;
+    uint32_t overflow_timeout_ms; /**< Wait of MQTT_OVERFLOW_BLOCK, 0 for 1000 */
+    uint32_t overflow_drop_qos;
+    mqtt_watermark_callback watermark_cb;
+    uint32_t high_watermark;    /**< Queued bytes, 0 for no watermark_cb calls */
+    uint32_t low_watermark;
     bool auto_reconnect;
+    uint32_t reconnect_initial_ms;  /**< 0 for CONFIG_MQTT_RECONNECT_INITIAL_MS, see mqtt_backoff.h */
+    uint32_t reconnect_max_ms;      /**< 0 for CONFIG_MQTT_RECONNECT_TIMEOUT seconds */
+    uint32_t reconnect_multiplier;  /**< Percent, 0 for CONFIG_MQTT_RECONNECT_MULTIPLIER */
+    mqtt_random_callback random_cb; /**< NULL for esp_random */
 } mqtt_settings;
 
 typedef struct mqtt_event_data_t
@@ -75,47 +148,157 @@ typedef struct mqtt_event_data_t
   uint16_t data_length;
   uint16_t data_offset;
   uint16_t data_total_length;
+  mqtt_buffer_t* buffer;     /**< Holding a whole PUBLISH, topic and data, NULL otherwise; see mqtt_buffer_retain */
 } mqtt_event_data_t;
 
+#define MQTT_MAX_PENDING_SUBSCRIBE INFLIGHT_HELD_IDS
+
+/**
+ * SUBSCRIBE or UNSUBSCRIBE waiting for its ack, as part of a batch of
+ * filters that may span several packets.
+ */
+typedef struct mqtt_pending_subscribe_t
+{
+  volatile uint16_t msg_id;  /**< 0 if the slot is free */
+  uint8_t type;
+  uint16_t first;            /**< Index in the batch of the packet's first filter */
+  uint16_t count;            /**< Filters in the packet */
+  uint16_t total;            /**< Filters in the batch */
+} mqtt_pending_subscribe_t;
+
 typedef struct mqtt_state_t
 {
   uint16_t port;
   int auto_reconnect;
   mqtt_connect_info_t* connect_info;
-  uint8_t* in_buffer;
+  uint8_t* in_buffer;        /**< Data of in_current */
+  mqtt_pool_t* in_pool;
+  mqtt_buffer_t* in_current; /**< Receive buffer being read into */
   uint8_t* out_buffer;
   int in_buffer_length;
   int out_buffer_length;
+  int in_offset;             /**< Start in in_buffer of the bytes read but not handled yet */
+  int in_length;             /**< Bytes read but not handled yet, the tail of a packet maybe */
   uint16_t message_length;
   uint16_t message_length_read;
-  mqtt_message_t* outbound_message;
-  mqtt_connection_t mqtt_connection;
-  uint16_t pending_msg_id;
-  int pending_msg_type;
-  int pending_publish_qos;
+  mqtt_pending_subscribe_t pending_subscribe[MQTT_MAX_PENDING_SUBSCRIBE];
+  unsigned int pending_subscribe_next;  /**< Claimed with an atomic increment */
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+  mqtt_alias_table_t tx_alias;  /**< Owned by the sending task */
+  mqtt_alias_table_t rx_alias;  /**< Owned by the receiving task */
+#endif
 } mqtt_state_t;
 
+#if defined(CONFIG_MQTT_STATS_ON)
+#define MQTT_STATS_BUCKETS 32
+
+/**
+ * Outbound path counters, updated without locking so they may be slightly
+ * off under contention. Enqueue cost is measured in CPU cycles from the
+ * mqtt_publish call (or ack generation) to the packet being in the outbox.
+ */
+typedef struct mqtt_stats_t
+{
+  uint32_t queued;          /**< Packets queued */
+  uint32_t evicted;         /**< Packets evicted to make room */
+  uint32_t dropped;         /**< Packets that can never be sent */
+  uint32_t rejected;        /**< Packets refused with MQTT_WOULD_BLOCK */
+  uint32_t sent;            /**< Packets handed to write_cb */
+  uint32_t writes;          /**< Calls to write_cb or writev_cb, fewer than sent when batched */
+  uint32_t retransmitted;   /**< Unacked packets written again */
+  uint64_t queued_bytes;    /**< Encoded bytes queued */
+  uint64_t copied_bytes;    /**< Bytes memcpy'd into the outbox or a write batch */
+  uint64_t sent_bytes;      /**< Bytes accepted by write_cb */
+  uint64_t enqueue_cycles;  /**< Total enqueue cost */
+  uint32_t enqueue_hist[MQTT_STATS_BUCKETS]; /**< Bucket n counts costs in [2^n, 2^(n+1)) */
+} mqtt_stats_t;
+#endif
+
 typedef struct mqtt_client {
   int socket;
 
 #if defined(CONFIG_MQTT_SECURITY_ON)  // ENABLE MQTT OVER SSL
-  SSL_CTX *ctx;
+  SSL_CTX *ctx;              /**< Created on the first connection, freed with the client */
   SSL *ssl;
+  SSL_SESSION *session;      /**< Of the last full handshake, offered to the server to resume */
 #endif
 
   mqtt_settings *settings;
   mqtt_state_t  mqtt_state;
   mqtt_connect_info_t connect_info;
-  QueueHandle_t xSendingQueue;
-  RINGBUF send_rb;
+  mqtt_outbox_t outbox;
+  mqtt_inflight_t inflight;
+  mqtt_trie_t subscriptions;         /**< Filters subscribed with a callback */
+  mqtt_dns_t dns;
+  mqtt_backoff_t backoff;            /**< Written by the client task only */
+#if defined(CONFIG_MQTT_STORE_ON)
+  mqtt_store_t store;
+  uint8_t *store_buffer;             /**< A PUBLISH being stored is encoded here, under the store lock */
+#endif
   uint32_t keepalive_tick;
+  TaskHandle_t task;
+  TaskHandle_t sending_task;
+  volatile bool sending_stop;        /**< The sending task is to exit, see mqtt_stop_sending */
+  volatile bool terminate;
+  volatile uint32_t above_watermark;
+#if defined(CONFIG_MQTT_SINGLE_TASK)
+  int wakeup_rx;                     /**< Loopback datagram socket the task selects on */
+  int wakeup_tx;                     /**< Producers send a byte here after queuing */
+  volatile uint32_t wakeup_pending;  /**< A wakeup byte is on its way */
+#endif
+#if defined(CONFIG_MQTT_STATS_ON)
+  mqtt_stats_t stats;
+#endif
 } mqtt_client;
 
 mqtt_client *mqtt_start(mqtt_settings *mqtt_info);
-void mqtt_stop();
+void mqtt_stop(mqtt_client *client);
 void mqtt_task(void *pvParameters);
-void mqtt_subscribe(mqtt_client *client, const char *topic, uint8_t qos);
-void mqtt_unsubscribe(mqtt_client *client, const char *topic);
-void mqtt_publish(mqtt_client* client, const char *topic, const char *data, int len, int qos, int retain);
-void mqtt_destroy();
+/**
+ * Messages matching topic go to callback, with context, instead of data_cb;
+ * with a NULL callback they go to data_cb again. When several filters
+ * match, each callback gets the message. Unsubscribing drops the callback
+ * once the packet is queued. A call that fails routes none of its filters,
+ * even one that had a callback before.
+ */
+mqtt_status_t mqtt_subscribe(mqtt_client *client, const char *topic, uint8_t qos,
+                             mqtt_message_callback callback, void *context);
+mqtt_status_t mqtt_unsubscribe(mqtt_client *client, const char *topic);
+mqtt_status_t mqtt_subscribe_multiple(mqtt_client *client, const mqtt_topic_t *topics, int count);
+mqtt_status_t mqtt_unsubscribe_multiple(mqtt_client *client, const mqtt_topic_t *topics, int count);
+mqtt_status_t mqtt_publish(mqtt_client* client, const char *topic, const char *data, int len, int qos, int retain);
+mqtt_status_t mqtt_publish_urgent(mqtt_client* client, const char *topic, const char *data, int len, int qos, int retain);
+mqtt_prepared_topic_t *mqtt_prepare_topic(const char *topic, int qos, int retain);
+void mqtt_free_topic(mqtt_prepared_topic_t *prepared);
+/**
+ * Keep the buffer a whole PUBLISH was delivered in, event_data->buffer,
+ * after data_cb returns: its topic and data stay valid, without a copy,
+ * until mqtt_buffer_release. The client reads on in another of its
+ * CONFIG_MQTT_RECEIVE_BUFFERS buffers, and waits once all are kept.
+ * Buffers may be released from any task, even after the client is gone.
+ */
+void mqtt_buffer_retain(mqtt_buffer_t *buffer);
+void mqtt_buffer_release(mqtt_buffer_t *buffer);
+mqtt_status_t mqtt_publish_prepared(mqtt_client* client, const mqtt_prepared_topic_t *prepared, const char *data, int len);
+void mqtt_destroy(mqtt_client *client);
+/**
+ * Copy of the reconnect backoff: failures in a row, and the delay and tick
+ * count of the retry last planned. Read without locking, so a field may be
+ * one retry ahead of another.
+ */
+void mqtt_get_backoff(mqtt_client *client, mqtt_backoff_t *backoff);
+#if defined(CONFIG_MQTT_STORE_ON)
+/**
+ * Write the publishes kept in the store through to the file system, e.g.
+ * before power goes; otherwise they are written as they are sent or as the
+ * stream buffer fills. Returns MQTT_DROPPED if a failed write gave up on
+ * some of them.
+ */
+mqtt_status_t mqtt_store_sync(mqtt_client *client);
+#endif
+#if defined(CONFIG_MQTT_STATS_ON)
+void mqtt_get_stats(mqtt_client *client, mqtt_stats_t *stats);
+void mqtt_reset_stats(mqtt_client *client);
+uint32_t mqtt_stats_percentile(const mqtt_stats_t *stats, int percent);
+#endif
 #endif
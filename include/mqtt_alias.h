@@ -0,0 +1,36 @@
+#ifndef _MQTT_ALIAS_H_
+#define _MQTT_ALIAS_H_
+
+#include <stdint.h>
+#include "mqtt_config.h"
+
+/**
+ * MQTT 5 topic alias table, one per direction and connection.
+ *
+ * Outbound, the sending task assigns aliases to topics in the order packets
+ * go out, up to the server's Topic Alias Maximum, and sends the topic itself
+ * only with the first packet. Inbound, aliases set by the server are
+ * remembered so that packets carrying only the alias can be delivered with
+ * their topic.
+ */
+
+typedef struct mqtt_alias_entry
+{
+  char* topic;               /**< Heap copy, NUL terminated, NULL if unused */
+  uint16_t length;
+} mqtt_alias_entry_t;
+
+typedef struct mqtt_alias_table
+{
+  uint16_t max;              /**< Aliases usable on this connection */
+  uint16_t count;            /**< Outbound aliases assigned so far */
+  mqtt_alias_entry_t entries[CONFIG_MQTT_MAX_TOPIC_ALIAS];
+} mqtt_alias_table_t;
+
+void alias_reset(mqtt_alias_table_t* table, int max);
+uint16_t alias_find(mqtt_alias_table_t* table, const char* topic, int length);
+uint16_t alias_assign(mqtt_alias_table_t* table, const char* topic, int length);
+int alias_set(mqtt_alias_table_t* table, uint16_t alias, const char* topic, int length);
+const char* alias_get(mqtt_alias_table_t* table, uint16_t alias, uint16_t* length);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _MQTT_BACKOFF_H_
+#define _MQTT_BACKOFF_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "mqtt_config.h"
+
+/**
+ * Delays between attempts to get a connection to the server.
+ *
+ * The first retry after a connection is lost goes out right away. Each
+ * retry after that waits a random delay between 0 and the ceiling ("full
+ * jitter"), the ceiling starting at initial_ms and growing by multiplier
+ * percent per failure up to max_ms, so that clients losing the server at
+ * the same time do not all come back at the same time. The ceiling drops
+ * back to initial_ms once a connection has stayed up for initial_ms, so that
+ * a server taking connections only to drop them is backed off from too.
+ *
+ * The time and the random numbers are handed in by the caller, which keeps
+ * the sequence of delays reproducible.
+ */
+
+typedef struct mqtt_backoff
+{
+  uint32_t initial_ms;
+  uint32_t max_ms;
+  uint32_t multiplier;       /**< Percent the ceiling grows by per failure */
+  uint32_t failures;         /**< Retries in a row that got no lasting connection */
+  uint32_t ceiling_ms;       /**< Longest delay the next retry may draw */
+  uint32_t delay_ms;         /**< Delay drawn for the last retry */
+  TickType_t retry_at;       /**< Tick count the last retry is due at */
+  TickType_t connected_at;   /**< Tick count the last connection came up at */
+  bool connected;            /**< A connection came up since the last retry */
+} mqtt_backoff_t;
+
+void backoff_init(mqtt_backoff_t* backoff, uint32_t initial_ms, uint32_t max_ms, uint32_t multiplier);
+void backoff_connected(mqtt_backoff_t* backoff, TickType_t now);
+uint32_t backoff_next(mqtt_backoff_t* backoff, TickType_t now, uint32_t random);
+
+#endif
@@ -4,11 +4,14 @@
 #include <stdio.h>
 
 #define CONFIG_MQTT_PROTOCOL_311 1
+// #define CONFIG_MQTT_PROTOCOL_5 1
 // #define CONFIG_MQTT_SECURITY_ON 1
 #define CONFIG_MQTT_PRIORITY 5
 #define CONFIG_MQTT_LOG_ERROR_ON
 #define CONFIG_MQTT_LOG_WARN_ON
 #define CONFIG_MQTT_LOG_INFO_ON
+// #define CONFIG_MQTT_STATS_ON 1
+// #define CONFIG_MQTT_SINGLE_TASK 1
 #define CONFIG_MQTT_RECONNECT_TIMEOUT 60
 #define CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD 1024
 #define CONFIG_MQTT_BUFFER_SIZE_BYTE 1024
@@ -18,6 +21,20 @@
 #define CONFIG_MQTT_MAX_PASSWORD_LEN 32
 #define CONFIG_MQTT_MAX_LWT_TOPIC 32
 #define CONFIG_MQTT_MAX_LWT_MSG 32
+#define CONFIG_MQTT_MAX_TOPIC_ALIAS 16
+#define CONFIG_MQTT_INFLIGHT_WINDOW 16
+#define CONFIG_MQTT_RETRANSMIT_TIMEOUT 20
+// #define CONFIG_MQTT_STORE_ON 1
+#ifndef CONFIG_MQTT_STORE_PATH
+#define CONFIG_MQTT_STORE_PATH "/spiffs/mqtt"
+#endif
+#ifndef CONFIG_MQTT_STORE_SEGMENT_SIZE
+#define CONFIG_MQTT_STORE_SEGMENT_SIZE 16384
+#endif
+#ifndef CONFIG_MQTT_STORE_MAX_SEGMENTS
+#define CONFIG_MQTT_STORE_MAX_SEGMENTS 64
+#endif
+#define CONFIG_MQTT_STORE_READ_BUFFER 1024
 
 
 
@@ -40,5 +57,44 @@
 #ifndef CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD
 #define CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD 1024
 #endif
+#ifndef CONFIG_MQTT_URGENT_QUEUE_SIZE_BYTE
+#define CONFIG_MQTT_URGENT_QUEUE_SIZE_BYTE 512
+#endif
+// Receive buffers of CONFIG_MQTT_BUFFER_SIZE_BYTE; reading waits while the application keeps them all
+#ifndef CONFIG_MQTT_RECEIVE_BUFFERS
+#define CONFIG_MQTT_RECEIVE_BUFFERS 2
+#endif
+// Queued packets written with one call, up to CONFIG_MQTT_BUFFER_SIZE_BYTE; 0 for one write each
+#ifndef CONFIG_MQTT_WRITE_BATCH_BYTE
+#define CONFIG_MQTT_WRITE_BATCH_BYTE CONFIG_MQTT_BUFFER_SIZE_BYTE
+#endif
+// How long a batch of bulk packets with room left waits for more, rounded down to ticks
+#ifndef CONFIG_MQTT_WRITE_FLUSH_MS
+#define CONFIG_MQTT_WRITE_FLUSH_MS 0
+#endif
+// Server addresses tried in turn when connecting
+#ifndef CONFIG_MQTT_DNS_MAX_ADDRESSES
+#define CONFIG_MQTT_DNS_MAX_ADDRESSES 4
+#endif
+// How long the default resolver's addresses are reused, lwIP not telling the record TTL; 0 to resolve every time
+#ifndef CONFIG_MQTT_DNS_TTL_S
+#define CONFIG_MQTT_DNS_TTL_S 60
+#endif
+// Wait for each address to take the TCP connection
+#ifndef CONFIG_MQTT_CONNECT_TIMEOUT_MS
+#define CONFIG_MQTT_CONNECT_TIMEOUT_MS 5000
+#endif
+// Longest wait between reconnect attempts, in seconds
+#ifndef CONFIG_MQTT_RECONNECT_TIMEOUT
+#define CONFIG_MQTT_RECONNECT_TIMEOUT 60
+#endif
+// Longest wait before the second reconnect attempt, the first going out right away
+#ifndef CONFIG_MQTT_RECONNECT_INITIAL_MS
+#define CONFIG_MQTT_RECONNECT_INITIAL_MS 1000
+#endif
+// Percent the longest wait grows by with each failed attempt
+#ifndef CONFIG_MQTT_RECONNECT_MULTIPLIER
+#define CONFIG_MQTT_RECONNECT_MULTIPLIER 200
+#endif
 
 #endif
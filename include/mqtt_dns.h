@@ -0,0 +1,35 @@
+#ifndef _MQTT_DNS_H_
+#define _MQTT_DNS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "lwip/sockets.h"
+#include "mqtt_config.h"
+
+/**
+ * Addresses the server name resolved to, kept for the TTL given by the
+ * resolver so that reconnecting does not wait on DNS each time.
+ *
+ * Connecting goes through the addresses in turn, starting with the last one
+ * that took a connection; the cache is dropped once none of them does, as
+ * they may be stale. Only the client task uses it.
+ */
+
+typedef struct mqtt_dns
+{
+  char host[CONFIG_MQTT_MAX_HOST_LEN];
+  struct sockaddr_storage addrs[CONFIG_MQTT_DNS_MAX_ADDRESSES];
+  struct sockaddr_storage last;  /**< Last address connected to, AF_UNSPEC if none */
+  int count;                 /**< Addresses held, 0 if none */
+  int next;                  /**< Address to try first */
+  TickType_t expires;        /**< Tick count the addresses are stale from */
+} mqtt_dns_t;
+
+int dns_get(mqtt_dns_t* dns, const char* host);
+void dns_set(mqtt_dns_t* dns, const char* host, int count, uint32_t ttl_s);
+struct sockaddr_storage* dns_address(mqtt_dns_t* dns, int i);
+void dns_worked(mqtt_dns_t* dns, int i);
+void dns_forget(mqtt_dns_t* dns);
+
+#endif
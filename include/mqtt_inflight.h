@@ -0,0 +1,81 @@
+#ifndef _MQTT_INFLIGHT_H_
+#define _MQTT_INFLIGHT_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mqtt_config.h"
+
+/**
+ * QoS 1 and 2 publishes between queuing and their final ack.
+ *
+ * A producer reserves a slot, and with it a packet identifier, before
+ * encoding the PUBLISH; it waits while the window is full. The sending task
+ * keeps a copy of the packet when writing it, and writes the copy again
+ * with DUP set if the ack is late or the connection was lost. The receiving
+ * task frees the slot on PUBACK or PUBCOMP, and on PUBREC has the PUBREL
+ * written again instead. Copies are kept in an arena allocated with the
+ * window, a slot's worth each, so the send path never allocates. A publish
+ * no copy could be kept of, e.g. one with an external payload, is given up
+ * on once it would have to be written again. Identifiers are handed out in
+ * sequence, skipping those still held by a slot or by a SUBSCRIBE or
+ * UNSUBSCRIBE waiting for its ack.
+ */
+
+#define INFLIGHT_HELD_IDS 8  /**< Identifiers held for packets not tracked here */
+
+enum mqtt_inflight_state
+{
+  INFLIGHT_FREE = 0,
+  INFLIGHT_QUEUED,           /**< Reserved, packet still in the outbox */
+  INFLIGHT_WAIT_PUBACK,
+  INFLIGHT_WAIT_PUBREC,
+  INFLIGHT_WAIT_PUBCOMP,
+  INFLIGHT_ACKED             /**< Acked while being written again */
+};
+
+typedef struct mqtt_inflight_entry
+{
+  uint16_t msg_id;
+  uint8_t state;             /**< mqtt_inflight_state */
+  uint8_t writing;           /**< The sending task is writing packet */
+  uint8_t due;               /**< Write again as soon as possible */
+  uint8_t pubrel_length;
+  uint8_t pubrel[4];         /**< Written again once in INFLIGHT_WAIT_PUBCOMP */
+  uint16_t length;           /**< Of the copy of the PUBLISH in the arena, 0 if none */
+  TickType_t sent;           /**< Tick count of the last write */
+} mqtt_inflight_entry_t;
+
+typedef struct mqtt_inflight
+{
+  SemaphoreHandle_t lock;
+  SemaphoreHandle_t free_sem;  /**< Given when a slot is freed while a producer waits */
+  uint8_t* arena;            /**< Copies of the PUBLISHes, packet_size bytes per slot */
+  int packet_size;
+  uint16_t limit;            /**< Slots configured, at most CONFIG_MQTT_INFLIGHT_WINDOW */
+  uint16_t window;           /**< Slots usable on this connection, at most limit */
+  uint16_t count;            /**< Slots in use */
+  uint16_t waiters;          /**< Producers sleeping on free_sem */
+  uint16_t last_id;
+  uint16_t held[INFLIGHT_HELD_IDS];  /**< From inflight_hold_id, 0 once released */
+  unsigned int held_next;
+  mqtt_inflight_entry_t entries[CONFIG_MQTT_INFLIGHT_WINDOW];
+} mqtt_inflight_t;
+
+int inflight_init(mqtt_inflight_t* ifl, int window, int packet_size);
+void inflight_deinit(mqtt_inflight_t* ifl);
+void inflight_set_window(mqtt_inflight_t* ifl, int window);
+uint16_t inflight_hold_id(mqtt_inflight_t* ifl);
+void inflight_release_id(mqtt_inflight_t* ifl, uint16_t msg_id);
+uint16_t inflight_reserve(mqtt_inflight_t* ifl, TickType_t ticks_to_wait);
+void inflight_cancel(mqtt_inflight_t* ifl, uint16_t msg_id);
+void inflight_sent(mqtt_inflight_t* ifl, uint16_t msg_id, int qos, const uint8_t* packet, int length);
+void inflight_unsent(mqtt_inflight_t* ifl, uint16_t msg_id);
+int inflight_ack(mqtt_inflight_t* ifl, uint16_t msg_id, int type, const uint8_t* pubrel, int length);
+mqtt_inflight_entry_t* inflight_take_due(mqtt_inflight_t* ifl, TickType_t timeout,
+                                         const uint8_t** data, int* length);
+void inflight_written(mqtt_inflight_t* ifl, mqtt_inflight_entry_t* entry, int result);
+void inflight_drop(mqtt_inflight_t* ifl, mqtt_inflight_entry_t* entry);
+void inflight_set_due(mqtt_inflight_t* ifl);
+
+#endif
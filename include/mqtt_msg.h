@@ -58,6 +58,37 @@ enum mqtt_message_type
   MQTT_MSG_TYPE_DISCONNECT = 14
 };
 
+enum mqtt_property_id
+{
+  MQTT_PROPERTY_PAYLOAD_FORMAT = 0x01,
+  MQTT_PROPERTY_MESSAGE_EXPIRY = 0x02,
+  MQTT_PROPERTY_CONTENT_TYPE = 0x03,
+  MQTT_PROPERTY_RESPONSE_TOPIC = 0x08,
+  MQTT_PROPERTY_CORRELATION_DATA = 0x09,
+  MQTT_PROPERTY_SUBSCRIPTION_ID = 0x0b,
+  MQTT_PROPERTY_SESSION_EXPIRY = 0x11,
+  MQTT_PROPERTY_ASSIGNED_CLIENT_ID = 0x12,
+  MQTT_PROPERTY_SERVER_KEEP_ALIVE = 0x13,
+  MQTT_PROPERTY_AUTH_METHOD = 0x15,
+  MQTT_PROPERTY_AUTH_DATA = 0x16,
+  MQTT_PROPERTY_REQUEST_PROBLEM_INFO = 0x17,
+  MQTT_PROPERTY_WILL_DELAY = 0x18,
+  MQTT_PROPERTY_REQUEST_RESPONSE_INFO = 0x19,
+  MQTT_PROPERTY_RESPONSE_INFO = 0x1a,
+  MQTT_PROPERTY_SERVER_REFERENCE = 0x1c,
+  MQTT_PROPERTY_REASON_STRING = 0x1f,
+  MQTT_PROPERTY_RECEIVE_MAXIMUM = 0x21,
+  MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM = 0x22,
+  MQTT_PROPERTY_TOPIC_ALIAS = 0x23,
+  MQTT_PROPERTY_MAXIMUM_QOS = 0x24,
+  MQTT_PROPERTY_RETAIN_AVAILABLE = 0x25,
+  MQTT_PROPERTY_USER_PROPERTY = 0x26,
+  MQTT_PROPERTY_MAXIMUM_PACKET_SIZE = 0x27,
+  MQTT_PROPERTY_WILDCARD_SUB_AVAILABLE = 0x28,
+  MQTT_PROPERTY_SUBSCRIPTION_ID_AVAILABLE = 0x29,
+  MQTT_PROPERTY_SHARED_SUB_AVAILABLE = 0x2a
+};
+
 enum mqtt_connect_return_code
 {
   CONNECTION_ACCEPTED = 0,
@@ -101,26 +132,126 @@ typedef struct mqtt_connect_info
 } mqtt_connect_info_t;
 
 
+/*
+ * MQTT 5 property as read by mqtt_property_next. Integer properties use
+ * value; strings and binary data point into the packet.
+ */
+typedef struct mqtt_property
+{
+  uint8_t id;
+  uint32_t value;
+  const uint8_t* data;
+  uint16_t length;
+  const uint8_t* value_data;  /* User property value, data being its name */
+  uint16_t value_length;
+} mqtt_property_t;
+
+struct mqtt_client;
+struct mqtt_event_data_t;
+
+/*
+ * Handler of the messages matching one topic filter, given the context it
+ * was subscribed with
+ */
+typedef void (* mqtt_message_callback)(struct mqtt_client* client, struct mqtt_event_data_t* event_data,
+                                       void* context);
+
+/*
+ * One topic filter of a SUBSCRIBE or UNSUBSCRIBE, with the callback its
+ * messages go to, NULL for data_cb
+ */
+typedef struct mqtt_topic
+{
+  const char* topic;
+  uint8_t qos;
+  mqtt_message_callback callback;
+  void* context;
+} mqtt_topic_t;
+
+/*
+ * PUBLISH topic encoded once for repeated use: the length-prefixed topic as
+ * it goes on the wire, followed by a NUL so it also reads as a string.
+ */
+typedef struct mqtt_prepared_topic
+{
+  uint8_t qos;
+  uint8_t retain;
+  uint16_t length;            /* Encoded length, topic length plus 2 */
+  uint8_t data[];
+} mqtt_prepared_topic_t;
+
+/*
+ * Inbound packet descriptor, filled in by mqtt_parse once the fixed and
+ * variable headers have been seen. Offsets are from the packet start.
+ */
+typedef struct mqtt_packet
+{
+  uint8_t type;
+  uint8_t flags;              /* DUP, QoS and retain bits */
+  uint8_t header_length;      /* Fixed header size */
+  uint32_t remaining_length;
+  uint32_t total_length;      /* Fixed header plus remaining length */
+  const char* topic;          /* PUBLISH only, points into the parsed buffer */
+  uint16_t topic_length;
+  uint16_t msg_id;            /* 0 if the packet carries none */
+  uint16_t topic_alias;       /* MQTT 5 Topic Alias property, 0 if none */
+  uint32_t properties_offset; /* MQTT 5 property list, after its length */
+  uint32_t properties_length;
+  uint32_t payload_offset;
+  uint32_t payload_length;
+} mqtt_packet_t;
+
+/*
+ * Resumable packet decoder. It is fed the bytes of one packet as they
+ * accumulate in a buffer and picks up where the previous call stopped.
+ */
+typedef struct mqtt_parser
+{
+  int state;
+  uint32_t pos;
+  int shift;
+  uint32_t topic_offset;
+  mqtt_packet_t packet;
+} mqtt_parser_t;
+
 static inline int mqtt_get_type(uint8_t* buffer) { return (buffer[0] & 0xf0) >> 4; }
 static inline int mqtt_get_connect_return_code(uint8_t* buffer) { return buffer[3]; }
 static inline int mqtt_get_dup(uint8_t* buffer) { return (buffer[0] & 0x08) >> 3; }
 static inline int mqtt_get_qos(uint8_t* buffer) { return (buffer[0] & 0x06) >> 1; }
 static inline int mqtt_get_retain(uint8_t* buffer) { return (buffer[0] & 0x01); }
+static inline int mqtt_packet_qos(const mqtt_packet_t* packet) { return (packet->flags & 0x06) >> 1; }
+static inline const char* mqtt_prepared_topic_name(const mqtt_prepared_topic_t* prepared) { return (const char*)prepared->data + 2; }
 
 void mqtt_msg_init(mqtt_connection_t* connection, uint8_t* buffer, uint16_t buffer_length);
+int mqtt_msg_publish_length(const char* topic, int data_length, int qos);
+int mqtt_msg_publish_header_length(const char* topic, int qos);
+int mqtt_msg_prepared_topic_size(const char* topic);
+void mqtt_msg_prepare_topic(mqtt_prepared_topic_t* prepared, const char* topic, int qos, int retain);
+int mqtt_msg_publish_prepared_length(const mqtt_prepared_topic_t* prepared, int data_length);
+int mqtt_msg_subscribe_length(const mqtt_topic_t* topics, int count, int max_length, int* packed);
+int mqtt_msg_unsubscribe_length(const mqtt_topic_t* topics, int count, int max_length, int* packed);
 int mqtt_get_total_length(uint8_t* buffer, uint16_t length);
 const char* mqtt_get_publish_topic(uint8_t* buffer, uint16_t* length);
 const char* mqtt_get_publish_data(uint8_t* buffer, uint16_t* length);
 uint16_t mqtt_get_id(uint8_t* buffer, uint16_t length);
+int mqtt_msg_encode_length(uint8_t* buffer, uint32_t length);
+int mqtt_property_next(const uint8_t* buffer, uint32_t length, uint32_t* pos, mqtt_property_t* property);
+void mqtt_parser_init(mqtt_parser_t* parser);
+int mqtt_parse(mqtt_parser_t* parser, const uint8_t* buffer, uint32_t length);
 
 mqtt_message_t* mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_info_t* info);
+// *message_id is the packet identifier to use, 0 to have one assigned, and is set to the one used
 mqtt_message_t* mqtt_msg_publish(mqtt_connection_t* connection, const char* topic, const char* data, int data_length, int qos, int retain, uint16_t* message_id);
+mqtt_message_t* mqtt_msg_publish_prepared(mqtt_connection_t* connection, const mqtt_prepared_topic_t* prepared, const char* data, int data_length, uint16_t* message_id);
+mqtt_message_t* mqtt_msg_publish_header(mqtt_connection_t* connection, const char* topic, uint32_t data_length, int qos, int retain, uint16_t* message_id);
 mqtt_message_t* mqtt_msg_puback(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* mqtt_msg_pubrec(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* mqtt_msg_pubrel(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* mqtt_msg_pubcomp(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* mqtt_msg_subscribe(mqtt_connection_t* connection, const char* topic, int qos, uint16_t* message_id);
 mqtt_message_t* mqtt_msg_unsubscribe(mqtt_connection_t* connection, const char* topic, uint16_t* message_id);
+mqtt_message_t* mqtt_msg_subscribe_multiple(mqtt_connection_t* connection, const mqtt_topic_t* topics, int count, int* packed, uint16_t* message_id);
+mqtt_message_t* mqtt_msg_unsubscribe_multiple(mqtt_connection_t* connection, const mqtt_topic_t* topics, int count, int* packed, uint16_t* message_id);
 mqtt_message_t* mqtt_msg_pingreq(mqtt_connection_t* connection);
 mqtt_message_t* mqtt_msg_pingresp(mqtt_connection_t* connection);
 mqtt_message_t* mqtt_msg_disconnect(mqtt_connection_t* connection);
@@ -0,0 +1,109 @@
+#ifndef _MQTT_OUTBOX_H_
+#define _MQTT_OUTBOX_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "ringbuf.h"
+#include "mqtt_msg.h"
+
+/**
+ * Outbound packet queue.
+ *
+ * Each packet is stored in the ring as one record: a fixed header carrying
+ * the packet boundaries and metadata, followed by the encoded packet. Records
+ * are aligned for their header (4 bytes on the ESP32) and never wrap, so both
+ * the header and the packet can be used in place. The sending task claims the
+ * oldest record, writes it and releases it; a producer short of room may
+ * discard the oldest PUBLISH not being sent, in place if records ahead of it
+ * are.
+ *
+ * Any number of tasks may queue at once without a lock. Each takes its
+ * record with rb_claim and encodes into it; the record only becomes visible
+ * to the sending task once its state is set to OUTBOX_PENDING, so a slow
+ * producer holds back the records queued after its own until it commits.
+ * Whoever frees the record at the read index, the sending task or an
+ * evicting producer, first takes it over with a compare-and-swap on its
+ * state.
+ *
+ * Records go in one of two lanes, each its own ring. The sending task drains
+ * the urgent lane first, so acks queued there are not held up behind a
+ * backlog of bulk publishes. It may claim several records of a lane in a
+ * row with outbox_claim_next, to write them together.
+ *
+ * A record may also point at a payload left in the producer's buffer, to be
+ * sent right after the packet. The producer sleeps in outbox_wait_payload
+ * until the record is released or discarded.
+ */
+
+enum mqtt_outbox_lane
+{
+  OUTBOX_LANE_BULK = 0,
+  OUTBOX_LANE_URGENT,
+  OUTBOX_LANES
+};
+
+enum mqtt_outbox_state
+{
+  OUTBOX_FREE = 0,           /**< Not written yet, free ring bytes are zero */
+  OUTBOX_PENDING,
+  OUTBOX_CLAIMED,
+  OUTBOX_DISCARDED,          /**< Reserved but never queued, to be freed */
+  OUTBOX_FREEING,            /**< Being freed by whoever took it over */
+  OUTBOX_SKIPPED = RB_SKIPPED  /**< End of buffer too short for a record */
+};
+
+typedef struct mqtt_outbox_payload
+{
+  const uint8_t* data;
+  uint32_t length;
+  TaskHandle_t waiter;       /**< Task woken up once the record is done with */
+  volatile uint32_t done;
+  int result;                /**< 0 if sent, -1 if discarded */
+} mqtt_outbox_payload_t;
+
+typedef struct mqtt_outbox_record
+{
+  volatile uint32_t state;   /**< mqtt_outbox_state, changed with compare-and-swap */
+  uint16_t size;             /**< Ring bytes used by the record, header included */
+  uint16_t length;           /**< Packet length */
+  uint32_t timestamp;        /**< Tick count when the packet was queued */
+  uint16_t msg_id;           /**< Packet identifier, 0 if none */
+  uint8_t header;            /**< First byte of the packet: type, dup, QoS, retain */
+  uint8_t offset;            /**< Packet start within data */
+  mqtt_outbox_payload_t* payload; /**< Sent after the packet, NULL if none */
+  uint8_t data[];
+} mqtt_outbox_record_t;
+
+typedef struct mqtt_outbox
+{
+  RINGBUF lanes[OUTBOX_LANES];
+  SemaphoreHandle_t ready;   /**< Given whenever a record is queued in any lane */
+  volatile uint32_t count;   /**< Records queued */
+  volatile uint32_t woken;   /**< outbox_claim is to return NULL, see outbox_wake */
+} mqtt_outbox_t;
+
+static inline uint8_t* outbox_packet(mqtt_outbox_record_t* rec) { return rec->data + rec->offset; }
+static inline int outbox_type(mqtt_outbox_record_t* rec) { return (rec->header & 0xf0) >> 4; }
+static inline int outbox_qos(mqtt_outbox_record_t* rec) { return (rec->header & 0x06) >> 1; }
+
+int outbox_init(mqtt_outbox_t* ob, uint8_t* buf, int size, int urgent_size);
+void outbox_deinit(mqtt_outbox_t* ob);
+int outbox_max_length(mqtt_outbox_t* ob, int lane);
+uint8_t* outbox_reserve(mqtt_outbox_t* ob, int lane, int len, TickType_t ticks_to_wait);
+void outbox_commit(mqtt_outbox_t* ob, uint8_t* data, mqtt_message_t* msg, uint16_t msg_id,
+                   mqtt_outbox_payload_t* payload);
+int outbox_wait_payload(mqtt_outbox_payload_t* payload);
+mqtt_outbox_record_t* outbox_front(mqtt_outbox_t* ob, int lane);
+mqtt_outbox_record_t* outbox_claim(mqtt_outbox_t* ob, TickType_t ticks_to_wait);
+void outbox_wake(mqtt_outbox_t* ob);
+mqtt_outbox_record_t* outbox_next(mqtt_outbox_t* ob, mqtt_outbox_record_t* rec);
+mqtt_outbox_record_t* outbox_claim_next(mqtt_outbox_t* ob, mqtt_outbox_record_t* rec, int max_length,
+                                        TickType_t ticks_to_wait);
+void outbox_release(mqtt_outbox_t* ob, mqtt_outbox_record_t* rec);
+void outbox_unclaim(mqtt_outbox_t* ob);
+int outbox_evict(mqtt_outbox_t* ob, int lane, int max_qos, mqtt_outbox_record_t* evicted);
+void outbox_clear(mqtt_outbox_t* ob);
+
+#endif
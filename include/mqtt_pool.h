@@ -0,0 +1,51 @@
+#ifndef _MQTT_POOL_H_
+#define _MQTT_POOL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+/**
+ * Pool of receive buffers.
+ *
+ * The receiving task reads into one buffer of the pool at a time. A whole
+ * PUBLISH delivered from it may be kept by the application, which takes a
+ * reference with pool_retain and gives it back with pool_release; the
+ * receiving task then carries on in another free buffer instead of copying
+ * the payload out. References are counted with atomics, so a buffer may be
+ * released from any task.
+ *
+ * The pool itself is freed once pool_destroy has been called and every
+ * buffer is back, so the application may hold on to buffers past the end
+ * of the client.
+ */
+
+struct mqtt_pool;
+
+typedef struct mqtt_buffer
+{
+  struct mqtt_pool* pool;
+  volatile uint32_t refs;    /**< 0 while free */
+  uint8_t data[];
+} mqtt_buffer_t;
+
+typedef struct mqtt_pool
+{
+  SemaphoreHandle_t released;  /**< Given whenever a buffer goes back to the pool */
+  volatile uint32_t users;   /**< Buffers in use, plus one until pool_destroy */
+  int count;
+  int size;                  /**< Bytes of data in each buffer */
+  int stride;                /**< Bytes from one buffer to the next */
+  uint8_t buffers[];
+} mqtt_pool_t;
+
+static inline bool pool_shared(mqtt_buffer_t* buffer) { return __atomic_load_n(&buffer->refs, __ATOMIC_ACQUIRE) > 1; }
+
+mqtt_pool_t* pool_create(int count, int size);
+void pool_destroy(mqtt_pool_t* pool);
+mqtt_buffer_t* pool_get(mqtt_pool_t* pool, TickType_t ticks_to_wait);
+void pool_retain(mqtt_buffer_t* buffer);
+void pool_release(mqtt_buffer_t* buffer);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef _MQTT_STORE_H_
+#define _MQTT_STORE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mqtt_config.h"
+
+/**
+ * Persistent queue of QoS 1 and 2 publishes, kept until acked.
+ *
+ * Publishes are appended to numbered segment files under
+ * CONFIG_MQTT_STORE_PATH, on whatever file system is mounted there. Each
+ * record is a small header followed by the encoded PUBLISH. Records are
+ * read back in order, a batch at a time, as the in-flight window allows,
+ * and given a fresh packet identifier each time they go out. An ack clears
+ * the record's state byte in place, which flash can do without an erase,
+ * and a segment file is deleted once every record in it is acked.
+ *
+ * Appends are not flushed one by one: they reach the file system when the
+ * stream buffer fills, when they are read back to be sent, or on
+ * store_sync. Records appended since the last of these are lost if power
+ * is, and a failed flush gives up on them; store_sync tells how many.
+ *
+ * After a reboot the segments left are scanned and every record not acked
+ * is sent again. Appends are refused while all CONFIG_MQTT_STORE_MAX_SEGMENTS
+ * segments hold records not acked; segments past that many, e.g. after the
+ * option was lowered, are left on disk for a later run.
+ */
+
+typedef struct mqtt_store_segment
+{
+  uint32_t number;           /**< File name, in append order */
+  uint32_t size;             /**< Bytes written */
+  uint32_t live;             /**< Records not acked yet */
+} mqtt_store_segment_t;
+
+typedef struct mqtt_store_pending
+{
+  uint16_t msg_id;           /**< Identifier it went out with, 0 if it must go out again */
+  uint8_t used;
+  uint32_t number;           /**< Segment holding the record */
+  uint32_t offset;           /**< Record offset in the segment */
+} mqtt_store_pending_t;
+
+typedef struct mqtt_store
+{
+  SemaphoreHandle_t lock;
+  mqtt_store_segment_t segments[CONFIG_MQTT_STORE_MAX_SEGMENTS];
+  int first;                 /**< Oldest segment in segments, used as a ring */
+  int count;
+  uint32_t next_number;      /**< Segment to create next */
+  uint32_t read_number;      /**< Segment of the next record to send */
+  uint32_t read_offset;
+  FILE* write_file;          /**< Newest segment, appended to */
+  uint32_t synced_size;      /**< Bytes of the newest segment known to be written */
+  uint32_t unsynced;         /**< Records appended since */
+  uint32_t lost;             /**< Records given up on by failed writes, see store_sync */
+  FILE* read_file;           /**< Segment read_number, read in sequence */
+  uint32_t read_file_number;
+  uint8_t* read_buffer;
+  FILE* seek_file;           /**< Any segment, for acks and single records */
+  uint32_t seek_file_number;
+  mqtt_store_pending_t pending[CONFIG_MQTT_INFLIGHT_WINDOW];
+} mqtt_store_t;
+
+int store_init(mqtt_store_t* store);
+void store_deinit(mqtt_store_t* store);
+void store_lock(mqtt_store_t* store);
+void store_unlock(mqtt_store_t* store);
+#define STORE_FULL -2
+int store_append(mqtt_store_t* store, const uint8_t* packet, int length);
+int store_sync(mqtt_store_t* store);
+int store_lost(mqtt_store_t* store);
+int store_next_length(mqtt_store_t* store);
+int store_next(mqtt_store_t* store, uint8_t* buffer, int length, uint16_t msg_id);
+int store_ack(mqtt_store_t* store, uint16_t msg_id);
+void store_cancel(mqtt_store_t* store, uint16_t msg_id);
+
+#endif
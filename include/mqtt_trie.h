@@ -0,0 +1,57 @@
+#ifndef _MQTT_TRIE_H_
+#define _MQTT_TRIE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mqtt_msg.h"
+
+/**
+ * Subscriptions with a callback of their own, by topic filter.
+ *
+ * Filters are stored one level per node, with the + and # wildcards as
+ * children apart from the named levels. A topic is matched in one walk over
+ * its levels, following at each node the named child of the same level,
+ * the + child and the # child, so the cost grows with the depth of the
+ * topic and not with the number of subscriptions.
+ *
+ * Subscribing and unsubscribing may happen from any task while the
+ * receiving task matches: the lock is held only to copy the callbacks out,
+ * which may then subscribe or unsubscribe themselves.
+ */
+
+#define TRIE_MAX_MATCHES 8
+
+typedef struct mqtt_trie_node
+{
+  struct mqtt_trie_node* next;      /**< Sibling with another name */
+  struct mqtt_trie_node* children;  /**< Named levels below */
+  struct mqtt_trie_node* plus;      /**< + level below */
+  struct mqtt_trie_node* hash;      /**< # level below */
+  mqtt_message_callback callback;   /**< NULL if no filter ends here */
+  void* context;
+  uint16_t length;
+  char level[];
+} mqtt_trie_node_t;
+
+typedef struct mqtt_trie_match
+{
+  mqtt_message_callback callback;
+  void* context;
+} mqtt_trie_match_t;
+
+typedef struct mqtt_trie
+{
+  SemaphoreHandle_t lock;
+  mqtt_trie_node_t* root;    /**< Above the first level, never matched itself */
+} mqtt_trie_t;
+
+int trie_init(mqtt_trie_t* trie);
+void trie_deinit(mqtt_trie_t* trie);
+bool trie_filter_valid(const char* filter);
+int trie_set(mqtt_trie_t* trie, const char* filter, mqtt_message_callback callback, void* context);
+void trie_remove(mqtt_trie_t* trie, const char* filter);
+int trie_match(mqtt_trie_t* trie, const char* topic, int length, mqtt_trie_match_t* matches, int max);
+
+#endif
@@ -2,22 +2,40 @@
 #define _RING_BUF_H_
 
 #include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
+/**
+ * Multi-producer byte ring the outbox keeps its records in.
+ *
+ * Indexes run over [0, 2 * size) which lets a full ring be told apart from an
+ * empty one without sacrificing a slot.
+ *
+ * rb_claim/rb_release let several producers share the ring. rb_claim moves
+ * head with a compare-and-swap, so the consumer sees claimed bytes before
+ * they are written; it relies on free bytes being zero, which rb_release
+ * keeps so, and on each claimer marking its data as written. A skipped end
+ * of buffer starts with RB_SKIPPED. A producer that finds the ring full
+ * sleeps on space_sem, which releases give only while one does.
+ *
+ * rb_peek_at lets the consumer use the oldest data in place.
+ */
+#define RB_SKIPPED 0xffffffff   /**< First word of the end of buffer skipped by rb_claim */
 
 typedef struct{
   uint8_t* p_o;        /**< Original pointer */
-  uint8_t* volatile p_r;   /**< Read pointer */
-  uint8_t* volatile p_w;   /**< Write pointer */
-  volatile int32_t fill_cnt;  /**< Number of filled slots */
+  volatile uint32_t head;  /**< Write index, moved by rb_claim */
+  volatile uint32_t tail;  /**< Read index, moved by rb_release */
   int32_t size;       /**< Buffer size */
-  int32_t block_size;
+  volatile uint32_t waiters;    /**< Producers sleeping on space_sem */
+  SemaphoreHandle_t space_sem;  /**< Given after a release while a producer waits */
 }RINGBUF;
 
-int32_t rb_init(RINGBUF *r, uint8_t* buf, int32_t size, int32_t block_size);
-int32_t rb_put(RINGBUF *r, uint8_t* c);
-int32_t rb_get(RINGBUF *r, uint8_t* c);
-int32_t rb_available(RINGBUF *r);
-uint32_t rb_read(RINGBUF *r, uint8_t *buf, int len);
-uint32_t rb_write(RINGBUF *r, uint8_t *buf, int len);
+int32_t rb_init(RINGBUF *r, uint8_t* buf, int32_t size);
+void rb_deinit(RINGBUF *r);
+int32_t rb_fill(RINGBUF *r);
+uint8_t *rb_claim(RINGBUF *r, int32_t len, TickType_t ticks_to_wait);
+int32_t rb_peek_at(RINGBUF *r, uint32_t *pos, uint8_t **ptr);
+void rb_release(RINGBUF *r, int32_t len);
 
 #endif
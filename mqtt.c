@@ -11,6 +11,7 @@
 #include "freertos/queue.h"
 
 #include "esp_log.h"
+#include "esp_system.h"
 #include "lwip/sockets.h"
 #include "lwip/dns.h"
 #include "lwip/netdb.h"
@@ -19,136 +20,618 @@
 #include "mqtt.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
-static TaskHandle_t xMqttTask = NULL;
-static TaskHandle_t xMqttSendingTask = NULL;
+// MQTT 5 only allows unacked packets to be sent again on a new connection
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+#define MQTT_RETRANSMIT_TICKS 0
+#else
+#define MQTT_RETRANSMIT_TICKS (CONFIG_MQTT_RETRANSMIT_TIMEOUT * 1000 / portTICK_RATE_MS)
+#endif
+
+// Placeholder packet identifier of stored publishes, replaced when sent
+#define MQTT_STORE_MSG_ID 0xffff
+
+// Stack buffer for acks and pings: fixed header slack and a packet identifier
+#define MQTT_ACK_BUFFER_SIZE 8
+
+// Bytes a PUBLISH header may take once rewritten to use a topic alias
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+#define MQTT_ALIAS_SCRATCH_SIZE 16
+#else
+#define MQTT_ALIAS_SCRATCH_SIZE 0
+#endif
+
+#if defined(CONFIG_MQTT_STATS_ON)
+#include "xtensa/hal.h"
+#define MQTT_STATS_NOW() xthal_get_ccount()
+#define MQTT_STATS_ADD(client, field, n) ((client)->stats.field += (n))
+#else
+#define MQTT_STATS_NOW() 0
+#define MQTT_STATS_ADD(client, field, n)
+#endif
+
+/*
+ * Default resolve_cb: every address getaddrinfo gives, IPv4 and IPv6 alike.
+ * lwIP does not tell the record TTL, so they are kept for
+ * CONFIG_MQTT_DNS_TTL_S.
+ */
+static int mqtt_resolve(mqtt_client *client, const char *host, struct sockaddr_storage *addrs,
+                        int max, uint32_t *ttl_s)
+{
+    struct addrinfo hints, *res, *ai;
+    int count = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL)
+        return 0;
+    for (ai = res; ai != NULL && count < max; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(*addrs))
+            continue;
+        memset(&addrs[count], 0, sizeof(*addrs));
+        memcpy(&addrs[count++], ai->ai_addr, ai->ai_addrlen);
+    }
+    freeaddrinfo(res);
+    *ttl_s = CONFIG_MQTT_DNS_TTL_S;
+    return count;
+}
+
+static void mqtt_stats_enqueued(mqtt_client *client, uint32_t start, int len)
+{
+#if defined(CONFIG_MQTT_STATS_ON)
+    uint32_t cycles = MQTT_STATS_NOW() - start;
+
+    client->stats.queued++;
+    client->stats.queued_bytes += len;
+    client->stats.enqueue_cycles += cycles;
+    client->stats.enqueue_hist[31 - __builtin_clz(cycles | 1)]++;
+#endif
+}
+
+static bool mqtt_in_client_task(mqtt_client *client)
+{
+#if defined(CONFIG_MQTT_SINGLE_TASK)
+    return xTaskGetCurrentTaskHandle() == client->task;
+#else
+    return false;
+#endif
+}
 
-static bool terminate_mqtt = false;
+/*
+ * Get the client task out of select once a packet has been queued. Only the
+ * first producer since the task last looked sends a byte.
+ */
+static void mqtt_wakeup(mqtt_client *client)
+{
+#if defined(CONFIG_MQTT_SINGLE_TASK)
+    char byte = 0;
 
-static int resolve_dns(const char *host, struct sockaddr_in *ip) {
-    struct hostent *he;
-    struct in_addr **addr_list;
-    he = gethostbyname(host);
-    if (he == NULL) return 0;
-    addr_list = (struct in_addr **)he->h_addr_list;
-    if (addr_list[0] == NULL) return 0;
-    ip->sin_family = AF_INET;
-    memcpy(&ip->sin_addr, addr_list[0], sizeof(ip->sin_addr));
-    return 1;
+    if (mqtt_in_client_task(client))
+        return;
+    if (__atomic_exchange_n(&client->wakeup_pending, 1, __ATOMIC_ACQ_REL) == 0)
+        send(client->wakeup_tx, &byte, 1, MSG_DONTWAIT);
+#endif
 }
-static void mqtt_queue(mqtt_client *client)
+
+/*
+ * Tell watermark_cb when the send queue crosses high_watermark going up, or
+ * low_watermark going down.
+ */
+static void mqtt_watermark(mqtt_client *client)
 {
-    int msg_len;
-    while (rb_available(&client->send_rb) < client->mqtt_state.outbound_message->length) {
-        xQueueReceive(client->xSendingQueue, &msg_len, 1000 / portTICK_RATE_MS);
-        rb_read(&client->send_rb, client->mqtt_state.out_buffer, msg_len);
+    mqtt_settings *settings = client->settings;
+    uint32_t fill;
+
+    if (settings->watermark_cb == NULL || settings->high_watermark == 0)
+        return;
+    fill = rb_fill(&client->outbox.lanes[OUTBOX_LANE_BULK]);
+    if (fill >= settings->high_watermark) {
+        if (__atomic_exchange_n(&client->above_watermark, 1, __ATOMIC_ACQ_REL) == 0)
+            settings->watermark_cb(client, true);
+    } else if (fill <= settings->low_watermark) {
+        if (__atomic_exchange_n(&client->above_watermark, 0, __ATOMIC_ACQ_REL) == 1)
+            settings->watermark_cb(client, false);
     }
-    rb_write(&client->send_rb,
-             client->mqtt_state.outbound_message->data,
-             client->mqtt_state.outbound_message->length);
-    xQueueSend(client->xSendingQueue, &client->mqtt_state.outbound_message->length, 0);
 }
 
-static bool client_connect(mqtt_client *client)
+#if defined(CONFIG_MQTT_STORE_ON)
+/*
+ * Account for stored publishes a failed write gave up on. Called with the
+ * store locked.
+ */
+static int mqtt_store_lost(mqtt_client *client, int lost)
 {
-    struct sockaddr_in remote_ip;
+    if (lost > 0) {
+        mqtt_warn("Store write failed, %d publishes dropped", lost);
+        MQTT_STATS_ADD(client, dropped, lost);
+    }
+    return lost;
+}
+#endif
 
-    while (1) {
+/*
+ * Move stored publishes into the outbox, in order, while the in-flight
+ * window and the outbox have room.
+ */
+static void mqtt_store_pump(mqtt_client *client)
+{
+#if defined(CONFIG_MQTT_STORE_ON)
+    mqtt_message_t msg;
+    uint8_t *region;
+    uint16_t msg_id;
+    int length;
 
-        bzero(&remote_ip, sizeof(struct sockaddr_in));
-        remote_ip.sin_family = AF_INET;
-        remote_ip.sin_port = htons(client->settings->port);
+    store_lock(&client->store);
+    while ((length = store_next_length(&client->store)) > 0) {
+        msg_id = inflight_reserve(&client->inflight, 0);
+        if (msg_id == 0)
+            break;
+        region = outbox_reserve(&client->outbox, OUTBOX_LANE_BULK, length, 0);
+        if (region != NULL)
+            length = store_next(&client->store, region, length, msg_id);
+        if (region == NULL || length == 0) {
+            inflight_cancel(&client->inflight, msg_id);
+            break;
+        }
+        msg.data = region;
+        msg.length = length;
+        outbox_commit(&client->outbox, region, &msg, msg_id, NULL);
+        mqtt_wakeup(client);
+    }
+    mqtt_store_lost(client, store_lost(&client->store));
+    store_unlock(&client->store);
+    mqtt_watermark(client);
+#endif
+}
 
+/*
+ * A stored publish was acked, or its packet dropped from the outbox and
+ * due to go out again.
+ */
+static void mqtt_store_done(mqtt_client *client, uint16_t msg_id, bool acked)
+{
+#if defined(CONFIG_MQTT_STORE_ON)
+    store_lock(&client->store);
+    if (acked)
+        store_ack(&client->store, msg_id);
+    else
+        store_cancel(&client->store, msg_id);
+    store_unlock(&client->store);
+#endif
+}
 
-        //if host is not ip address, resolve it
-        if (inet_aton( client->settings->host, &(remote_ip.sin_addr)) == 0) {
-            mqtt_info("Resolve dns for domain: %s", client->settings->host);
+/*
+ * Ticks to wait for room under policy. The client task cannot wait for
+ * itself to make room.
+ */
+static TickType_t mqtt_overflow_wait(mqtt_client *client, mqtt_overflow_policy_t policy)
+{
+    if (policy != MQTT_OVERFLOW_BLOCK || mqtt_in_client_task(client))
+        return 0;
+    if (client->settings->overflow_timeout_ms == 0)
+        return 1000 / portTICK_RATE_MS;
+    return client->settings->overflow_timeout_ms / portTICK_RATE_MS;
+}
 
-            if (!resolve_dns(client->settings->host, &remote_ip)) {
-                vTaskDelay(1000 / portTICK_RATE_MS);
-                continue;
+/*
+ * Reserve a record for a packet in an outbox lane. An urgent packet the
+ * urgent lane has no room for goes in the bulk lane instead. When the bulk
+ * lane is full, policy says whether to wait for room, give up, or evict the
+ * oldest queued publishes.
+ */
+static mqtt_status_t mqtt_queue_reserve(mqtt_client *client, int lane, int len, mqtt_overflow_policy_t policy,
+                                        uint8_t **region)
+{
+    mqtt_outbox_record_t evicted;
+    bool waited = false;
+    int freed = 0, size;
+
+    if (lane == OUTBOX_LANE_URGENT) {
+        *region = outbox_reserve(&client->outbox, OUTBOX_LANE_URGENT, len, 0);
+        if (*region != NULL)
+            return MQTT_OK;
+        lane = OUTBOX_LANE_BULK;
+    }
+    if (len > outbox_max_length(&client->outbox, lane)) {
+        mqtt_warn("Message of %d bytes does not fit the send queue, dropping it", len);
+        MQTT_STATS_ADD(client, dropped, 1);
+        return MQTT_DROPPED;
+    }
+    *region = outbox_reserve(&client->outbox, lane, len, mqtt_overflow_wait(client, policy));
+    while (*region == NULL && policy == MQTT_OVERFLOW_DROP_OLDEST) {
+        // Publishes queued behind one being sent are discarded in place and
+        // their room comes once it is sent, so evict no more than needed
+        if (freed <= len &&
+            (size = outbox_evict(&client->outbox, lane, client->settings->overflow_drop_qos, &evicted)) > 0) {
+            freed += size;
+            mqtt_warn("Send queue full, evicted oldest message");
+            MQTT_STATS_ADD(client, evicted, 1);
+            if (outbox_qos(&evicted) > 0) {
+                inflight_cancel(&client->inflight, evicted.msg_id);
+                mqtt_store_done(client, evicted.msg_id, false);
             }
+            *region = outbox_reserve(&client->outbox, lane, len, 0);
+        } else if (!waited) {
+            // The oldest record is being sent, written or may not be
+            // evicted; give the sending task one chance to get past it
+            *region = outbox_reserve(&client->outbox, lane, len,
+                                     mqtt_overflow_wait(client, MQTT_OVERFLOW_BLOCK));
+            waited = true;
+        } else {
+            break;
         }
+    }
+    if (*region == NULL) {
+        mqtt_warn("Send queue full, refusing message of %d bytes", len);
+        MQTT_STATS_ADD(client, rejected, 1);
+        return MQTT_WOULD_BLOCK;
+    }
+    return MQTT_OK;
+}
 
+/*
+ * Reserve a fresh outbox record and point the caller's encoder at it, so the
+ * mqtt_msg_* builders write the packet in place; mqtt_queue_end queues it.
+ * Each producer has its own encoder, so any number may run at once.
+ */
+static mqtt_status_t mqtt_queue_begin(mqtt_client *client, int lane, int len, mqtt_connection_t *connection,
+                                      uint8_t **region)
+{
+    mqtt_status_t status = mqtt_queue_reserve(client, lane, len, client->settings->overflow_policy, region);
 
-#if defined(CONFIG_MQTT_SECURITY_ON)  // ENABLE MQTT OVER SSL
-        client->ctx = NULL;
-        client->ssl = NULL;
+    if (status == MQTT_OK)
+        mqtt_msg_init(connection, *region, len);
+    return status;
+}
 
-        client->ctx = SSL_CTX_new(TLSv1_2_client_method());
-        if (!client->ctx) {
-            mqtt_error("Failed to create SSL CTX");
-            goto failed1;
-        }
-#endif
+static mqtt_status_t mqtt_queue_end(mqtt_client *client, uint8_t *region, mqtt_message_t *msg, uint16_t msg_id,
+                                    mqtt_outbox_payload_t *payload)
+{
+    // A failed encode still hands the record back
+    outbox_commit(&client->outbox, region, msg, msg_id, payload);
+    if (msg->length == 0)
+        return MQTT_INVALID;
+    mqtt_wakeup(client);
+    mqtt_watermark(client);
+    return MQTT_OK;
+}
 
-        client->socket = socket(PF_INET, SOCK_STREAM, 0);
-        if (client->socket == -1) {
-            mqtt_error("Failed to create socket");
-            goto failed2;
+/*
+ * mqtt_queue_begin for a PUBLISH. QoS 1 and 2 also take an in-flight slot,
+ * waiting while the window is full as the overflow policy allows, and
+ * *msg_id is set to its packet identifier; it is 0 for QoS 0.
+ */
+static mqtt_status_t mqtt_publish_begin(mqtt_client *client, int lane, int len, int qos, uint16_t *msg_id,
+                                        mqtt_connection_t *connection, uint8_t **region)
+{
+    mqtt_status_t status;
+
+    *msg_id = 0;
+    if (qos > 0) {
+        *msg_id = inflight_reserve(&client->inflight,
+                                   mqtt_overflow_wait(client, client->settings->overflow_policy));
+        if (*msg_id == 0) {
+            mqtt_warn("In-flight window full, refusing publish");
+            MQTT_STATS_ADD(client, rejected, 1);
+            return MQTT_WOULD_BLOCK;
         }
+    }
+    status = mqtt_queue_begin(client, lane, len, connection, region);
+    if (status != MQTT_OK && *msg_id != 0)
+        inflight_cancel(&client->inflight, *msg_id);
+    return status;
+}
 
+static mqtt_status_t mqtt_publish_end(mqtt_client *client, uint8_t *region, mqtt_message_t *msg,
+                                      uint16_t msg_id, mqtt_outbox_payload_t *payload)
+{
+    mqtt_status_t status = mqtt_queue_end(client, region, msg, msg_id, payload);
 
+    if (status != MQTT_OK && msg_id != 0)
+        inflight_cancel(&client->inflight, msg_id);
+    return status;
+}
 
-        mqtt_info("Connecting to server %s:%d,%d",
-                  inet_ntoa((remote_ip.sin_addr)),
-                  client->settings->port,
-                  remote_ip.sin_port);
+/*
+ * Queue a copy of a packet encoded elsewhere. Acks and pings go in the
+ * urgent lane, with MQTT_OVERFLOW_BLOCK whatever the client's policy.
+ */
+static mqtt_status_t mqtt_queue(mqtt_client *client, int lane, mqtt_message_t *msg, uint16_t msg_id,
+                                mqtt_overflow_policy_t policy)
+{
+    mqtt_message_t queued = *msg;
+    uint32_t start = MQTT_STATS_NOW();
+    mqtt_status_t status;
+    uint8_t *region;
+
+    if (queued.length == 0)
+        return MQTT_INVALID;
+    status = mqtt_queue_reserve(client, lane, queued.length, policy, &region);
+    if (status != MQTT_OK)
+        return status;
+    memcpy(region, queued.data, queued.length);
+    queued.data = region;
+    outbox_commit(&client->outbox, region, &queued, msg_id, NULL);
+    mqtt_wakeup(client);
+    mqtt_watermark(client);
+    MQTT_STATS_ADD(client, copied_bytes, queued.length);
+    mqtt_stats_enqueued(client, start, queued.length);
+    return MQTT_OK;
+}
 
+/*
+ * Queue an ack or a ping response. Going on without it would leave the
+ * broker waiting, so a refused one is counted dropped and the caller gives
+ * up the connection instead: the broker sends again after the reconnect.
+ * Returns 0, or -1 if refused.
+ */
+static int mqtt_queue_ack(mqtt_client *client, mqtt_message_t *msg, uint16_t msg_id)
+{
+    if (mqtt_queue(client, OUTBOX_LANE_URGENT, msg, msg_id, MQTT_OVERFLOW_BLOCK) == MQTT_OK)
+        return 0;
+    mqtt_error("Cannot queue packet type %d, id: %d, closing the connection", mqtt_get_type(msg->data), msg_id);
+    MQTT_STATS_ADD(client, dropped, 1);
+    return -1;
+}
 
-        if (connect(client->socket, (struct sockaddr *)(&remote_ip), sizeof(struct sockaddr)) != 00) {
-            mqtt_error("Connect failed");
-            goto failed3;
-        }
+/*
+ * Remember a SUBSCRIBE or UNSUBSCRIBE until its ack comes back. When every
+ * slot is taken the oldest one is reused, and its ack goes unreported.
+ */
+static void mqtt_pending_subscribe_add(mqtt_client *client, int type, uint16_t msg_id,
+                                       int first, int count, int total)
+{
+    mqtt_state_t *state = &client->mqtt_state;
+    unsigned int slot = __atomic_fetch_add(&state->pending_subscribe_next, 1, __ATOMIC_RELAXED);
+    mqtt_pending_subscribe_t *pending = &state->pending_subscribe[slot % MQTT_MAX_PENDING_SUBSCRIBE];
+
+    pending->msg_id = 0;
+    pending->type = type;
+    pending->first = first;
+    pending->count = count;
+    pending->total = total;
+    __atomic_store_n(&pending->msg_id, msg_id, __ATOMIC_RELEASE);
+}
 
-#if defined(CONFIG_MQTT_SECURITY_ON)  // ENABLE MQTT OVER SSL
-        mqtt_info("Creating SSL object...");
-        client->ssl = SSL_new(client->ctx);
-        if (!client->ssl) {
-            mqtt_error("Unable to creat new SSL");
-            goto failed3;
+static bool mqtt_pending_subscribe_take(mqtt_client *client, int type, uint16_t msg_id,
+                                        mqtt_pending_subscribe_t *found)
+{
+    mqtt_pending_subscribe_t *pending;
+    int i;
+
+    for (i = 0; i < MQTT_MAX_PENDING_SUBSCRIBE; i++) {
+        pending = &client->mqtt_state.pending_subscribe[i];
+        if (__atomic_load_n(&pending->msg_id, __ATOMIC_ACQUIRE) == msg_id && pending->type == type) {
+            *found = *pending;
+            pending->msg_id = 0;
+            return true;
         }
+    }
+    return false;
+}
 
-        if (!SSL_set_fd(client->ssl, client->socket)) {
-            mqtt_error("SSL set_fd failed");
-            goto failed3;
-        }
+/*
+ * Sleep until the next attempt at a connection is due, or the client is
+ * stopped.
+ */
+static void mqtt_backoff_wait(mqtt_client *client)
+{
+    mqtt_backoff_t *backoff = &client->backoff;
+    uint32_t random;
+    int32_t left;
+
+    random = client->settings->random_cb != NULL ? client->settings->random_cb(client) : esp_random();
+    if (backoff_next(backoff, xTaskGetTickCount(), random) > 0)
+        mqtt_info("Retrying in %d ms, %d failures so far", backoff->delay_ms, backoff->failures - 1);
+    while (!client->terminate && (left = (int32_t)(backoff->retry_at - xTaskGetTickCount())) > 0)
+        vTaskDelay(MIN(left, 100 / portTICK_RATE_MS));
+}
 
-        mqtt_info("Start SSL connect..");
-        if (!SSL_connect(client->ssl)) {
-            mqtt_error("SSL Connect FAILED");
-            goto failed4;
-        }
+/*
+ * Addresses of the server, cached while their TTL lasts, otherwise asked
+ * of resolve_cb. Returns how many there are.
+ */
+static int mqtt_resolve_host(mqtt_client *client)
+{
+    const char *host = client->settings->host;
+    uint32_t ttl_s = 0;
+    int count;
+
+    count = dns_get(&client->dns, host);
+    if (count > 0)
+        return count;
+
+    mqtt_info("Resolve dns for domain: %s", host);
+    count = client->settings->resolve_cb(client, host, client->dns.addrs, CONFIG_MQTT_DNS_MAX_ADDRESSES, &ttl_s);
+    if (count <= 0) {
+        mqtt_error("Cannot resolve %s", host);
+        return 0;
+    }
+    dns_set(&client->dns, host, count, ttl_s);
+    return client->dns.count;
+}
+
+/*
+ * Set the port of a resolved address. Returns the length of the address,
+ * 0 for a family sockets cannot connect to.
+ */
+static socklen_t mqtt_address_port(struct sockaddr_storage *addr, uint16_t port)
+{
+    if (addr->ss_family == AF_INET) {
+        ((struct sockaddr_in *)addr)->sin_port = htons(port);
+        return sizeof(struct sockaddr_in);
+    }
+#if LWIP_IPV6
+    if (addr->ss_family == AF_INET6) {
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+        return sizeof(struct sockaddr_in6);
+    }
 #endif
-        mqtt_info("Connected!");
+    return 0;
+}
+
+static const char *mqtt_address_name(const struct sockaddr_storage *addr, char *name, int length)
+{
+    const void *ip = &((const struct sockaddr_in *)addr)->sin_addr;
 
-        return true;
+#if LWIP_IPV6
+    if (addr->ss_family == AF_INET6)
+        ip = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+#endif
+    if (inet_ntop(addr->ss_family, ip, name, length) == NULL)
+        return "?";
+    return name;
+}
 
-        //failed5:
-        //   SSL_shutdown(client->ssl);
+/*
+ * Connect without waiting more than timeout_ms for the server to answer, so
+ * that a dead address does not hold up the next one. Returns 0 once
+ * connected, -1 otherwise with errno telling why.
+ */
+static int mqtt_connect_timeout(int sock, const struct sockaddr *addr, socklen_t length, int timeout_ms)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    socklen_t error_length = sizeof(int);
+    struct timeval tv;
+    fd_set writeset;
+    int error = 0;
+
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    if (connect(sock, addr, length) != 0) {
+        if (errno != EINPROGRESS)
+            return -1;
+        FD_ZERO(&writeset);
+        FD_SET(sock, &writeset);
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        if (select(sock + 1, NULL, &writeset, NULL, &tv) <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0 || error != 0) {
+            errno = error;
+            return -1;
+        }
+    }
+    fcntl(sock, F_SETFL, flags);
+    return 0;
+}
 
 #if defined(CONFIG_MQTT_SECURITY_ON)
-        failed4:
-          SSL_free(client->ssl);
-          client->ssl = NULL;
+static void mqtt_forget_session(mqtt_client *client)
+{
+    if (client->session != NULL) {
+        SSL_SESSION_free(client->session);
+        client->session = NULL;
+    }
+}
 #endif
 
-        failed3:
-          close(client->socket);
-          client->socket = -1;
+/*
+ * Default connect_cb: try the server addresses in turn, the one that worked
+ * last time first, until one takes the connection. Only gives up when the
+ * client is stopped.
+ */
+static bool client_connect(mqtt_client *client)
+{
+    struct sockaddr_storage *addr;
+    socklen_t addr_length;
+    char name[48];
+    int count, i;
+
+    while (!client->terminate) {
+        count = mqtt_resolve_host(client);
+        for (i = 0; i < count && !client->terminate; i++) {
+            addr = dns_address(&client->dns, i);
+            addr_length = mqtt_address_port(addr, client->settings->port);
+            if (addr_length == 0)
+                continue;
 
-        failed2:
-#if defined(CONFIG_MQTT_SECURITY_ON)
-          SSL_CTX_free(client->ctx);
+#if defined(CONFIG_MQTT_SECURITY_ON)  // ENABLE MQTT OVER SSL
+            // Kept from one connection to the next, see mqtt_destroy
+            if (client->ctx == NULL)
+                client->ctx = SSL_CTX_new(TLSv1_2_client_method());
+            if (!client->ctx) {
+                mqtt_error("Failed to create SSL CTX");
+                goto failed2;
+            }
+#endif
+
+            client->socket = socket(addr->ss_family, SOCK_STREAM, 0);
+            if (client->socket == -1) {
+                mqtt_error("Failed to create socket");
+                goto failed2;
+            }
+
+            mqtt_info("Connecting to server %s:%d, address %d of %d",
+                      mqtt_address_name(addr, name, sizeof(name)),
+                      client->settings->port, i + 1, count);
+
+            if (mqtt_connect_timeout(client->socket, (struct sockaddr *)addr, addr_length,
+                                     CONFIG_MQTT_CONNECT_TIMEOUT_MS) != 0) {
+                mqtt_error("Connect failed: %d", errno);
+                goto failed3;
+            }
+
+#if defined(CONFIG_MQTT_SECURITY_ON)  // ENABLE MQTT OVER SSL
+            mqtt_info("Creating SSL object...");
+            client->ssl = SSL_new(client->ctx);
+            if (!client->ssl) {
+                mqtt_error("Unable to creat new SSL");
+                goto failed3;
+            }
 
-        failed1:
-          client->ctx = NULL;
+            if (!SSL_set_fd(client->ssl, client->socket)) {
+                mqtt_error("SSL set_fd failed");
+                goto failed3;
+            }
+
+            // Resuming the last session spares most of the handshake
+            if (client->session != NULL)
+                SSL_set_session(client->ssl, client->session);
+
+            mqtt_info("Start SSL connect..");
+            if (SSL_connect(client->ssl) <= 0) {
+                mqtt_error("SSL Connect FAILED");
+                mqtt_forget_session(client);
+                goto failed4;
+            }
+            mqtt_info("SSL session %s", SSL_session_reused(client->ssl) ? "resumed" : "new");
+            if (!SSL_session_reused(client->ssl)) {
+                mqtt_forget_session(client);
+                client->session = SSL_get1_session(client->ssl);
+            }
 #endif
-         vTaskDelay(1000 / portTICK_RATE_MS);
+            mqtt_info("Connected!");
+            dns_worked(&client->dns, i);
 
-     }
-}
+            return true;
+
+            //failed5:
+            //   SSL_shutdown(client->ssl);
+
+#if defined(CONFIG_MQTT_SECURITY_ON)
+            failed4:
+              SSL_free(client->ssl);
+              client->ssl = NULL;
+#endif
 
+            failed3:
+              close(client->socket);
+              client->socket = -1;
+
+            failed2:
+              mqtt_warn("Server address %d of %d unusable", i + 1, count);
+        }
+
+        // No address took the connection, they may have changed
+        dns_forget(&client->dns);
+        mqtt_backoff_wait(client);
+    }
+    return false;
+}
 
 // Close client socket
 // including SSL objects if CNFIG_MQTT_SECURITY_ON is enabled
@@ -171,28 +654,25 @@ void closeclient(mqtt_client *client)
 	  client->ssl = NULL;
 	}
 
-	if (client->ctx != NULL)
-	{
-	  SSL_CTX_free(client->ctx);
-	  client->ctx = NULL;
-	}
 #endif
 
 }
 
+static void mqtt_set_timeout(mqtt_client *client, int optname, int timeout_ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(client->socket, SOL_SOCKET, optname, &tv, sizeof(tv));
+}
+
 int mqtt_read(mqtt_client *client, void *buffer, int len, int timeout_ms)
 {
     int result;
-    struct timeval tv;
-    if (timeout_ms > 0) {
-        tv.tv_sec = 0;
-        tv.tv_usec = timeout_ms * 1000;
-        while (tv.tv_usec > 1000 * 1000) {
-            tv.tv_usec -= 1000 * 1000;
-            tv.tv_sec++;
-        }
-        setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    }
+
+    if (timeout_ms > 0)
+        mqtt_set_timeout(client, SO_RCVTIMEO, timeout_ms);
 
 #if defined(CONFIG_MQTT_SECURITY_ON)
     result = SSL_read(client->ssl, buffer, len);
@@ -200,11 +680,8 @@ int mqtt_read(mqtt_client *client, void *buffer, int len, int timeout_ms)
     result = read(client->socket, buffer, len);
 #endif
 
-    if (timeout_ms > 0) {
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
-        setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    }
+    if (timeout_ms > 0)
+        mqtt_set_timeout(client, SO_RCVTIMEO, 0);
 
     return result;
 }
@@ -212,16 +689,9 @@ int mqtt_read(mqtt_client *client, void *buffer, int len, int timeout_ms)
 int mqtt_write(mqtt_client *client, const void *buffer, int len, int timeout_ms)
 {
     int result;
-    struct timeval tv;
-    if (timeout_ms > 0) {
-        tv.tv_sec = 0;
-        tv.tv_usec = timeout_ms * 1000;
-        while (tv.tv_usec > 1000 * 1000) {
-            tv.tv_usec -= 1000 * 1000;
-            tv.tv_sec++;
-        }
-        setsockopt(client->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-    }
+
+    if (timeout_ms > 0)
+        mqtt_set_timeout(client, SO_SNDTIMEO, timeout_ms);
 
 #if defined(CONFIG_MQTT_SECURITY_ON)
     result = SSL_write(client->ssl, buffer, len);
@@ -229,15 +699,375 @@ int mqtt_write(mqtt_client *client, const void *buffer, int len, int timeout_ms)
     result = write(client->socket, buffer, len);
 #endif
 
-    if (timeout_ms > 0) {
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
-        setsockopt(client->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (timeout_ms > 0)
+        mqtt_set_timeout(client, SO_SNDTIMEO, 0);
+
+    return result;
+}
+
+/*
+ * Write several buffers with one call. Plain sockets use writev with no
+ * staging copy. Over SSL each SSL_write makes at least one TLS record, so
+ * segments that fit in out_buffer together are copied there back to back
+ * for a single SSL_write. Larger ones, e.g. an external payload, go to
+ * SSL_write in turn, stopping at the first short write; the header then
+ * costs a record of its own, small next to the payload.
+ */
+int mqtt_writev(mqtt_client *client, const mqtt_segment_t *segments, int count, int timeout_ms)
+{
+    int result;
+#if defined(CONFIG_MQTT_SECURITY_ON)
+    uint8_t *staging = client->mqtt_state.out_buffer;
+    int length = 0, i, n;
+#else
+    struct iovec iov[MQTT_MAX_SEGMENTS];
+    int i;
+#endif
+
+    if (timeout_ms > 0)
+        mqtt_set_timeout(client, SO_SNDTIMEO, timeout_ms);
+
+#if defined(CONFIG_MQTT_SECURITY_ON)
+    for (i = 0; i < count; i++)
+        length += segments[i].len;
+    if (count > 1 && length <= client->mqtt_state.out_buffer_length) {
+        for (i = 0, length = 0; i < count; i++) {
+            memcpy(staging + length, segments[i].data, segments[i].len);
+            length += segments[i].len;
+        }
+        MQTT_STATS_ADD(client, copied_bytes, length);
+        result = SSL_write(client->ssl, staging, length);
+    } else {
+        result = 0;
+        for (i = 0; i < count; i++) {
+            n = SSL_write(client->ssl, segments[i].data, segments[i].len);
+            if (n <= 0) {
+                if (result == 0)
+                    result = n;
+                break;
+            }
+            result += n;
+            if (n < segments[i].len)
+                break;
+        }
     }
+#else
+    count = MIN(count, MQTT_MAX_SEGMENTS);
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = (void *)segments[i].data;
+        iov[i].iov_len = segments[i].len;
+    }
+    result = writev(client->socket, iov, count);
+#endif
+
+    if (timeout_ms > 0)
+        mqtt_set_timeout(client, SO_SNDTIMEO, 0);
 
     return result;
 }
 
+/*
+ * Write every segment, picking up after short writes. Without a vectored
+ * callback each segment goes through write_cb.
+ */
+static int mqtt_send_segments(mqtt_client *client, mqtt_segment_t *segments, int count, int timeout_ms)
+{
+    int send_len;
+
+    while (count > 0) {
+        if (segments->len == 0) {
+            segments++;
+            count--;
+            continue;
+        }
+        mqtt_info("Sending...%d bytes", segments->len);
+        if (client->settings->writev_cb)
+            send_len = client->settings->writev_cb(client, segments, count, timeout_ms);
+        else
+            send_len = client->settings->write_cb(client, segments->data, segments->len, timeout_ms);
+        if (send_len <= 0) {
+            mqtt_info("Write error: %d", errno);
+            return -1;
+        }
+
+        MQTT_STATS_ADD(client, writes, 1);
+        MQTT_STATS_ADD(client, sent_bytes, send_len);
+        while (count > 0 && send_len >= segments->len) {
+            send_len -= segments->len;
+            segments++;
+            count--;
+        }
+        if (count > 0) {
+            segments->data = (const uint8_t *)segments->data + send_len;
+            segments->len -= send_len;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Carry on reading in a fresh pool buffer, taking along the bytes not
+ * handled yet, as the application kept the current one. Waits for the
+ * application to release a buffer if all are kept. Returns 0, or -1 if the
+ * client is stopped meanwhile.
+ */
+static int mqtt_in_buffer_switch(mqtt_client *client)
+{
+    mqtt_state_t *state = &client->mqtt_state;
+    mqtt_buffer_t *fresh;
+
+    while ((fresh = pool_get(state->in_pool, 1000 / portTICK_RATE_MS)) == NULL) {
+        mqtt_warn("Every receive buffer is kept by the application, waiting");
+        if (client->terminate)
+            return -1;
+    }
+    memcpy(fresh->data, state->in_buffer + state->in_offset, state->in_length);
+    pool_release(state->in_current);
+    state->in_current = fresh;
+    state->in_buffer = fresh->data;
+    state->in_offset = 0;
+    return 0;
+}
+
+/*
+ * Let the rest of a packet too large for in_buffer be read over it, the
+ * bytes not handled yet all being part of the packet and dealt with.
+ */
+static int mqtt_in_buffer_reuse(mqtt_client *client)
+{
+    mqtt_state_t *state = &client->mqtt_state;
+
+    state->in_offset = 0;
+    state->in_length = 0;
+    if (pool_shared(state->in_current))
+        return mqtt_in_buffer_switch(client);
+    return 0;
+}
+
+static void mqtt_in_buffer_free(mqtt_client *client)
+{
+    pool_release(client->mqtt_state.in_current);
+    pool_destroy(client->mqtt_state.in_pool);
+}
+
+/*
+ * Read more of the stream into in_buffer, after the in_length bytes not
+ * handled yet, which are first moved to its start, or to a fresh buffer if
+ * the application kept packets before them. Returns what read_cb returned.
+ */
+static int mqtt_read_more(mqtt_client *client, int timeout_ms)
+{
+    mqtt_state_t *state = &client->mqtt_state;
+    int read_len;
+
+    if (pool_shared(state->in_current)) {
+        if (mqtt_in_buffer_switch(client) != 0)
+            return -1;
+    } else if (state->in_offset > 0) {
+        memmove(state->in_buffer, state->in_buffer + state->in_offset, state->in_length);
+        state->in_offset = 0;
+    }
+    read_len = client->settings->read_cb(client, state->in_buffer + state->in_length,
+                                         state->in_buffer_length - state->in_length, timeout_ms);
+    if (read_len > 0)
+        state->in_length += read_len;
+    return read_len;
+}
+
+/*
+ * Read until in_buffer holds the next packet, or its headers if it does not
+ * fit, a PUBLISH then being delivered in chunks. Bytes already read are used
+ * first, so a read may bring in several packets and the tail of one is kept
+ * for the next call. With once, read_cb is called at most once, for what
+ * select reported, and the bytes read are left in in_buffer if the packet
+ * is not in yet. Returns 0, 1 if it is not, or -1 on a read error or a
+ * malformed packet.
+ */
+static int mqtt_read_packet(mqtt_client *client, mqtt_parser_t *parser, int timeout_ms, bool once)
+{
+    mqtt_state_t *state = &client->mqtt_state;
+    mqtt_packet_t *packet = &parser->packet;
+    int read_len, need;
+    bool read = false;
+
+    // Read until the packet headers are in, resuming the decode each time
+    mqtt_parser_init(parser);
+    while ((need = mqtt_parse(parser, state->in_buffer + state->in_offset, state->in_length)) > 0) {
+        if (state->in_length + need > state->in_buffer_length) {
+            mqtt_error("Packet headers larger than the receive buffer");
+            return -1;
+        }
+        if (once && read)
+            return 1;
+        read_len = mqtt_read_more(client, timeout_ms);
+        read = true;
+
+        mqtt_info("Read len %d", read_len);
+        if (read_len <= 0) {
+            // ECONNRESET for example
+            mqtt_info("=Read error %d", errno);
+            return -1;
+        }
+    }
+    if (need < 0) {
+        mqtt_error("Malformed packet, type %d", packet->type);
+        return -1;
+    }
+
+    // Read the packet whole if it fits, so that a PUBLISH is delivered in one
+    // piece the application may keep
+    while ((uint32_t)state->in_length < packet->total_length &&
+           packet->total_length <= (uint32_t)state->in_buffer_length) {
+        if (once && read)
+            return 1;
+        read_len = mqtt_read_more(client, timeout_ms);
+        read = true;
+        if (read_len <= 0) {
+            mqtt_info("=Read error %d", errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Whether in_buffer holds the next packet whole, or as much of it as can
+ * be handled without reading.
+ */
+static bool mqtt_packet_buffered(mqtt_client *client)
+{
+    mqtt_state_t *state = &client->mqtt_state;
+    mqtt_parser_t parser;
+
+    mqtt_parser_init(&parser);
+    if (mqtt_parse(&parser, state->in_buffer + state->in_offset, state->in_length) != 0)
+        return false;
+    return parser.packet.total_length <= (uint32_t)state->in_length ||
+           parser.packet.total_length > (uint32_t)state->in_buffer_length;
+}
+
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+/*
+ * Start the connection with empty topic alias tables, allowing as many
+ * outbound aliases as the CONNACK properties say the server accepts.
+ */
+static bool mqtt_connack_properties(mqtt_client *client, const uint8_t *buffer, const mqtt_packet_t *packet)
+{
+    mqtt_property_t property;
+    const uint8_t *properties;
+    uint32_t pos = 0;
+    int alias_max = 0;
+    int receive_max = 0;
+
+    if (packet->properties_offset + packet->properties_length > packet->total_length ||
+        packet->total_length > (uint32_t)client->mqtt_state.in_length)
+        return false;
+    properties = buffer + packet->properties_offset;
+    while (mqtt_property_next(properties, packet->properties_length, &pos, &property) > 0) {
+        if (property.id == MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM)
+            alias_max = property.value;
+        else if (property.id == MQTT_PROPERTY_RECEIVE_MAXIMUM)
+            receive_max = property.value;
+    }
+    inflight_set_window(&client->inflight, receive_max);
+    mqtt_info("Server accepts %d topic aliases", alias_max);
+    alias_reset(&client->mqtt_state.tx_alias, alias_max);
+    alias_reset(&client->mqtt_state.rx_alias, CONFIG_MQTT_MAX_TOPIC_ALIAS);
+    return true;
+}
+
+/*
+ * Rewrite a queued PUBLISH to use a topic alias, as segments pointing into
+ * the record and into scratch (MQTT_ALIAS_SCRATCH_SIZE bytes). The first packet on a topic
+ * carries the topic and its new alias, the next ones an empty topic and the
+ * alias. Returns the number of segments, 0 to send the record as it is.
+ */
+static int mqtt_alias_segments(mqtt_client *client, mqtt_outbox_record_t *rec,
+                               mqtt_segment_t *segments, uint8_t *scratch)
+{
+    mqtt_alias_table_t *table = &client->mqtt_state.tx_alias;
+    mqtt_parser_t parser;
+    mqtt_packet_t *packet = &parser.packet;
+    uint8_t *msg = outbox_packet(rec);
+    uint8_t *tail;
+    uint8_t properties_length[4];
+    uint32_t length_size, remaining;
+    uint16_t alias;
+    bool assigned = false;
+    int header_size, properties_length_size, n = 0;
+
+    if (table->max == 0 || outbox_type(rec) != MQTT_MSG_TYPE_PUBLISH)
+        return 0;
+    mqtt_parser_init(&parser);
+    if (mqtt_parse(&parser, msg, rec->length) != 0 || packet->properties_offset == 0 ||
+        packet->topic_length == 0 || packet->topic_alias != 0)
+        return 0;
+
+    alias = alias_find(table, packet->topic, packet->topic_length);
+    if (alias == 0) {
+        alias = alias_assign(table, packet->topic, packet->topic_length);
+        assigned = alias != 0;
+    }
+    if (alias == 0)
+        return 0;
+
+    // Bytes taken by the property length, between the topic or id and the properties
+    length_size = packet->properties_offset - packet->header_length - 2 - packet->topic_length -
+                  (mqtt_packet_qos(packet) > 0 ? 2 : 0);
+    properties_length_size = mqtt_msg_encode_length(properties_length, packet->properties_length + 3);
+    remaining = packet->remaining_length - (assigned ? 0 : packet->topic_length) -
+                length_size + properties_length_size + 3;
+
+    scratch[0] = msg[0];
+    header_size = 1 + mqtt_msg_encode_length(scratch + 1, remaining);
+    tail = scratch + header_size;
+    if (!assigned) {
+        *tail++ = 0;
+        *tail++ = 0;
+    }
+    if (mqtt_packet_qos(packet) > 0) {
+        *tail++ = packet->msg_id >> 8;
+        *tail++ = packet->msg_id & 0xff;
+    }
+    memcpy(tail, properties_length, properties_length_size);
+    tail += properties_length_size;
+    *tail++ = MQTT_PROPERTY_TOPIC_ALIAS;
+    *tail++ = alias >> 8;
+    *tail++ = alias & 0xff;
+
+    if (assigned) {
+        segments[n].data = scratch;
+        segments[n++].len = header_size;
+        segments[n].data = msg + packet->header_length;
+        segments[n++].len = 2 + packet->topic_length;
+        segments[n].data = scratch + header_size;
+        segments[n++].len = tail - scratch - header_size;
+    } else {
+        segments[n].data = scratch;
+        segments[n++].len = tail - scratch;
+    }
+    segments[n].data = msg + packet->properties_offset;
+    segments[n++].len = rec->length - packet->properties_offset;
+    return n;
+}
+
+/*
+ * Swap a topic alias set by the server for its topic, remembering the
+ * topics the server introduces with an alias.
+ */
+static int mqtt_resolve_alias(mqtt_client *client, mqtt_packet_t *packet)
+{
+    mqtt_alias_table_t *table = &client->mqtt_state.rx_alias;
+
+    if (packet->topic_alias == 0)
+        return 0;
+    if (packet->topic_length > 0)
+        return alias_set(table, packet->topic_alias, packet->topic, packet->topic_length);
+    packet->topic = alias_get(table, packet->topic_alias, &packet->topic_length);
+    return packet->topic == NULL ? -1 : 0;
+}
+#endif
+
 /*
  * mqtt_connect
  * input - client
@@ -245,24 +1075,24 @@ int mqtt_write(mqtt_client *client, const void *buffer, int len, int timeout_ms)
  */
 static bool mqtt_connect(mqtt_client *client)
 {
-    int write_len, read_len, connect_rsp_code;
-
-
-    mqtt_msg_init(&client->mqtt_state.mqtt_connection,
+    mqtt_state_t *state = &client->mqtt_state;
+    int write_len, connect_rsp_code;
+    mqtt_connection_t connection;
+    mqtt_message_t *msg;
+    mqtt_parser_t parser;
+    mqtt_packet_t *packet = &parser.packet;
+    uint8_t *buffer;
+
+
+    // out_buffer is only used here, by the client task, before any producer
+    // can queue for this connection
+    mqtt_msg_init(&connection,
                   client->mqtt_state.out_buffer,
                   client->mqtt_state.out_buffer_length);
-    client->mqtt_state.outbound_message = mqtt_msg_connect(&client->mqtt_state.mqtt_connection,
-                                          client->mqtt_state.connect_info);
-    client->mqtt_state.pending_msg_type = mqtt_get_type(client->mqtt_state.outbound_message->data);
-    client->mqtt_state.pending_msg_id = mqtt_get_id(client->mqtt_state.outbound_message->data,
-                                        client->mqtt_state.outbound_message->length);
-    mqtt_info("Sending MQTT CONNECT message, type: %d, id: %04X",
-              client->mqtt_state.pending_msg_type,
-              client->mqtt_state.pending_msg_id);
-
-    write_len = client->settings->write_cb(client,
-                      client->mqtt_state.outbound_message->data,
-                      client->mqtt_state.outbound_message->length, 0);
+    msg = mqtt_msg_connect(&connection, client->mqtt_state.connect_info);
+    mqtt_info("Sending MQTT CONNECT message, %d bytes", msg->length);
+
+    write_len = client->settings->write_cb(client, msg->data, msg->length, 0);
     if(write_len < 0) {
         mqtt_error("Writing failed: %d", errno);
         return false;
@@ -270,19 +1100,33 @@ static bool mqtt_connect(mqtt_client *client)
 
     mqtt_info("Reading MQTT CONNECT response message");
 
-    read_len = client->settings->read_cb(client, client->mqtt_state.in_buffer, CONFIG_MQTT_BUFFER_SIZE_BYTE, 10 * 1000);
-
-    if (read_len < 0) {
+    // Whatever the server sends right after the CONNACK is kept in
+    // in_buffer for the receive loop
+    state->in_offset = 0;
+    state->in_length = 0;
+    if (mqtt_read_packet(client, &parser, 10 * 1000, false) != 0 ||
+        packet->total_length > (uint32_t)state->in_length || packet->remaining_length < 2) {
         mqtt_error("Error network response");
         return false;
     }
-    if (mqtt_get_type(client->mqtt_state.in_buffer) != MQTT_MSG_TYPE_CONNACK) {
-        mqtt_error("Invalid MSG_TYPE response: %d, read_len: %d", mqtt_get_type(client->mqtt_state.in_buffer), read_len);
+    if (packet->type != MQTT_MSG_TYPE_CONNACK) {
+        mqtt_error("Invalid MSG_TYPE response: %d, read_len: %d", packet->type, state->in_length);
         return false;
     }
-    connect_rsp_code = mqtt_get_connect_return_code(client->mqtt_state.in_buffer);
+    buffer = state->in_buffer + state->in_offset;
+    connect_rsp_code = buffer[packet->header_length + 1];
     switch (connect_rsp_code) {
         case CONNECTION_ACCEPTED:
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+            if (!mqtt_connack_properties(client, buffer, packet)) {
+                mqtt_error("Invalid CONNACK properties");
+                return false;
+            }
+#endif
+            state->in_offset += packet->total_length;
+            state->in_length -= packet->total_length;
+            if (state->in_length > 0)
+                mqtt_info("%d bytes received after CONNACK", state->in_length);
             mqtt_info("Connected");
             return true;
         case CONNECTION_REFUSE_PROTOCOL:
@@ -304,277 +1148,610 @@ static bool mqtt_connect(mqtt_client *client)
     return false;
 }
 
+static bool mqtt_record_tracked(mqtt_outbox_record_t *rec)
+{
+    return outbox_type(rec) == MQTT_MSG_TYPE_PUBLISH && outbox_qos(rec) > 0;
+}
+
+/*
+ * Fill in the segments a claimed record is written from, pointing into the
+ * record, scratch (MQTT_ALIAS_SCRATCH_SIZE bytes) and any external payload,
+ * and start tracking it as sent. Returns the number of segments.
+ */
+static int mqtt_record_segments(mqtt_client *client, mqtt_outbox_record_t *rec,
+                                mqtt_segment_t *segments, uint8_t *scratch)
+{
+    int count = 0;
+
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+    count = mqtt_alias_segments(client, rec, segments, scratch);
+#endif
+    if (count == 0) {
+        segments[0].data = outbox_packet(rec);
+        segments[0].len = rec->length;
+        count = 1;
+    }
+    if (rec->payload != NULL) {
+        segments[count].data = rec->payload->data;
+        segments[count].len = rec->payload->length;
+        count++;
+    }
+    mqtt_info("Sending packet type %d, id: %d", outbox_type(rec), rec->msg_id);
+    // Keep the publish for writing again until acked; a payload left with
+    // the producer cannot be kept, so that publish is dropped if its ack is
+    // late or the connection is lost
+    if (mqtt_record_tracked(rec))
+        inflight_sent(&client->inflight, rec->msg_id, outbox_qos(rec),
+                      rec->payload == NULL ? outbox_packet(rec) : NULL, rec->length);
+    return count;
+}
+
+static int mqtt_segments_length(const mqtt_segment_t *segments, int count)
+{
+    int length = 0;
+
+    while (count-- > 0)
+        length += segments[count].len;
+    return length;
+}
+
+/*
+ * Write a claimed record, its external payload included, then release it.
+ * While there is room in the CONFIG_MQTT_WRITE_BATCH_BYTE budget, the
+ * records queued right behind it in its lane are claimed too, waiting up to
+ * CONFIG_MQTT_WRITE_FLUSH_MS for more bulk ones, and the lot is copied back
+ * to back into out_buffer for a single write. A record going out alone is
+ * written in place. On a write error every claimed record is handed back
+ * for the next connection.
+ */
+static int mqtt_send_record(mqtt_client *client, mqtt_outbox_record_t *rec)
+{
+    mqtt_outbox_t *outbox = &client->outbox;
+    mqtt_outbox_record_t *first = rec;
+    mqtt_outbox_record_t *next;
+    mqtt_segment_t segments[5];
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+    uint8_t scratch[MQTT_ALIAS_SCRATCH_SIZE];
+#else
+    uint8_t *scratch = NULL;
+#endif
+    uint8_t *batch = client->mqtt_state.out_buffer;
+    int budget = MIN(CONFIG_MQTT_WRITE_BATCH_BYTE, client->mqtt_state.out_buffer_length);
+    TickType_t flush = CONFIG_MQTT_WRITE_FLUSH_MS / portTICK_RATE_MS;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed;
+    int length = 0;
+    int records = 1;
+    int count, room, i;
+
+    count = mqtt_record_segments(client, rec, segments, scratch);
+    while (1) {
+        room = budget - length - mqtt_segments_length(segments, count);
+        elapsed = xTaskGetTickCount() - start;
+        next = room > MQTT_ALIAS_SCRATCH_SIZE ?
+               outbox_claim_next(outbox, rec, room - MQTT_ALIAS_SCRATCH_SIZE,
+                                 elapsed < flush ? flush - elapsed : 0) : NULL;
+        if (next == NULL && length == 0)
+            break;
+        for (i = 0; i < count; i++) {
+            memcpy(batch + length, segments[i].data, segments[i].len);
+            length += segments[i].len;
+        }
+        if (next == NULL) {
+            segments[0].data = batch;
+            segments[0].len = length;
+            count = 1;
+            break;
+        }
+        rec = next;
+        records++;
+        count = mqtt_record_segments(client, rec, segments, scratch);
+    }
+
+    //TODO: Check sending type, to callback publish message
+    if (mqtt_send_segments(client, segments, count, 5 * 1000) != 0) {
+        for (rec = first, i = 0; i < records; rec = outbox_next(outbox, rec), i++) {
+            if (mqtt_record_tracked(rec))
+                inflight_unsent(&client->inflight, rec->msg_id);
+        }
+        outbox_unclaim(outbox);
+        return -1;
+    }
+    for (rec = first, i = 0; i < records; rec = next, i++) {
+        next = outbox_next(outbox, rec);
+        outbox_release(outbox, rec);
+    }
+    mqtt_watermark(client);
+    MQTT_STATS_ADD(client, sent, records);
+    if (records > 1)
+        MQTT_STATS_ADD(client, copied_bytes, length);
+    //invalidate keepalive timer
+    client->keepalive_tick = client->settings->keepalive / 2;
+    return 0;
+}
+
+static int mqtt_send_ping(mqtt_client *client)
+{
+    int send_len;
+    uint8_t buffer[MQTT_ACK_BUFFER_SIZE];
+    mqtt_connection_t connection;
+    mqtt_message_t *msg;
+
+    client->keepalive_tick = client->settings->keepalive / 2;
+    mqtt_msg_init(&connection, buffer, sizeof(buffer));
+    msg = mqtt_msg_pingreq(&connection);
+    mqtt_info("Sending pingreq");
+    send_len = client->settings->write_cb(client, msg->data, msg->length, 0);
+    if(send_len <= 0) {
+        mqtt_info("Write error: %d", errno);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write again the unacked packets that are due: all of them on a new
+ * connection, then those whose ack is late.
+ */
+static int mqtt_retransmit(mqtt_client *client)
+{
+    mqtt_inflight_entry_t *entry;
+    mqtt_segment_t segment;
+    int result;
+
+    while ((entry = inflight_take_due(&client->inflight, MQTT_RETRANSMIT_TICKS,
+                                      (const uint8_t **)&segment.data, &segment.len)) != NULL) {
+        if (segment.data == NULL) {
+            mqtt_warn("Unacked packet cannot be sent again, dropped, id: %d", entry->msg_id);
+            inflight_drop(&client->inflight, entry);
+            MQTT_STATS_ADD(client, dropped, 1);
+            continue;
+        }
+        mqtt_info("Sending again unacked packet, id: %d", entry->msg_id);
+        result = mqtt_send_segments(client, &segment, 1, 5 * 1000);
+        inflight_written(&client->inflight, entry, result);
+        if (result != 0)
+            return -1;
+        MQTT_STATS_ADD(client, retransmitted, 1);
+    }
+    return 0;
+}
+
 void mqtt_sending_task(void *pvParameters)
 {
     mqtt_client *client = (mqtt_client *)pvParameters;
-    uint32_t msg_len;
-    int send_len;
-    bool connected = true;
+    mqtt_outbox_record_t *rec;
+    TickType_t checked = xTaskGetTickCount() - 1000 / portTICK_RATE_MS;
     mqtt_info("mqtt_sending_task");
 
-    while (connected) {
-        if (xQueueReceive(client->xSendingQueue, &msg_len, 1000 / portTICK_RATE_MS)) {
-            //queue available
-            while (msg_len > 0) {
-                send_len = msg_len;
-                if (send_len > CONFIG_MQTT_BUFFER_SIZE_BYTE)
-                    send_len = CONFIG_MQTT_BUFFER_SIZE_BYTE;
-                mqtt_info("Sending...%d bytes", send_len);
-
-                rb_read(&client->send_rb, client->mqtt_state.out_buffer, send_len);
-                client->mqtt_state.pending_msg_type = mqtt_get_type(client->mqtt_state.out_buffer);
-                client->mqtt_state.pending_msg_id = mqtt_get_id(client->mqtt_state.out_buffer, send_len);
-                send_len = client->settings->write_cb(client, client->mqtt_state.out_buffer, send_len, 5 * 1000);
-                if(send_len <= 0) {
-                    mqtt_info("Write error: %d", errno);
-                    connected = false;
-                    break;
-                }
-
-                //TODO: Check sending type, to callback publish message
-                msg_len -= send_len;
-            }
-            //invalidate keepalive timer
-            client->keepalive_tick = client->settings->keepalive / 2;
+    while (!client->sending_stop) {
+        if (xTaskGetTickCount() - checked >= 1000 / portTICK_RATE_MS) {
+            checked = xTaskGetTickCount();
+            if (mqtt_retransmit(client) != 0)
+                break;
+        }
+        rec = outbox_claim(&client->outbox, 1000 / portTICK_RATE_MS);
+        if (rec != NULL) {
+            if (mqtt_send_record(client, rec) != 0)
+                break;
+        }
+        else if (client->sending_stop) {
+            break;
         }
         else {
             if (client->keepalive_tick > 0) client->keepalive_tick --;
-            else {
-                client->keepalive_tick = client->settings->keepalive / 2;
-                client->mqtt_state.outbound_message = mqtt_msg_pingreq(&client->mqtt_state.mqtt_connection);
-                client->mqtt_state.pending_msg_type = mqtt_get_type(client->mqtt_state.outbound_message->data);
-                client->mqtt_state.pending_msg_id = mqtt_get_id(client->mqtt_state.outbound_message->data,
-                                                    client->mqtt_state.outbound_message->length);
-                mqtt_info("Sending pingreq");
-                send_len = client->settings->write_cb(client,
-                      client->mqtt_state.outbound_message->data,
-                      client->mqtt_state.outbound_message->length, 0);
-                if(send_len <= 0) {
-					mqtt_info("Write error: %d", errno);
-                    connected = false;
-					break;
-				}
-            }
+            else if (mqtt_send_ping(client) != 0)
+                break;
         }
     }
-    closeclient(client);
-    xMqttSendingTask = NULL;
+    // Wake up the receiving task, which closes the connection
+    if (client->socket != -1)
+        shutdown(client->socket, SHUT_RDWR);
+    client->sending_task = NULL;
     vTaskDelete(NULL);
 }
 
-void deliver_publish(mqtt_client* client, uint8_t* message, int length, size_t* remaining_data_offset, size_t* remaining_data_len)
+#if !defined(CONFIG_MQTT_SINGLE_TASK)
+/*
+ * Have the sending task exit and wait until it has. It is not deleted from
+ * here, as it could be holding the in-flight lock or be halfway through a
+ * record; a write it is blocked in fails once the socket is shut down.
+ */
+static void mqtt_stop_sending(mqtt_client *client)
 {
-    mqtt_event_data_t event_data;
+    client->sending_stop = true;
+    if (client->socket != -1)
+        shutdown(client->socket, SHUT_RDWR);
+    outbox_wake(&client->outbox);
+    while (client->sending_task != NULL)
+        vTaskDelay(10 / portTICK_RATE_MS);
+    client->sending_stop = false;
+}
+#endif
 
-    event_data.data_total_length = 0;
+/*
+ * Deliver the PUBLISH at buffer in in_buffer, of which length bytes have
+ * been read, then read the rest of its payload in chunks that stop at the
+ * packet end. Returns the number of bytes it used from buffer, -1 on a read
+ * error.
+ */
+static int deliver_publish(mqtt_client* client, uint8_t* buffer, mqtt_packet_t* packet, int length)
+{
+    mqtt_event_data_t event_data;
+    mqtt_trie_match_t matches[TRIE_MAX_MATCHES];
+    uint32_t received = MIN((uint32_t)length, packet->total_length);
+    int used = received;
+    int count, i;
+
+    event_data.topic             = packet->topic;
+    event_data.topic_length      = packet->topic_length;
+    event_data.data              = (const char*)buffer + packet->payload_offset;
+    event_data.data_length       = received - packet->payload_offset;
     event_data.data_offset       = 0;
+    event_data.data_total_length = packet->payload_length;
+    event_data.buffer            = received >= packet->total_length ? client->mqtt_state.in_current : NULL;
+
+    // The topic is only there for the first chunk, so match it once
+    count = trie_match(&client->subscriptions, packet->topic, packet->topic_length,
+                       matches, TRIE_MAX_MATCHES);
+    if (count > TRIE_MAX_MATCHES) {
+        mqtt_warn("%d filters match, only the first %d callbacks get the message", count, TRIE_MAX_MATCHES);
+        count = TRIE_MAX_MATCHES;
+    }
 
-    bool first_chunk = true;
-
-//    ESP_LOGI("MQTT-ETR", ">>>deliver_publish: length = %d", length);
-//    ESP_LOG_BUFFER_HEXDUMP("MQTT-ETR", message, length, ESP_LOG_DEBUG);
-
-    do {
-        if (first_chunk) {
-//            ESP_LOGI("MQTT-ETR", "Fisrt chunk");
-            event_data.topic_length = length;
-            event_data.topic        = mqtt_get_publish_topic(message, &event_data.topic_length);
-            event_data.data_length  = length;
-            event_data.data         = mqtt_get_publish_data(message, &event_data.data_length);
-        } else {
-//            ESP_LOGI("MQTT-ETR", "next chunk(s)");
-            event_data.topic        = NULL;
-            event_data.topic_length = 0;
-            event_data.data         = (char*)message;
-            event_data.data_length  = MIN(length, client->mqtt_state.message_length - client->mqtt_state.message_length_read);
-            client->mqtt_state.message_length_read += event_data.data_length;
-        }
-
-//        ESP_LOGD("MQTT-ETR", "Topic lenght = %d", event_data.topic_length);
-//        ESP_LOGD("MQTT-ETR", "Data lenght = %d", event_data.data_length);
-//        ESP_LOGD(
-//            "MQTT-ETR", "client->mqtt_state.message_length = %d", client->mqtt_state.message_length); // Total mqtt message length
-//        ESP_LOGD("MQTT-ETR",
-//                 "client->mqtt_state.message_length_read = %d",
-//                 client->mqtt_state.message_length_read); // Amount of used data from network buffer (mqtt header+topix+data)
-
-        if (event_data.data_total_length == 0) {
-            if (client->mqtt_state.message_length_read >= client->mqtt_state.message_length) {
-//                ESP_LOGW("MQTT-ETR", "A");
-                event_data.data_total_length = event_data.data_length;
-            } else {
-//                ESP_LOGW("MQTT-ETR", "B");
-                event_data.data_total_length =
-                    client->mqtt_state.message_length - client->mqtt_state.message_length_read + event_data.data_length;
-            }
-
-//            ESP_LOGD("MQTT-ETR", "event_data.data_total_length = %d", event_data.data_total_length);
-        }
-
+    while (1) {
         mqtt_info("Data received: %d/%d bytes ", event_data.data_length, event_data.data_total_length);
-        if (client->settings->data_cb) {
+        for (i = 0; i < count; i++) {
+            matches[i].callback(client, &event_data, matches[i].context);
+        }
+        if (count == 0 && client->settings->data_cb) {
             client->settings->data_cb(client, &event_data);
         }
 
-        if (client->mqtt_state.message_length_read >= client->mqtt_state.message_length) {
-//            ESP_LOGI("MQTT-ETR", "break 1");
+        if (received >= packet->total_length)
             break;
-        }
 
         event_data.data_offset += event_data.data_length;
 
-        length = client->settings->read_cb(client, client->mqtt_state.in_buffer, CONFIG_MQTT_BUFFER_SIZE_BYTE, 0);
-        if (length < 0) {
+        // Nothing follows in in_buffer, so chunks go to its start
+        if (used > 0) {
+            if (mqtt_in_buffer_reuse(client) != 0)
+                return -1;
+            used = 0;
+        }
+        buffer = client->mqtt_state.in_buffer;
+        length = client->settings->read_cb(client, buffer,
+                                           MIN(packet->total_length - received, client->mqtt_state.in_buffer_length), 0);
+        if (length <= 0) {
             mqtt_info("+Read error: %d", errno);
-            break;
+            return -1;
         }
-        first_chunk = false;
-//        ESP_LOGD("MQTT-ETR", "Next data len: %d", length);
-//        ESP_LOG_BUFFER_HEXDUMP("MQTT-ETR", message, length, ESP_LOG_DEBUG);
+        received += length;
 
-    } while (1);
-
-//    ESP_LOGD(
-//        "MQTT-ETR", "client->mqtt_state.message_length = %d", client->mqtt_state.message_length); // Total mqtt message length
-//    ESP_LOGD("MQTT-ETR",
-//             "client->mqtt_state.message_length_read = %d",
-//             client->mqtt_state.message_length_read); // Amount of used data from network buffer (mqtt header+topix+data)
+        event_data.topic        = NULL;
+        event_data.topic_length = 0;
+        event_data.data         = (const char*)buffer;
+        event_data.data_length  = length;
+        event_data.buffer       = NULL;
+    }
 
-//    ESP_LOGD("MQTT-ETR", "length = %d", length);
+    return used;
+}
 
-    if ((first_chunk && client->mqtt_state.message_length < length) || (!first_chunk && event_data.data_length < length)) {
+/*
+ * Read and drop the part of a packet that did not fit in in_buffer.
+ */
+static int mqtt_skip(mqtt_client *client, uint32_t length)
+{
+    int read_len;
 
-        *remaining_data_len    = first_chunk ? length - client->mqtt_state.message_length : length - event_data.data_length;
-        *remaining_data_offset = first_chunk ? client->mqtt_state.message_length : event_data.data_length;
-//        ESP_LOGW("MQTT-ETR", "More data to read in buffer: %d @0x%p", *remaining_data_len, message+ *remaining_data_offset);
-//        ESP_LOGE("MQTT-ETR", "==========================================================================");
-    } else {
-//        ESP_LOGD("MQTT-ETR", "remaining data offset: %d", *remaining_data_offset);
-//        ESP_LOGD("MQTT-ETR", "remaining data length: %d", *remaining_data_len);
+    while (length > 0) {
+        read_len = client->settings->read_cb(client, client->mqtt_state.in_buffer,
+                                             MIN(length, client->mqtt_state.in_buffer_length), 0);
+        if (read_len <= 0)
+            return -1;
+        length -= read_len;
     }
-
-//    ESP_LOGI("MQTT-ETR", "<<<<deliver_publish");
+    return 0;
 }
-void mqtt_start_receive_schedule(mqtt_client *client)
+
+/*
+ * Handle the next packet of the stream, reading only when in_buffer does
+ * not hold it yet; bytes read past the packet are left there for the next
+ * call. In single-task mode a packet not fully in yet is left for a later
+ * call. Returns 0, or -1 once the connection is unusable.
+ */
+static int mqtt_receive_packet(mqtt_client *client)
 {
-    int read_len;
-    uint8_t msg_type;
+    mqtt_state_t *state = &client->mqtt_state;
+    mqtt_parser_t parser;
+    mqtt_packet_t *packet = &parser.packet;
+    uint8_t *buffer;
+    int length, used, ready;
     uint8_t msg_qos;
     uint16_t msg_id;
+    mqtt_pending_subscribe_t pending;
+    mqtt_event_data_t event_data;
+    uint8_t ack_buffer[MQTT_ACK_BUFFER_SIZE];
+    mqtt_connection_t connection;
+    mqtt_message_t *msg = NULL;
+
+#if defined(CONFIG_MQTT_SINGLE_TASK)
+    // Back to the loop with what came in so far, rather than block the
+    // client task waiting for the rest of the packet
+    ready = mqtt_read_packet(client, &parser, 0, true);
+#else
+    ready = mqtt_read_packet(client, &parser, 0, false);
+#endif
+    if (ready != 0)
+        return ready > 0 ? 0 : -1;
+    buffer = state->in_buffer + state->in_offset;
+    length = state->in_length;
+
+    msg_qos = mqtt_packet_qos(packet);
+    msg_id  = packet->msg_id;
+    used    = MIN((uint32_t)length, packet->total_length);
+    mqtt_info("msg_type %d, msg_id: %d", packet->type, msg_id);
+    switch (packet->type) {
+        case MQTT_MSG_TYPE_SUBACK:
+            inflight_release_id(&client->inflight, msg_id);
+            if (mqtt_pending_subscribe_take(client, MQTT_MSG_TYPE_SUBSCRIBE, msg_id, &pending)) {
+                // One return code per filter: the granted QoS, or 0x80 on failure
+                event_data.type              = MQTT_MSG_TYPE_SUBACK;
+                event_data.topic             = NULL;
+                event_data.topic_length      = 0;
+                event_data.data              = (const char *)buffer + packet->payload_offset;
+                event_data.data_length       = MIN(pending.count, MIN(packet->payload_length, used - packet->payload_offset));
+                event_data.data_offset       = pending.first;
+                event_data.data_total_length = pending.total;
+                event_data.buffer            = NULL;
+                mqtt_info("Subscribe successful, filters %d-%d of %d",
+                          pending.first, pending.first + event_data.data_length - 1, pending.total);
+                if (client->settings->subscribe_cb) {
+                    client->settings->subscribe_cb(client, &event_data);
+                }
+            }
+            break;
+        case MQTT_MSG_TYPE_UNSUBACK:
+            inflight_release_id(&client->inflight, msg_id);
+            if (mqtt_pending_subscribe_take(client, MQTT_MSG_TYPE_UNSUBSCRIBE, msg_id, &pending))
+                mqtt_info("UnSubscribe successful, filters %d-%d of %d",
+                          pending.first, pending.first + pending.count - 1, pending.total);
+            break;
+        case MQTT_MSG_TYPE_PUBLISH:
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+            if (mqtt_resolve_alias(client, packet) != 0) {
+                mqtt_error("Invalid topic alias %d", packet->topic_alias);
+                used = -1;
+                break;
+            }
+#endif
+            mqtt_msg_init(&connection, ack_buffer, sizeof(ack_buffer));
+            if (msg_qos == 1)
+                msg = mqtt_msg_puback(&connection, msg_id);
+            else if (msg_qos == 2)
+                msg = mqtt_msg_pubrec(&connection, msg_id);
+
+            if (msg_qos == 1 || msg_qos == 2) {
+                mqtt_info("Queue response QoS: %d", msg_qos);
+                // Not delivered unacked, or a QoS 2 redelivery would be delivered twice
+                if (mqtt_queue_ack(client, msg, msg_id) != 0) {
+                    used = -1;
+                    break;
+                }
+            }
+            mqtt_info("deliver_publish");
+            used = deliver_publish(client, buffer, packet, length);
+            break;
+        case MQTT_MSG_TYPE_PUBACK:
+            if (inflight_ack(&client->inflight, msg_id, MQTT_MSG_TYPE_PUBACK, NULL, 0) == 0) {
+                mqtt_info("received MQTT_MSG_TYPE_PUBACK, finish QoS1 publish");
+                mqtt_store_done(client, msg_id, true);
+                mqtt_store_pump(client);
+            }
 
-    size_t remaining_data_offset = 0;
-    size_t remaining_data_len    = 0;
-
-    while (1) {
+            break;
+        case MQTT_MSG_TYPE_PUBREC:
+            mqtt_msg_init(&connection, ack_buffer, sizeof(ack_buffer));
+            msg = mqtt_msg_pubrel(&connection, msg_id);
+            inflight_ack(&client->inflight, msg_id, MQTT_MSG_TYPE_PUBREC, msg->data, msg->length);
+            // A refused PUBREL goes out again from the in-flight window
+            if (mqtt_queue_ack(client, msg, msg_id) != 0)
+                used = -1;
+            break;
+        case MQTT_MSG_TYPE_PUBREL:
+            mqtt_msg_init(&connection, ack_buffer, sizeof(ack_buffer));
+            msg = mqtt_msg_pubcomp(&connection, msg_id);
+            if (mqtt_queue_ack(client, msg, msg_id) != 0)
+                used = -1;
 
-        if (terminate_mqtt)
             break;
-        if (xMqttSendingTask == NULL)
+        case MQTT_MSG_TYPE_PUBCOMP:
+            if (inflight_ack(&client->inflight, msg_id, MQTT_MSG_TYPE_PUBCOMP, NULL, 0) == 0) {
+                mqtt_info("Receive MQTT_MSG_TYPE_PUBCOMP, finish QoS2 publish");
+                mqtt_store_done(client, msg_id, true);
+                mqtt_store_pump(client);
+            }
+            break;
+        case MQTT_MSG_TYPE_PINGREQ:
+            mqtt_msg_init(&connection, ack_buffer, sizeof(ack_buffer));
+            msg = mqtt_msg_pingresp(&connection);
+            if (mqtt_queue_ack(client, msg, 0) != 0)
+                used = -1;
+            break;
+        case MQTT_MSG_TYPE_PINGRESP:
+            mqtt_info("MQTT_MSG_TYPE_PINGRESP");
+            // Ignore
             break;
+    }
 
-        if (remaining_data_offset == 0) {
-            read_len = client->settings->read_cb(client, client->mqtt_state.in_buffer, CONFIG_MQTT_BUFFER_SIZE_BYTE, 0);
+    if (used < 0)
+        return -1;
+    if (packet->type != MQTT_MSG_TYPE_PUBLISH && packet->total_length > (uint32_t)length) {
+        if (mqtt_in_buffer_reuse(client) != 0 ||
+            mqtt_skip(client, packet->total_length - length) != 0)
+            return -1;
+        used = 0;
+    }
 
-            mqtt_info("Read len %d", read_len);
-            if (read_len <= 0) {
-                // ECONNRESET for example
-                mqtt_info("=Read error %d", errno);
-                break;
-            }
-        } else {
-            memmove(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer + remaining_data_offset, remaining_data_len);
-            read_len = remaining_data_len;
-
-            remaining_data_len    = 0;
-            remaining_data_offset = 0;
-        }
-
-        msg_type = mqtt_get_type(client->mqtt_state.in_buffer);
-        msg_qos  = mqtt_get_qos(client->mqtt_state.in_buffer);
-        msg_id   = mqtt_get_id(client->mqtt_state.in_buffer,client->mqtt_state.in_buffer_length);
-        mqtt_info("msg_type %d, msg_id: %d, pending_id: %d", msg_type, msg_id, client->mqtt_state.pending_msg_type);
-        switch (msg_type) {
-            case MQTT_MSG_TYPE_SUBACK:
-                if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_SUBSCRIBE &&
-                    client->mqtt_state.pending_msg_id == msg_id) {
-                    mqtt_info("Subscribe successful");
-                    if (client->settings->subscribe_cb) {
-                        client->settings->subscribe_cb(client, NULL);
-                    }
-                }
-                break;
-            case MQTT_MSG_TYPE_UNSUBACK:
-                if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE &&
-                    client->mqtt_state.pending_msg_id == msg_id)
-                    mqtt_info("UnSubscribe successful");
-                break;
-            case MQTT_MSG_TYPE_PUBLISH:
-                if (msg_qos == 1)
-                    client->mqtt_state.outbound_message = mqtt_msg_puback(&client->mqtt_state.mqtt_connection, msg_id);
-                else if (msg_qos == 2)
-                    client->mqtt_state.outbound_message = mqtt_msg_pubrec(&client->mqtt_state.mqtt_connection, msg_id);
-
-                if (msg_qos == 1 || msg_qos == 2) {
-                    mqtt_info("Queue response QoS: %d", msg_qos);
-                    mqtt_queue(client);
-                    // if (QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data,
-                    // client->mqtt_state.outbound_message->length) == -1) {
-                    //     mqtt_info("MQTT: Queue full");
-                    // }
-                }
-                client->mqtt_state.message_length_read = remaining_data_offset ? remaining_data_len : read_len;
-                client->mqtt_state.message_length = mqtt_get_total_length(client->mqtt_state.in_buffer + remaining_data_offset,
-                                                                          client->mqtt_state.message_length_read);
-                mqtt_info("deliver_publish");
-
-                deliver_publish(client,
-                                client->mqtt_state.in_buffer + remaining_data_offset,
-                                client->mqtt_state.message_length_read,
-                                &remaining_data_offset,
-                                &remaining_data_len);
-                // deliver_publish(client, client->mqtt_state.in_buffer, client->mqtt_state.message_length_read);
-                break;
-            case MQTT_MSG_TYPE_PUBACK:
-                if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_msg_id == msg_id) {
-                    mqtt_info("received MQTT_MSG_TYPE_PUBACK, finish QoS1 publish");
-                }
+    // Keep whatever followed the packet for the next round, in place
+    state->in_offset += used;
+    state->in_length -= used;
+    if (state->in_length == 0)
+        state->in_offset = 0;
+    return 0;
+}
 
-                break;
-            case MQTT_MSG_TYPE_PUBREC:
-                client->mqtt_state.outbound_message = mqtt_msg_pubrel(&client->mqtt_state.mqtt_connection, msg_id);
-                mqtt_queue(client);
-                break;
-            case MQTT_MSG_TYPE_PUBREL:
-                client->mqtt_state.outbound_message = mqtt_msg_pubcomp(&client->mqtt_state.mqtt_connection, msg_id);
-                mqtt_queue(client);
+void mqtt_start_receive_schedule(mqtt_client *client)
+{
+    while (!client->terminate && client->sending_task != NULL) {
+        if (mqtt_receive_packet(client) != 0)
+            break;
+    }
+}
 
-                break;
-            case MQTT_MSG_TYPE_PUBCOMP:
-                if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBREL && client->mqtt_state.pending_msg_id == msg_id) {
-                    mqtt_info("Receive MQTT_MSG_TYPE_PUBCOMP, finish QoS2 publish");
-                }
-                break;
-            case MQTT_MSG_TYPE_PINGREQ:
-                client->mqtt_state.outbound_message = mqtt_msg_pingresp(&client->mqtt_state.mqtt_connection);
-                mqtt_queue(client);
-                break;
-            case MQTT_MSG_TYPE_PINGRESP:
-                mqtt_info("MQTT_MSG_TYPE_PINGRESP");
-                // Ignore
-                break;
+#if defined(CONFIG_MQTT_SINGLE_TASK)
+/*
+ * Loopback socket pair producers use to interrupt the client task's select.
+ */
+static int mqtt_wakeup_open(mqtt_client *client)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    client->wakeup_rx = socket(AF_INET, SOCK_DGRAM, 0);
+    client->wakeup_tx = socket(AF_INET, SOCK_DGRAM, 0);
+    if (client->wakeup_rx < 0 || client->wakeup_tx < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(client->wakeup_rx, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(client->wakeup_rx, (struct sockaddr *)&addr, &addr_len) != 0 ||
+        connect(client->wakeup_tx, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        return -1;
+    return 0;
+}
+
+static void mqtt_wakeup_close(mqtt_client *client)
+{
+    if (client->wakeup_rx >= 0)
+        close(client->wakeup_rx);
+    if (client->wakeup_tx >= 0)
+        close(client->wakeup_tx);
+    client->wakeup_rx = client->wakeup_tx = -1;
+}
+
+/*
+ * Bytes already read from the connection but not handed out yet, which
+ * select cannot see.
+ */
+static bool mqtt_read_pending(mqtt_client *client)
+{
+#if defined(CONFIG_MQTT_SECURITY_ON)
+    return client->ssl != NULL && SSL_pending(client->ssl) > 0;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Serve a connection from the client task alone: write what producers
+ * queued, handle incoming packets and send pings, sleeping in select on the
+ * socket and the wakeup socket in between. Returns once the connection is
+ * lost or the client is stopped.
+ */
+static void mqtt_run(mqtt_client *client)
+{
+    mqtt_outbox_record_t *rec;
+    TickType_t keepalive = client->settings->keepalive * 1000 / 2 / portTICK_RATE_MS;
+    TickType_t last_send = xTaskGetTickCount();
+    TickType_t idle, wait;
+    struct timeval tv;
+    fd_set readset;
+    char drain[16];
+    int ready;
+
+    while (!client->terminate) {
+        // Clear first, so a packet queued from now on sends a new wakeup
+        __atomic_store_n(&client->wakeup_pending, 0, __ATOMIC_RELEASE);
+        if (mqtt_retransmit(client) != 0)
+            return;
+        while ((rec = outbox_claim(&client->outbox, 0)) != NULL) {
+            if (mqtt_send_record(client, rec) != 0)
+                return;
+            last_send = xTaskGetTickCount();
+        }
+
+        idle = xTaskGetTickCount() - last_send;
+        if (keepalive > 0 && idle >= keepalive) {
+            if (mqtt_send_ping(client) != 0)
+                return;
+            last_send = xTaskGetTickCount();
+            idle = 0;
+        }
+
+        if (!mqtt_read_pending(client) && !mqtt_packet_buffered(client)) {
+            // Wake up at least once a second so a stop is never missed for long
+            wait = 1000 / portTICK_RATE_MS;
+            if (keepalive > 0 && keepalive - idle < wait)
+                wait = keepalive - idle;
+            tv.tv_sec = wait * portTICK_RATE_MS / 1000;
+            tv.tv_usec = (wait * portTICK_RATE_MS % 1000) * 1000;
+
+            FD_ZERO(&readset);
+            FD_SET(client->socket, &readset);
+            FD_SET(client->wakeup_rx, &readset);
+            ready = select(MAX(client->socket, client->wakeup_rx) + 1, &readset, NULL, NULL, &tv);
+            if (ready < 0) {
+                mqtt_error("select failed: %d", errno);
+                return;
+            }
+            if (FD_ISSET(client->wakeup_rx, &readset)) {
+                while (recv(client->wakeup_rx, drain, sizeof(drain), MSG_DONTWAIT) > 0)
+                    ;
+            }
+            if (!FD_ISSET(client->socket, &readset))
+                continue;
         }
+
+        // One packet per round, so that the acks it queued go out before
+        // the next one already in in_buffer is handled
+        if (mqtt_receive_packet(client) != 0)
+            return;
     }
 }
+#endif
 
 void mqtt_destroy(mqtt_client *client)
 {
 	if (client == NULL) return;
 
-	vQueueDelete(client->xSendingQueue);
-
-    free(client->mqtt_state.in_buffer);
+    mqtt_in_buffer_free(client);
     free(client->mqtt_state.out_buffer);
-    free(client->send_rb.p_o);
+    outbox_clear(&client->outbox);
+    outbox_deinit(&client->outbox);
+    inflight_deinit(&client->inflight);
+    trie_deinit(&client->subscriptions);
+#if defined(CONFIG_MQTT_SECURITY_ON)
+    mqtt_forget_session(client);
+    if (client->ctx != NULL)
+        SSL_CTX_free(client->ctx);
+#endif
+#if defined(CONFIG_MQTT_STORE_ON)
+    store_deinit(&client->store);
+    free(client->store_buffer);
+#endif
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+    alias_reset(&client->mqtt_state.tx_alias, 0);
+    alias_reset(&client->mqtt_state.rx_alias, 0);
+#endif
+    free(client->outbox.lanes[OUTBOX_LANE_BULK].p_o);
+#if defined(CONFIG_MQTT_SINGLE_TASK)
+    mqtt_wakeup_close(client);
+#endif
     free(client);
 
     mqtt_info("Client destroyed");
@@ -587,9 +1764,14 @@ void mqtt_task(void *pvParameters)
     mqtt_client *client = (mqtt_client *)pvParameters;
 
     while (1) {
-    	if (terminate_mqtt) break;
+    	if (client->terminate) break;
 
-        client->settings->connect_cb(client);
+        if (!client->settings->connect_cb(client)) {
+            if (client->terminate)
+                break;
+            mqtt_backoff_wait(client);
+            continue;
+        }
 
         mqtt_info("Connected to server %s:%d", client->settings->host, client->settings->port);
         if (!mqtt_connect(client)) {
@@ -602,47 +1784,54 @@ void mqtt_task(void *pvParameters)
             if (!client->settings->auto_reconnect) {
 				break;
 			} else {
+				mqtt_backoff_wait(client);
 				continue;
 			}
         }
+        backoff_connected(&client->backoff, xTaskGetTickCount());
+        // Whatever was not acked on the last connection goes out again first
+        inflight_set_due(&client->inflight);
+        mqtt_store_pump(client);
+#if defined(CONFIG_MQTT_SINGLE_TASK)
+        mqtt_info("Connected to MQTT broker");
+        if (client->settings->connected_cb) {
+            client->settings->connected_cb(client, NULL);
+        }
+        mqtt_run(client);
+#else
         mqtt_info("Connected to MQTT broker, create sending thread before call connected callback");
-        xTaskCreate(&mqtt_sending_task, "mqtt_sending_task", 2048, client, CONFIG_MQTT_PRIORITY + 1, &xMqttSendingTask);
+        xTaskCreate(&mqtt_sending_task, "mqtt_sending_task", 2048, client, CONFIG_MQTT_PRIORITY + 1, &client->sending_task);
         if (client->settings->connected_cb) {
             client->settings->connected_cb(client, NULL);
         }
 
         mqtt_info("mqtt_start_receive_schedule");
         mqtt_start_receive_schedule(client);
+        mqtt_stop_sending(client);
+#endif
 
         client->settings->disconnect_cb(client);
         if (client->settings->disconnected_cb) {
         	client->settings->disconnected_cb(client, NULL);
 		}
 
-        if (xMqttSendingTask != NULL) {
-        	vTaskDelete(xMqttSendingTask);
-        }
+        outbox_unclaim(&client->outbox);
         if (!client->settings->auto_reconnect) {
 			break;
 		}
-        vTaskDelay(1000 / portTICK_RATE_MS);
+        mqtt_backoff_wait(client);
 
     }
 
     mqtt_destroy(client);
-    xMqttTask = NULL;
     vTaskDelete(NULL);
 }
 
 mqtt_client *mqtt_start(mqtt_settings *settings)
 {
-	terminate_mqtt = false;
-
     int stackSize = 4096;
 
     uint8_t *rb_buf;
-    if (xMqttTask != NULL)
-        return NULL;
     mqtt_client *client = malloc(sizeof(mqtt_client));
 
     if (client == NULL) {
@@ -666,11 +1855,19 @@ mqtt_client *mqtt_start(mqtt_settings *settings)
     client->connect_info.will_length = settings->lwt_msg_len;
 
     client->keepalive_tick = settings->keepalive / 2;
+    backoff_init(&client->backoff, settings->reconnect_initial_ms, settings->reconnect_max_ms,
+                 settings->reconnect_multiplier);
 
     client->connect_info.keepalive = settings->keepalive;
     client->connect_info.clean_session = settings->clean_session;
 
-    client->mqtt_state.in_buffer = (uint8_t *)malloc(CONFIG_MQTT_BUFFER_SIZE_BYTE);
+    client->mqtt_state.in_pool = pool_create(CONFIG_MQTT_RECEIVE_BUFFERS, CONFIG_MQTT_BUFFER_SIZE_BYTE);
+    if (client->mqtt_state.in_pool == NULL) {
+        mqtt_error("Memory not enough");
+        return NULL;
+    }
+    client->mqtt_state.in_current = pool_get(client->mqtt_state.in_pool, 0);
+    client->mqtt_state.in_buffer = client->mqtt_state.in_current->data;
     client->mqtt_state.in_buffer_length = CONFIG_MQTT_BUFFER_SIZE_BYTE;
     client->mqtt_state.out_buffer =  (uint8_t *)malloc(CONFIG_MQTT_BUFFER_SIZE_BYTE);
     client->mqtt_state.out_buffer_length = CONFIG_MQTT_BUFFER_SIZE_BYTE;
@@ -684,69 +1881,507 @@ mqtt_client *mqtt_start(mqtt_settings *settings)
         client->settings->disconnect_cb = closeclient;
     if (!client->settings->read_cb)
         client->settings->read_cb = mqtt_read;
-    if (!client->settings->write_cb)
+    if (!client->settings->resolve_cb)
+        client->settings->resolve_cb = mqtt_resolve;
+    if (!client->settings->write_cb) {
         client->settings->write_cb = mqtt_write;
+        if (!client->settings->writev_cb)
+            client->settings->writev_cb = mqtt_writev;
+    }
 
 #if defined(CONFIG_MQTT_SECURITY_ON)  // ENABLE MQTT OVER SSL
     client->ctx = NULL;
     client->ssl = NULL;
+    client->session = NULL;
     stackSize = 10240; // Need more stack to handle SSL handshake
 #endif
 
-    /* Create a queue capable of containing 64 unsigned long values. */
-    client->xSendingQueue = xQueueCreate(64, sizeof( uint32_t ));
-    rb_buf = (uint8_t*) malloc(CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD * 4);
+    rb_buf = (uint8_t*) malloc(CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD * 4 + CONFIG_MQTT_URGENT_QUEUE_SIZE_BYTE);
 
     if (rb_buf == NULL) {
         mqtt_error("Memory not enough");
+        mqtt_in_buffer_free(client);
+        return NULL;
+    }
+
+    if (outbox_init(&client->outbox, rb_buf, CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD * 4 + CONFIG_MQTT_URGENT_QUEUE_SIZE_BYTE,
+                    CONFIG_MQTT_URGENT_QUEUE_SIZE_BYTE) != 0) {
+        mqtt_error("Memory not enough");
+        free(rb_buf);
+        mqtt_in_buffer_free(client);
         return NULL;
     }
 
-    rb_init(&client->send_rb, rb_buf, CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD * 4, 1);
+    if (inflight_init(&client->inflight, settings->inflight_window,
+                      outbox_max_length(&client->outbox, OUTBOX_LANE_BULK)) != 0) {
+        mqtt_error("Memory not enough");
+        outbox_deinit(&client->outbox);
+        free(rb_buf);
+        mqtt_in_buffer_free(client);
+        return NULL;
+    }
 
-    mqtt_msg_init(&client->mqtt_state.mqtt_connection,
-                  client->mqtt_state.out_buffer,
-                  client->mqtt_state.out_buffer_length);
+    if (trie_init(&client->subscriptions) != 0) {
+        mqtt_error("Memory not enough");
+        inflight_deinit(&client->inflight);
+        outbox_deinit(&client->outbox);
+        free(rb_buf);
+        mqtt_in_buffer_free(client);
+        return NULL;
+    }
+
+#if defined(CONFIG_MQTT_STORE_ON)
+    client->store_buffer = malloc(outbox_max_length(&client->outbox, OUTBOX_LANE_BULK));
+    if (client->store_buffer == NULL || store_init(&client->store) != 0) {
+        mqtt_error("Cannot open the store at %s", CONFIG_MQTT_STORE_PATH);
+        free(client->store_buffer);
+        trie_deinit(&client->subscriptions);
+        inflight_deinit(&client->inflight);
+        outbox_deinit(&client->outbox);
+        free(rb_buf);
+        mqtt_in_buffer_free(client);
+        return NULL;
+    }
+#endif
+
+#if defined(CONFIG_MQTT_SINGLE_TASK)
+    client->wakeup_rx = client->wakeup_tx = -1;
+    if (mqtt_wakeup_open(client) != 0) {
+        mqtt_error("Cannot open the wakeup socket");
+        mqtt_wakeup_close(client);
+#if defined(CONFIG_MQTT_STORE_ON)
+        store_deinit(&client->store);
+        free(client->store_buffer);
+#endif
+        trie_deinit(&client->subscriptions);
+        inflight_deinit(&client->inflight);
+        outbox_deinit(&client->outbox);
+        free(rb_buf);
+        mqtt_in_buffer_free(client);
+        return NULL;
+    }
+#endif
 
-    xTaskCreate(&mqtt_task, "mqtt_task", stackSize, client, CONFIG_MQTT_PRIORITY, &xMqttTask);
+    xTaskCreate(&mqtt_task, "mqtt_task", stackSize, client, CONFIG_MQTT_PRIORITY, &client->task);
     return client;
 }
 
-void mqtt_subscribe(mqtt_client *client, const char *topic, uint8_t qos)
+/*
+ * Stop routing messages of filters to their callbacks: once their packet is
+ * queued, those unsubscribed from or subscribed to without a callback; if
+ * it could not be, those mqtt_route_filters routed.
+ */
+static void mqtt_unroute_filters(mqtt_client *client, int type, const mqtt_topic_t *topics, int count,
+                                 bool failed)
+{
+    bool routed;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        routed = type == MQTT_MSG_TYPE_SUBSCRIBE && topics[i].callback != NULL;
+        if (routed == failed)
+            trie_remove(&client->subscriptions, topics[i].topic);
+    }
+}
+
+/*
+ * Route messages of the filters about to be subscribed to their callbacks,
+ * before the packet goes out so that none arrives unrouted.
+ */
+static int mqtt_route_filters(mqtt_client *client, int type, const mqtt_topic_t *topics, int count,
+                              mqtt_status_t *status)
+{
+    int i;
+
+    if (type != MQTT_MSG_TYPE_SUBSCRIBE)
+        return 0;
+    for (i = 0; i < count; i++) {
+        if (topics[i].callback != NULL &&
+            trie_set(&client->subscriptions, topics[i].topic, topics[i].callback, topics[i].context) != 0) {
+            mqtt_error("Cannot route messages of \"%s\" to its callback", topics[i].topic);
+            *status = trie_filter_valid(topics[i].topic) ? MQTT_DROPPED : MQTT_INVALID;
+            mqtt_unroute_filters(client, type, topics, i, true);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Queue SUBSCRIBE or UNSUBSCRIBE packets for the whole batch, each carrying
+ * as many filters as fit in out_buffer_length and encoded in place in its
+ * outbox record. Their packet identifiers are held until acked, so that no
+ * publish is given one. Stops at the first packet that cannot be queued,
+ * returning why; the filters of those queued before keep their routes, its
+ * own do not.
+ */
+static mqtt_status_t mqtt_queue_subscribe(mqtt_client *client, int type, const mqtt_topic_t *topics, int count)
+{
+    mqtt_state_t *state = &client->mqtt_state;
+    uint32_t start = MQTT_STATS_NOW();
+    mqtt_connection_t connection;
+    mqtt_message_t *msg;
+    mqtt_pending_subscribe_t pending;
+    mqtt_status_t status = MQTT_OK;
+    uint8_t *region;
+    uint16_t msg_id;
+    int first, packed, length;
+
+    for (first = 0; first < count; first += packed) {
+        if (type == MQTT_MSG_TYPE_SUBSCRIBE)
+            length = mqtt_msg_subscribe_length(topics + first, count - first, state->out_buffer_length, &packed);
+        else
+            length = mqtt_msg_unsubscribe_length(topics + first, count - first, state->out_buffer_length, &packed);
+        if (length < 0) {
+            mqtt_error("Topic filter %d is empty or does not fit in a packet", first + packed);
+            status = MQTT_INVALID;
+            break;
+        }
+        if (mqtt_route_filters(client, type, topics + first, packed, &status) != 0)
+            break;
+        msg_id = inflight_hold_id(&client->inflight);
+        mqtt_pending_subscribe_add(client, type, msg_id, first, packed, count);
+        mqtt_info("Queue %s, %d filters from \"%s\", id: %d",
+                  type == MQTT_MSG_TYPE_SUBSCRIBE ? "subscribe" : "unsubscribe",
+                  packed, topics[first].topic, msg_id);
+        status = mqtt_queue_begin(client, OUTBOX_LANE_BULK, length, &connection, &region);
+        if (status == MQTT_OK) {
+            if (type == MQTT_MSG_TYPE_SUBSCRIBE)
+                msg = mqtt_msg_subscribe_multiple(&connection, topics + first, packed, &packed, &msg_id);
+            else
+                msg = mqtt_msg_unsubscribe_multiple(&connection, topics + first, packed, &packed, &msg_id);
+            status = mqtt_queue_end(client, region, msg, msg_id, NULL);
+        }
+        if (status != MQTT_OK) {
+            mqtt_pending_subscribe_take(client, type, msg_id, &pending);
+            inflight_release_id(&client->inflight, msg_id);
+            mqtt_unroute_filters(client, type, topics + first, packed, true);
+            break;
+        }
+        mqtt_stats_enqueued(client, start, msg->length);
+        mqtt_unroute_filters(client, type, topics + first, packed, false);
+    }
+    return status;
+}
+
+mqtt_status_t mqtt_subscribe(mqtt_client *client, const char *topic, uint8_t qos,
+                             mqtt_message_callback callback, void *context)
+{
+    mqtt_topic_t filter = { topic, qos, callback, context };
+
+    return mqtt_queue_subscribe(client, MQTT_MSG_TYPE_SUBSCRIBE, &filter, 1);
+}
+
+mqtt_status_t mqtt_unsubscribe(mqtt_client *client, const char *topic)
+{
+    mqtt_topic_t filter = { topic, 0 };
+
+    return mqtt_queue_subscribe(client, MQTT_MSG_TYPE_UNSUBSCRIBE, &filter, 1);
+}
+
+/*
+ * Subscribe to count topic filters with as few SUBSCRIBE packets as
+ * possible. subscribe_cb gets the SUBACK return codes of each packet, with
+ * data_offset the index in topics of its first filter and data_total_length
+ * set to count. Messages of a filter with a callback go to it, as with
+ * mqtt_subscribe.
+ * Returns MQTT_OK once every packet is queued, otherwise why the first one
+ * that could not be failed; packets queued before it still go out.
+ */
+mqtt_status_t mqtt_subscribe_multiple(mqtt_client *client, const mqtt_topic_t *topics, int count)
+{
+    return mqtt_queue_subscribe(client, MQTT_MSG_TYPE_SUBSCRIBE, topics, count);
+}
+
+mqtt_status_t mqtt_unsubscribe_multiple(mqtt_client *client, const mqtt_topic_t *topics, int count)
+{
+    return mqtt_queue_subscribe(client, MQTT_MSG_TYPE_UNSUBSCRIBE, topics, count);
+}
+
+/*
+ * Publish a payload too large for the outbox. Only the packet header is
+ * queued; the sending task writes the payload straight from data, and the
+ * caller sleeps until it has been sent or dropped.
+ */
+static mqtt_status_t mqtt_publish_external(mqtt_client* client, const char *topic, const char *data, int len,
+                                           int qos, int retain)
+{
+    mqtt_outbox_payload_t payload;
+    uint32_t start = MQTT_STATS_NOW();
+    mqtt_connection_t connection;
+    mqtt_message_t *msg;
+    mqtt_status_t status;
+    uint16_t msg_id;
+    uint8_t *region;
+
+    if (mqtt_in_client_task(client)) {
+        mqtt_warn("Publish of %d bytes from the client task would never be sent, dropping it", len);
+        MQTT_STATS_ADD(client, dropped, 1);
+        return MQTT_DROPPED;
+    }
+    status = mqtt_publish_begin(client, OUTBOX_LANE_BULK, mqtt_msg_publish_header_length(topic, qos), qos,
+                                &msg_id, &connection, &region);
+    if (status != MQTT_OK)
+        return status;
+    payload.data = (const uint8_t *)data;
+    payload.length = len;
+    payload.waiter = xTaskGetCurrentTaskHandle();
+    payload.done = 0;
+    payload.result = -1;
+    msg = mqtt_msg_publish_header(&connection, topic, len, qos, retain, &msg_id);
+    status = mqtt_publish_end(client, region, msg, msg_id, &payload);
+    if (status != MQTT_OK)
+        return status;
+    mqtt_stats_enqueued(client, start, msg->length + len);
+    mqtt_info("Queuing publish of %d bytes, waiting for it to be sent", len);
+    if (outbox_wait_payload(&payload) != 0) {
+        mqtt_warn("Publish of %d bytes dropped", len);
+        return MQTT_DROPPED;
+    }
+    return MQTT_OK;
+}
+
+#if defined(CONFIG_MQTT_STORE_ON)
+/*
+ * Take the store and point the caller's encoder at the client's buffer
+ * for a PUBLISH headed there, which is appended from a copy rather than
+ * encoded in place. mqtt_publish_stored gives the store back.
+ */
+static void mqtt_store_begin(mqtt_client* client, mqtt_connection_t *connection, int length)
+{
+    store_lock(&client->store);
+    mqtt_msg_init(connection, client->store_buffer, length);
+}
+
+/*
+ * Append the QoS 1 or 2 PUBLISH encoded after mqtt_store_begin to the
+ * store, then send what the window allows. Its packet identifier is set
+ * when it goes out.
+ */
+static mqtt_status_t mqtt_publish_stored(mqtt_client* client, mqtt_message_t *msg, uint32_t start)
+{
+    int length = msg->length;
+    int result = -1;
+
+    if (length > 0)
+        result = store_append(&client->store, msg->data, length);
+    store_unlock(&client->store);
+    if (length == 0)
+        return MQTT_INVALID;
+    if (result == STORE_FULL) {
+        mqtt_warn("Store full, refusing publish of %d bytes", length);
+        MQTT_STATS_ADD(client, rejected, 1);
+        return MQTT_WOULD_BLOCK;
+    }
+    if (result != 0) {
+        mqtt_warn("Cannot store publish of %d bytes, dropping it", length);
+        MQTT_STATS_ADD(client, dropped, 1);
+        return MQTT_DROPPED;
+    }
+    MQTT_STATS_ADD(client, copied_bytes, length);
+    mqtt_stats_enqueued(client, start, length);
+    mqtt_store_pump(client);
+    return MQTT_OK;
+}
+#endif
+
+static void mqtt_publish_queued(mqtt_client* client, mqtt_message_t *msg, uint32_t start, int len)
+{
+    MQTT_STATS_ADD(client, copied_bytes, len);
+    mqtt_stats_enqueued(client, start, msg->length);
+    mqtt_info("Queuing publish, length: %d, queue size(%d/%d), %d messages",
+              msg->length,
+              rb_fill(&client->outbox.lanes[OUTBOX_LANE_BULK]),
+              client->outbox.lanes[OUTBOX_LANE_BULK].size,
+              client->outbox.count);
+}
+
+/*
+ * Queue a PUBLISH. What happens when the send queue or the in-flight window
+ * is full follows settings->overflow_policy; see mqtt_status_t.
+ */
+mqtt_status_t mqtt_publish(mqtt_client* client, const char *topic, const char *data, int len, int qos, int retain)
+{
+    uint32_t start = MQTT_STATS_NOW();
+    int length = mqtt_msg_publish_length(topic, len, qos);
+    mqtt_connection_t connection;
+    mqtt_message_t *msg;
+    mqtt_status_t status;
+    uint16_t msg_id;
+    uint8_t *region;
+
+#if defined(CONFIG_MQTT_STORE_ON)
+    if (qos > 0 && length <= outbox_max_length(&client->outbox, OUTBOX_LANE_BULK)) {
+        mqtt_store_begin(client, &connection, length);
+        msg_id = MQTT_STORE_MSG_ID;
+        msg = mqtt_msg_publish(&connection, topic, data, len, qos, retain, &msg_id);
+        return mqtt_publish_stored(client, msg, start);
+    }
+#endif
+    if (length > outbox_max_length(&client->outbox, OUTBOX_LANE_BULK))
+        return mqtt_publish_external(client, topic, data, len, qos, retain);
+    status = mqtt_publish_begin(client, OUTBOX_LANE_BULK, length, qos, &msg_id, &connection, &region);
+    if (status != MQTT_OK)
+        return status;
+    msg = mqtt_msg_publish(&connection, topic, data, len, qos, retain, &msg_id);
+    status = mqtt_publish_end(client, region, msg, msg_id, NULL);
+    if (status == MQTT_OK)
+        mqtt_publish_queued(client, msg, start, len);
+    return status;
+}
+
+/*
+ * mqtt_publish through the urgent lane, ahead of every queued bulk publish.
+ * It is never kept in the store, and queued as a bulk publish if the urgent
+ * lane has no room for it.
+ */
+mqtt_status_t mqtt_publish_urgent(mqtt_client* client, const char *topic, const char *data, int len, int qos, int retain)
+{
+    uint32_t start = MQTT_STATS_NOW();
+    int length = mqtt_msg_publish_length(topic, len, qos);
+    mqtt_connection_t connection;
+    mqtt_message_t *msg;
+    mqtt_status_t status;
+    uint16_t msg_id;
+    uint8_t *region;
+
+    status = mqtt_publish_begin(client, OUTBOX_LANE_URGENT, length, qos, &msg_id, &connection, &region);
+    if (status != MQTT_OK)
+        return status;
+    msg = mqtt_msg_publish(&connection, topic, data, len, qos, retain, &msg_id);
+    status = mqtt_publish_end(client, region, msg, msg_id, NULL);
+    if (status == MQTT_OK)
+        mqtt_publish_queued(client, msg, start, len);
+    return status;
+}
+
+void mqtt_buffer_retain(mqtt_buffer_t *buffer)
+{
+    pool_retain(buffer);
+}
+
+void mqtt_buffer_release(mqtt_buffer_t *buffer)
+{
+    pool_release(buffer);
+}
+
+/*
+ * Encode topic, QoS and retain flag once for use with mqtt_publish_prepared.
+ * Returns NULL if the topic is invalid or memory is short; release with
+ * mqtt_free_topic.
+ */
+mqtt_prepared_topic_t *mqtt_prepare_topic(const char *topic, int qos, int retain)
+{
+    int size = mqtt_msg_prepared_topic_size(topic);
+    mqtt_prepared_topic_t *prepared;
+
+    if (size < 0)
+        return NULL;
+    prepared = malloc(size);
+    if (prepared == NULL) {
+        mqtt_error("Memory not enough");
+        return NULL;
+    }
+    mqtt_msg_prepare_topic(prepared, topic, qos, retain);
+    return prepared;
+}
+
+void mqtt_free_topic(mqtt_prepared_topic_t *prepared)
+{
+    free(prepared);
+}
+
+/*
+ * mqtt_publish to a topic from mqtt_prepare_topic, without scanning or
+ * re-encoding it.
+ */
+mqtt_status_t mqtt_publish_prepared(mqtt_client* client, const mqtt_prepared_topic_t *prepared, const char *data, int len)
 {
-    client->mqtt_state.outbound_message = mqtt_msg_subscribe(&client->mqtt_state.mqtt_connection,
-                                          topic, qos,
-                                          &client->mqtt_state.pending_msg_id);
-    mqtt_info("Queue subscribe, topic\"%s\", id: %d", topic, client->mqtt_state.pending_msg_id);
-    mqtt_queue(client);
+    uint32_t start = MQTT_STATS_NOW();
+    int length = mqtt_msg_publish_prepared_length(prepared, len);
+    mqtt_connection_t connection;
+    mqtt_message_t *msg;
+    mqtt_status_t status;
+    uint16_t msg_id;
+    uint8_t *region;
+
+#if defined(CONFIG_MQTT_STORE_ON)
+    if (prepared->qos > 0 && length <= outbox_max_length(&client->outbox, OUTBOX_LANE_BULK)) {
+        mqtt_store_begin(client, &connection, length);
+        msg_id = MQTT_STORE_MSG_ID;
+        msg = mqtt_msg_publish_prepared(&connection, prepared, data, len, &msg_id);
+        return mqtt_publish_stored(client, msg, start);
+    }
+#endif
+    if (length > outbox_max_length(&client->outbox, OUTBOX_LANE_BULK))
+        return mqtt_publish_external(client, mqtt_prepared_topic_name(prepared), data, len,
+                                     prepared->qos, prepared->retain);
+    status = mqtt_publish_begin(client, OUTBOX_LANE_BULK, length, prepared->qos, &msg_id, &connection, &region);
+    if (status != MQTT_OK)
+        return status;
+    msg = mqtt_msg_publish_prepared(&connection, prepared, data, len, &msg_id);
+    status = mqtt_publish_end(client, region, msg, msg_id, NULL);
+    if (status == MQTT_OK)
+        mqtt_publish_queued(client, msg, start, len);
+    return status;
 }
 
+/*
+ * Ask a client to disconnect and stop for good. Its task releases the
+ * client once done, so it must not be used after this call.
+ */
+void mqtt_stop(mqtt_client *client)
+{
+	int socket = client->socket;
+
+	client->terminate = true;
+	// Wake up a receive blocked on the socket
+	if (socket != -1)
+		shutdown(socket, SHUT_RDWR);
+}
 
-void mqtt_unsubscribe(mqtt_client *client, const char *topic)
+void mqtt_get_backoff(mqtt_client *client, mqtt_backoff_t *backoff)
 {
-	client->mqtt_state.outbound_message = mqtt_msg_unsubscribe(&client->mqtt_state.mqtt_connection,
-	                                          topic,
-	                                          &client->mqtt_state.pending_msg_id);
-	mqtt_info("Queue unsubscribe, topic\"%s\", id: %d", topic, client->mqtt_state.pending_msg_id);
-	mqtt_queue(client);
+    *backoff = client->backoff;
 }
 
-void mqtt_publish(mqtt_client* client, const char *topic, const char *data, int len, int qos, int retain)
+#if defined(CONFIG_MQTT_STORE_ON)
+mqtt_status_t mqtt_store_sync(mqtt_client *client)
 {
+    int lost;
 
-    client->mqtt_state.outbound_message = mqtt_msg_publish(&client->mqtt_state.mqtt_connection,
-                                          topic, data, len,
-                                          qos, retain,
-                                          &client->mqtt_state.pending_msg_id);
-    mqtt_queue(client);
-    mqtt_info("Queuing publish, length: %d, queue size(%d/%d)",
-              client->mqtt_state.outbound_message->length,
-              client->send_rb.fill_cnt,
-              client->send_rb.size);
+    store_lock(&client->store);
+    lost = mqtt_store_lost(client, store_sync(&client->store));
+    store_unlock(&client->store);
+    return lost > 0 ? MQTT_DROPPED : MQTT_OK;
+}
+#endif
+
+#if defined(CONFIG_MQTT_STATS_ON)
+void mqtt_get_stats(mqtt_client *client, mqtt_stats_t *stats)
+{
+    memcpy(stats, &client->stats, sizeof(mqtt_stats_t));
 }
 
-void mqtt_stop()
+void mqtt_reset_stats(mqtt_client *client)
 {
-	terminate_mqtt = true;
+    memset(&client->stats, 0, sizeof(mqtt_stats_t));
 }
 
+/*
+ * Upper bound, in CPU cycles, of the given percentile of enqueue costs.
+ */
+uint32_t mqtt_stats_percentile(const mqtt_stats_t *stats, int percent)
+{
+    uint64_t rank = ((uint64_t)stats->queued * percent + 99) / 100;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < MQTT_STATS_BUCKETS - 1; i++) {
+        seen += stats->enqueue_hist[i];
+        if (seen >= rank)
+            break;
+    }
+    return i == MQTT_STATS_BUCKETS - 1 ? UINT32_MAX : (2u << i) - 1;
+}
+#endif
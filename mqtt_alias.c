@@ -0,0 +1,91 @@
+/**
+* \file
+*   MQTT 5 topic alias tables
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_alias.h"
+
+/**
+* \brief forget every alias, e.g. on a new connection
+* \param table pointer to the table
+* \param max number of aliases allowed, capped to CONFIG_MQTT_MAX_TOPIC_ALIAS
+*/
+void alias_reset(mqtt_alias_table_t* table, int max)
+{
+    int i;
+
+    for (i = 0; i < CONFIG_MQTT_MAX_TOPIC_ALIAS; i++) {
+        free(table->entries[i].topic);
+        table->entries[i].topic = NULL;
+        table->entries[i].length = 0;
+    }
+    table->max = max < CONFIG_MQTT_MAX_TOPIC_ALIAS ? max : CONFIG_MQTT_MAX_TOPIC_ALIAS;
+    table->count = 0;
+}
+
+/**
+* \brief alias already standing for a topic
+* \return the alias, 0 if none
+*/
+uint16_t alias_find(mqtt_alias_table_t* table, const char* topic, int length)
+{
+    mqtt_alias_entry_t* entry;
+    int i;
+
+    for (i = 0; i < table->count; i++) {
+        entry = &table->entries[i];
+        if (entry->length == length && memcmp(entry->topic, topic, length) == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+/**
+* \brief give the next free alias to a topic
+* \return the alias, 0 if they are all taken or memory is short
+*/
+uint16_t alias_assign(mqtt_alias_table_t* table, const char* topic, int length)
+{
+    if (table->count >= table->max)
+        return 0;
+    if (alias_set(table, table->count + 1, topic, length) != 0)
+        return 0;
+    return ++table->count;
+}
+
+/**
+* \brief make alias stand for a topic, replacing what it stood for
+* \return 0 if successfull, -1 if the alias is out of range or memory is short
+*/
+int alias_set(mqtt_alias_table_t* table, uint16_t alias, const char* topic, int length)
+{
+    mqtt_alias_entry_t* entry;
+    char* copy;
+
+    if (alias == 0 || alias > table->max)
+        return -1;
+    copy = malloc(length + 1);
+    if (copy == NULL)
+        return -1;
+    memcpy(copy, topic, length);
+    copy[length] = '\0';
+
+    entry = &table->entries[alias - 1];
+    free(entry->topic);
+    entry->topic = copy;
+    entry->length = length;
+    return 0;
+}
+
+/**
+* \brief topic an alias stands for
+* \return the topic, NULL if the alias is not set
+*/
+const char* alias_get(mqtt_alias_table_t* table, uint16_t alias, uint16_t* length)
+{
+    if (alias == 0 || alias > table->max)
+        return NULL;
+    *length = table->entries[alias - 1].length;
+    return table->entries[alias - 1].topic;
+}
@@ -0,0 +1,68 @@
+/**
+* \file
+*   Reconnect backoff with full jitter
+*/
+#include <string.h>
+#include "mqtt_backoff.h"
+
+static void backoff_reset(mqtt_backoff_t* backoff)
+{
+    backoff->failures = 0;
+    backoff->ceiling_ms = backoff->initial_ms;
+    backoff->delay_ms = 0;
+}
+
+/**
+* \brief init the backoff of a client with no failure yet
+* \param initial_ms ceiling of the first jittered delay, 0 for CONFIG_MQTT_RECONNECT_INITIAL_MS
+* \param max_ms highest ceiling, 0 for CONFIG_MQTT_RECONNECT_TIMEOUT seconds
+* \param multiplier percent the ceiling grows by per failure, 0 for CONFIG_MQTT_RECONNECT_MULTIPLIER
+*/
+void backoff_init(mqtt_backoff_t* backoff, uint32_t initial_ms, uint32_t max_ms, uint32_t multiplier)
+{
+    memset(backoff, 0, sizeof(*backoff));
+    backoff->initial_ms = initial_ms > 0 ? initial_ms : CONFIG_MQTT_RECONNECT_INITIAL_MS;
+    backoff->max_ms = max_ms > 0 ? max_ms : CONFIG_MQTT_RECONNECT_TIMEOUT * 1000;
+    backoff->multiplier = multiplier > 0 ? multiplier : CONFIG_MQTT_RECONNECT_MULTIPLIER;
+    if (backoff->max_ms < backoff->initial_ms)
+        backoff->max_ms = backoff->initial_ms;
+    backoff->ceiling_ms = backoff->initial_ms;
+}
+
+/**
+* \brief a connection is up; if it lasts initial_ms, the next retry goes out
+* right away again
+* \param now tick count
+*/
+void backoff_connected(mqtt_backoff_t* backoff, TickType_t now)
+{
+    backoff->connected = true;
+    backoff->connected_at = now;
+}
+
+/**
+* \brief plan the next retry
+* \param now tick count
+* \param random uniformly distributed number the delay is drawn from
+* \return the delay until the retry in ms, also in delay_ms
+*/
+uint32_t backoff_next(mqtt_backoff_t* backoff, TickType_t now, uint32_t random)
+{
+    uint64_t ceiling;
+
+    // A server that drops connections as soon as it takes them is not back
+    if (backoff->connected && now - backoff->connected_at >= backoff->initial_ms / portTICK_RATE_MS)
+        backoff_reset(backoff);
+    backoff->connected = false;
+
+    if (backoff->failures == 0) {
+        backoff->delay_ms = 0;
+    } else {
+        backoff->delay_ms = random % (backoff->ceiling_ms + 1);
+        ceiling = (uint64_t)backoff->ceiling_ms * backoff->multiplier / 100;
+        backoff->ceiling_ms = ceiling < backoff->max_ms ? ceiling : backoff->max_ms;
+    }
+    backoff->failures++;
+    backoff->retry_at = now + backoff->delay_ms / portTICK_RATE_MS;
+    return backoff->delay_ms;
+}
@@ -0,0 +1,87 @@
+/**
+* \file
+*   Cache of the server addresses
+*/
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mqtt_dns.h"
+
+static bool dns_same(const struct sockaddr_storage* a, const struct sockaddr_storage* b)
+{
+    if (a->ss_family != b->ss_family)
+        return false;
+    if (a->ss_family == AF_INET)
+        return memcmp(&((const struct sockaddr_in*)a)->sin_addr, &((const struct sockaddr_in*)b)->sin_addr,
+                      sizeof(struct in_addr)) == 0;
+#if LWIP_IPV6
+    if (a->ss_family == AF_INET6)
+        return memcmp(&((const struct sockaddr_in6*)a)->sin6_addr, &((const struct sockaddr_in6*)b)->sin6_addr,
+                      sizeof(struct in6_addr)) == 0;
+#endif
+    return false;
+}
+
+/**
+* \brief number of addresses cached for host, 0 if none or stale
+*/
+int dns_get(mqtt_dns_t* dns, const char* host)
+{
+    if (dns->count == 0 || strcmp(dns->host, host) != 0)
+        return 0;
+    if ((int32_t)(dns->expires - xTaskGetTickCount()) <= 0)
+        return 0;
+    return dns->count;
+}
+
+/**
+* \brief take the count addresses just resolved into addrs for host
+* \param ttl_s seconds they may be reused for, 0 for this connection only
+* The address connected to last time is tried first again if still there.
+*/
+void dns_set(mqtt_dns_t* dns, const char* host, int count, uint32_t ttl_s)
+{
+    int i;
+
+    if (strcmp(dns->host, host) != 0) {
+        strncpy(dns->host, host, sizeof(dns->host) - 1);
+        dns->host[sizeof(dns->host) - 1] = '\0';
+        dns->last.ss_family = AF_UNSPEC;
+    }
+    dns->count = count < CONFIG_MQTT_DNS_MAX_ADDRESSES ? count : CONFIG_MQTT_DNS_MAX_ADDRESSES;
+    dns->next = 0;
+    for (i = 0; i < dns->count; i++) {
+        if (dns_same(&dns->addrs[i], &dns->last)) {
+            dns->next = i;
+            break;
+        }
+    }
+    dns->expires = xTaskGetTickCount() + ttl_s * 1000 / portTICK_RATE_MS;
+}
+
+/**
+* \brief address to try i-th, counting from the one to try first
+*/
+struct sockaddr_storage* dns_address(mqtt_dns_t* dns, int i)
+{
+    return &dns->addrs[(dns->next + i) % dns->count];
+}
+
+/**
+* \brief the i-th address took the connection, try it first next time
+*/
+void dns_worked(mqtt_dns_t* dns, int i)
+{
+    struct sockaddr_storage* addr = dns_address(dns, i);
+
+    dns->last = *addr;
+    dns->next = (dns->next + i) % dns->count;
+}
+
+/**
+* \brief drop the cached addresses, e.g. after none took a connection
+*/
+void dns_forget(mqtt_dns_t* dns)
+{
+    dns->count = 0;
+}
@@ -0,0 +1,372 @@
+/**
+* \file
+*   QoS 1 and 2 in-flight window and packet identifier allocation
+*/
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "mqtt_msg.h"
+#include "mqtt_inflight.h"
+
+static mqtt_inflight_entry_t* inflight_find(mqtt_inflight_t* ifl, uint16_t msg_id)
+{
+    int i;
+
+    for (i = 0; i < CONFIG_MQTT_INFLIGHT_WINDOW; i++) {
+        if (ifl->entries[i].state != INFLIGHT_FREE && ifl->entries[i].msg_id == msg_id)
+            return &ifl->entries[i];
+    }
+    return NULL;
+}
+
+static bool inflight_held(mqtt_inflight_t* ifl, uint16_t msg_id)
+{
+    int i;
+
+    for (i = 0; i < INFLIGHT_HELD_IDS; i++) {
+        if (ifl->held[i] == msg_id)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Arena space of a slot, where its copy of the PUBLISH is kept.
+ */
+static uint8_t* inflight_packet(mqtt_inflight_t* ifl, mqtt_inflight_entry_t* entry)
+{
+    return ifl->arena + (entry - ifl->entries) * ifl->packet_size;
+}
+
+static void inflight_free(mqtt_inflight_t* ifl, mqtt_inflight_entry_t* entry)
+{
+    memset(entry, 0, sizeof(*entry));
+    ifl->count--;
+    if (ifl->waiters > 0)
+        xSemaphoreGive(ifl->free_sem);
+}
+
+/*
+ * Free the slot, or leave that to inflight_written if the sending task is
+ * using the packet.
+ */
+static void inflight_done(mqtt_inflight_t* ifl, mqtt_inflight_entry_t* entry)
+{
+    if (entry->writing)
+        entry->state = INFLIGHT_ACKED;
+    else
+        inflight_free(ifl, entry);
+}
+
+static uint16_t inflight_alloc_id(mqtt_inflight_t* ifl)
+{
+    do {
+        if (++ifl->last_id == 0)
+            ifl->last_id = 1;
+    } while (inflight_find(ifl, ifl->last_id) != NULL || inflight_held(ifl, ifl->last_id));
+    return ifl->last_id;
+}
+
+/**
+* \brief init an empty window
+* \param ifl pointer to the window
+* \param window slots usable, 0 or more than CONFIG_MQTT_INFLIGHT_WINDOW for all
+* \param packet_size longest PUBLISH a copy is kept of, e.g. the largest outbox record
+* \return 0 if successfull, otherwise failed
+* Room for a copy in each usable slot is allocated here, once.
+*/
+int inflight_init(mqtt_inflight_t* ifl, int window, int packet_size)
+{
+    memset(ifl, 0, sizeof(*ifl));
+    ifl->limit = window > 0 && window < CONFIG_MQTT_INFLIGHT_WINDOW ? window : CONFIG_MQTT_INFLIGHT_WINDOW;
+    ifl->window = ifl->limit;
+    ifl->packet_size = packet_size;
+    ifl->arena = malloc(ifl->limit * packet_size);
+    ifl->lock = xSemaphoreCreateMutex();
+    ifl->free_sem = xSemaphoreCreateBinary();
+    if (ifl->arena == NULL || ifl->lock == NULL || ifl->free_sem == NULL) {
+        inflight_deinit(ifl);
+        return -1;
+    }
+    return 0;
+}
+
+void inflight_deinit(mqtt_inflight_t* ifl)
+{
+    free(ifl->arena);
+    if (ifl->lock != NULL)
+        vSemaphoreDelete(ifl->lock);
+    if (ifl->free_sem != NULL)
+        vSemaphoreDelete(ifl->free_sem);
+    memset(ifl, 0, sizeof(*ifl));
+}
+
+/**
+* \brief narrow the window to what the server accepts, e.g. its Receive Maximum
+* \param window slots the server allows, 0 for no limit beyond the configured one
+* Slots already in use above the new window drain as their acks come in.
+*/
+void inflight_set_window(mqtt_inflight_t* ifl, int window)
+{
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    ifl->window = window > 0 && window < ifl->limit ? window : ifl->limit;
+    if (ifl->count < ifl->window && ifl->waiters > 0)
+        xSemaphoreGive(ifl->free_sem);
+    xSemaphoreGive(ifl->lock);
+}
+
+/**
+* \brief packet identifier for a packet not tracked here, e.g. a SUBSCRIBE, kept from publishes until released
+* Only the last INFLIGHT_HELD_IDS identifiers are held; holding one more lets the oldest go.
+*/
+uint16_t inflight_hold_id(mqtt_inflight_t* ifl)
+{
+    uint16_t msg_id;
+
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    msg_id = inflight_alloc_id(ifl);
+    ifl->held[ifl->held_next++ % INFLIGHT_HELD_IDS] = msg_id;
+    xSemaphoreGive(ifl->lock);
+    return msg_id;
+}
+
+/**
+* \brief let a packet identifier from inflight_hold_id be used again, e.g. once acked
+*/
+void inflight_release_id(mqtt_inflight_t* ifl, uint16_t msg_id)
+{
+    int i;
+
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    for (i = 0; i < INFLIGHT_HELD_IDS; i++) {
+        if (ifl->held[i] == msg_id)
+            ifl->held[i] = 0;
+    }
+    xSemaphoreGive(ifl->lock);
+}
+
+/**
+* \brief take a slot for a publish about to be queued, sleeping while the window is full
+* \param ifl pointer to the window
+* \param ticks_to_wait maximum time to sleep, portMAX_DELAY for no timeout
+* \return the packet identifier to publish with, 0 on timeout
+*/
+uint16_t inflight_reserve(mqtt_inflight_t* ifl, TickType_t ticks_to_wait)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed;
+    bool waiting = false;
+    uint16_t msg_id;
+    int i;
+
+    while (1) {
+        xSemaphoreTake(ifl->lock, portMAX_DELAY);
+        if (waiting) {
+            ifl->waiters--;
+            waiting = false;
+        }
+        if (ifl->count < ifl->window) {
+            for (i = 0; ifl->entries[i].state != INFLIGHT_FREE; i++)
+                ;
+            msg_id = inflight_alloc_id(ifl);
+            ifl->entries[i].msg_id = msg_id;
+            ifl->entries[i].state = INFLIGHT_QUEUED;
+            ifl->count++;
+            // free_sem only wakes one waiter; pass it on if slots are left
+            if (ifl->count < ifl->window && ifl->waiters > 0)
+                xSemaphoreGive(ifl->free_sem);
+            xSemaphoreGive(ifl->lock);
+            return msg_id;
+        }
+        elapsed = xTaskGetTickCount() - start;
+        if (ticks_to_wait != portMAX_DELAY && elapsed >= ticks_to_wait) {
+            xSemaphoreGive(ifl->lock);
+            return 0;
+        }
+        // Counted under the lock, so a slot freed from now on gives free_sem
+        ifl->waiters++;
+        waiting = true;
+        xSemaphoreGive(ifl->lock);
+        xSemaphoreTake(ifl->free_sem, ticks_to_wait == portMAX_DELAY ? portMAX_DELAY : ticks_to_wait - elapsed);
+    }
+}
+
+/**
+* \brief give back a slot whose publish was dropped before being sent
+*/
+void inflight_cancel(mqtt_inflight_t* ifl, uint16_t msg_id)
+{
+    mqtt_inflight_entry_t* entry;
+
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    entry = inflight_find(ifl, msg_id);
+    if (entry != NULL && entry->state == INFLIGHT_QUEUED)
+        inflight_free(ifl, entry);
+    xSemaphoreGive(ifl->lock);
+}
+
+/**
+* \brief record that the publish holding msg_id is about to be written
+* \param ifl pointer to the window
+* \param msg_id packet identifier from inflight_reserve
+* \param qos QoS of the publish
+* \param packet whole encoded PUBLISH to keep a copy of, NULL if it cannot be written again
+* \param length length of packet, no copy being kept if it is over the packet_size of inflight_init
+* Called before the write, so that the ack cannot come first.
+*/
+void inflight_sent(mqtt_inflight_t* ifl, uint16_t msg_id, int qos, const uint8_t* packet, int length)
+{
+    mqtt_inflight_entry_t* entry;
+
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    entry = inflight_find(ifl, msg_id);
+    if (entry != NULL && entry->state == INFLIGHT_QUEUED) {
+        entry->length = 0;
+        if (packet != NULL && length <= ifl->packet_size) {
+            memcpy(inflight_packet(ifl, entry), packet, length);
+            entry->length = length;
+        }
+        entry->state = qos == 1 ? INFLIGHT_WAIT_PUBACK : INFLIGHT_WAIT_PUBREC;
+        entry->sent = xTaskGetTickCount();
+        entry->due = 0;
+    }
+    xSemaphoreGive(ifl->lock);
+}
+
+/**
+* \brief undo inflight_sent after the write failed, the outbox keeping the packet
+*/
+void inflight_unsent(mqtt_inflight_t* ifl, uint16_t msg_id)
+{
+    mqtt_inflight_entry_t* entry;
+
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    entry = inflight_find(ifl, msg_id);
+    if (entry != NULL && !entry->writing &&
+        (entry->state == INFLIGHT_WAIT_PUBACK || entry->state == INFLIGHT_WAIT_PUBREC)) {
+        entry->length = 0;
+        entry->state = INFLIGHT_QUEUED;
+    }
+    xSemaphoreGive(ifl->lock);
+}
+
+/**
+* \brief handle a PUBACK, PUBREC or PUBCOMP
+* \param ifl pointer to the window
+* \param msg_id packet identifier of the ack
+* \param type MQTT_MSG_TYPE_PUBACK, MQTT_MSG_TYPE_PUBREC or MQTT_MSG_TYPE_PUBCOMP
+* \param pubrel for PUBREC, the PUBREL answering it, written again if PUBCOMP is late
+* \param length length of pubrel
+* \return 0 if the ack matched the slot's state, -1 otherwise
+*/
+int inflight_ack(mqtt_inflight_t* ifl, uint16_t msg_id, int type, const uint8_t* pubrel, int length)
+{
+    mqtt_inflight_entry_t* entry;
+    int result = -1;
+
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    entry = inflight_find(ifl, msg_id);
+    if (entry != NULL && type == MQTT_MSG_TYPE_PUBACK && entry->state == INFLIGHT_WAIT_PUBACK) {
+        inflight_done(ifl, entry);
+        result = 0;
+    } else if (entry != NULL && type == MQTT_MSG_TYPE_PUBREC && entry->state == INFLIGHT_WAIT_PUBREC) {
+        entry->state = INFLIGHT_WAIT_PUBCOMP;
+        entry->pubrel_length = length < (int)sizeof(entry->pubrel) ? length : sizeof(entry->pubrel);
+        memcpy(entry->pubrel, pubrel, entry->pubrel_length);
+        entry->sent = xTaskGetTickCount();
+        entry->due = 0;
+        result = 0;
+    } else if (entry != NULL && type == MQTT_MSG_TYPE_PUBCOMP && entry->state == INFLIGHT_WAIT_PUBCOMP) {
+        inflight_done(ifl, entry);
+        result = 0;
+    }
+    xSemaphoreGive(ifl->lock);
+    return result;
+}
+
+/**
+* \brief claim the next packet to write again
+* \param ifl pointer to the window
+* \param timeout ticks after which an unacked packet is written again, 0 for never
+* \param data set to the packet, DUP flag set, or NULL if no copy of the PUBLISH
+*             was kept, e.g. for an external payload
+* \param length set to the packet length
+* \return the slot, to hand to inflight_written, or to inflight_drop if data is
+*         NULL, NULL if nothing is due
+* Slots flagged by inflight_set_due are returned regardless of timeout.
+*/
+mqtt_inflight_entry_t* inflight_take_due(mqtt_inflight_t* ifl, TickType_t timeout,
+                                         const uint8_t** data, int* length)
+{
+    TickType_t now = xTaskGetTickCount();
+    mqtt_inflight_entry_t* entry;
+    int i;
+
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    for (i = 0; i < CONFIG_MQTT_INFLIGHT_WINDOW; i++) {
+        entry = &ifl->entries[i];
+        if (entry->writing || !(entry->due || (timeout > 0 && now - entry->sent >= timeout)))
+            continue;
+        if (entry->state == INFLIGHT_WAIT_PUBCOMP) {
+            *data = entry->pubrel;
+            *length = entry->pubrel_length;
+        } else if (entry->state == INFLIGHT_WAIT_PUBACK || entry->state == INFLIGHT_WAIT_PUBREC) {
+            *data = entry->length > 0 ? inflight_packet(ifl, entry) : NULL;
+            *length = entry->length;
+            if (*data != NULL)
+                inflight_packet(ifl, entry)[0] |= 0x08;
+        } else {
+            continue;
+        }
+        entry->writing = 1;
+        xSemaphoreGive(ifl->lock);
+        return entry;
+    }
+    xSemaphoreGive(ifl->lock);
+    return NULL;
+}
+
+/**
+* \brief hand back a slot from inflight_take_due once written
+* \param result 0 if the write succeeded; otherwise the slot stays due
+*/
+void inflight_written(mqtt_inflight_t* ifl, mqtt_inflight_entry_t* entry, int result)
+{
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    entry->writing = 0;
+    entry->sent = xTaskGetTickCount();
+    entry->due = result != 0;
+    if (entry->state == INFLIGHT_ACKED)
+        inflight_free(ifl, entry);
+    xSemaphoreGive(ifl->lock);
+}
+
+/**
+* \brief free a slot from inflight_take_due that cannot be written again
+* Its publish is given up on, a late ack for it being ignored.
+*/
+void inflight_drop(mqtt_inflight_t* ifl, mqtt_inflight_entry_t* entry)
+{
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    entry->writing = 0;
+    inflight_free(ifl, entry);
+    xSemaphoreGive(ifl->lock);
+}
+
+/**
+* \brief flag every unacked packet to be written again, e.g. on a new connection
+*/
+void inflight_set_due(mqtt_inflight_t* ifl)
+{
+    int i;
+
+    xSemaphoreTake(ifl->lock, portMAX_DELAY);
+    for (i = 0; i < CONFIG_MQTT_INFLIGHT_WINDOW; i++) {
+        if (ifl->entries[i].state >= INFLIGHT_WAIT_PUBACK)
+            ifl->entries[i].due = 1;
+    }
+    xSemaphoreGive(ifl->lock);
+}
@@ -33,6 +33,14 @@
 #include "mqtt_msg.h"
 #include "mqtt_config.h"
 #define MQTT_MAX_FIXED_HEADER_SIZE 3
+#define MQTT_MAX_LONG_HEADER_SIZE 5
+#define MQTT_MAX_REMAINING_LENGTH 268435455
+
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+#define MQTT_EMPTY_PROPERTIES_SIZE 1
+#else
+#define MQTT_EMPTY_PROPERTIES_SIZE 0
+#endif
 
 enum mqtt_connect_flag
 {
@@ -43,11 +51,24 @@ enum mqtt_connect_flag
     MQTT_CONNECT_FLAG_CLEAN_SESSION = 1 << 1
 };
 
+enum mqtt_parse_state
+{
+    MQTT_PARSE_FIXED = 0,
+    MQTT_PARSE_LENGTH,
+    MQTT_PARSE_TOPIC_LENGTH,
+    MQTT_PARSE_TOPIC,
+    MQTT_PARSE_ID,
+    MQTT_PARSE_CONNACK,
+    MQTT_PARSE_PROPERTIES_LENGTH,
+    MQTT_PARSE_PROPERTIES,
+    MQTT_PARSE_DONE
+};
+
 struct __attribute((__packed__)) mqtt_connect_variable_header
 {
     uint8_t lengthMsb;
     uint8_t lengthLsb;
-#if defined(CONFIG_MQTT_PROTOCOL_311)
+#if defined(CONFIG_MQTT_PROTOCOL_311) || defined(CONFIG_MQTT_PROTOCOL_5)
     uint8_t magic[4];
 #else
     uint8_t magic[6];
@@ -87,12 +108,35 @@ static uint16_t append_message_id(mqtt_connection_t* connection, uint16_t messag
     return message_id;
 }
 
+/*
+ * Property length of a packet that carries no properties. MQTT 3.1.1 has
+ * no properties at all, so this appends nothing there.
+ */
+static int append_empty_properties(mqtt_connection_t* connection)
+{
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+    if (connection->message.length + 1 > connection->buffer_length)
+        return -1;
+    connection->buffer[connection->message.length++] = 0;
+#endif
+    return 0;
+}
+
 static int init_message(mqtt_connection_t* connection)
 {
     connection->message.length = MQTT_MAX_FIXED_HEADER_SIZE;
     return MQTT_MAX_FIXED_HEADER_SIZE;
 }
 
+/*
+ * Bytes fini_message needs past the buffer for a remaining length that
+ * does not fit the 2 length bytes set aside by init_message.
+ */
+static int fixed_header_slack(uint32_t remaining_length)
+{
+    return remaining_length < 16384 ? 0 : remaining_length < 2097152 ? 1 : 2;
+}
+
 static mqtt_message_t* fail_message(mqtt_connection_t* connection)
 {
     connection->message.data = connection->buffer;
@@ -103,8 +147,25 @@ static mqtt_message_t* fail_message(mqtt_connection_t* connection)
 static mqtt_message_t* fini_message(mqtt_connection_t* connection, int type, int dup, int qos, int retain)
 {
     int remaining_length = connection->message.length - MQTT_MAX_FIXED_HEADER_SIZE;
+    int slack = fixed_header_slack(remaining_length);
 
-    if (remaining_length > 127)
+    // Also catches a buffer too small for the fixed header itself
+    if (connection->message.length > connection->buffer_length)
+        return fail_message(connection);
+
+    if (slack > 0)
+    {
+        // Only 2 length bytes were set aside, move the packet body up
+        if (connection->message.length + slack > connection->buffer_length)
+            return fail_message(connection);
+        memmove(connection->buffer + MQTT_MAX_FIXED_HEADER_SIZE + slack,
+                connection->buffer + MQTT_MAX_FIXED_HEADER_SIZE, remaining_length);
+        connection->buffer[0] = ((type & 0x0f) << 4) | ((dup & 1) << 3) | ((qos & 3) << 1) | (retain & 1);
+        mqtt_msg_encode_length(connection->buffer + 1, remaining_length);
+        connection->message.length = remaining_length + MQTT_MAX_FIXED_HEADER_SIZE + slack;
+        connection->message.data = connection->buffer;
+    }
+    else if (remaining_length > 127)
     {
         connection->buffer[0] = ((type & 0x0f) << 4) | ((dup & 1) << 3) | ((qos & 3) << 1) | (retain & 1);
         connection->buffer[1] = 0x80 | (remaining_length % 128);
@@ -123,6 +184,169 @@ static mqtt_message_t* fini_message(mqtt_connection_t* connection, int type, int
     return &connection->message;
 }
 
+/*
+ * Like fini_message, for a packet whose variable header starts at
+ * MQTT_MAX_LONG_HEADER_SIZE and which is followed by extra_length bytes
+ * that are not in the buffer. The fixed header takes up to 5 bytes.
+ */
+static mqtt_message_t* fini_long_message(mqtt_connection_t* connection, int type, int dup, int qos, int retain, uint32_t extra_length)
+{
+    uint32_t header_length = connection->message.length - MQTT_MAX_LONG_HEADER_SIZE;
+    uint32_t remaining_length = header_length + extra_length;
+    uint8_t encoded[4];
+    int n;
+
+    if (remaining_length > MQTT_MAX_REMAINING_LENGTH ||
+        connection->message.length > connection->buffer_length)
+        return fail_message(connection);
+
+    n = mqtt_msg_encode_length(encoded, remaining_length);
+    connection->message.data = connection->buffer + MQTT_MAX_LONG_HEADER_SIZE - n - 1;
+    connection->message.data[0] = ((type & 0x0f) << 4) | ((dup & 1) << 3) | ((qos & 3) << 1) | (retain & 1);
+    memcpy(connection->message.data + 1, encoded, n);
+    connection->message.length = header_length + n + 1;
+
+    return &connection->message;
+}
+
+/*
+ * Write length as an MQTT variable byte integer, at most 4 bytes. Returns
+ * the number of bytes written.
+ */
+int mqtt_msg_encode_length(uint8_t* buffer, uint32_t length)
+{
+    int n = 0;
+
+    do {
+        buffer[n] = length % 128;
+        length /= 128;
+        if (length > 0)
+            buffer[n] |= 0x80;
+        n++;
+    } while (length > 0 && n < 4);
+
+    return n;
+}
+
+/*
+ * Read a variable byte integer at buffer[*pos], advancing *pos past it.
+ * Returns 0, or -1 if it is malformed or runs past length.
+ */
+static int decode_length(const uint8_t* buffer, uint32_t length, uint32_t* pos, uint32_t* value)
+{
+    int shift = 0;
+    uint8_t byte;
+
+    *value = 0;
+    do {
+        if (*pos >= length || shift >= 28)
+            return -1;
+        byte = buffer[(*pos)++];
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return 0;
+}
+
+/*
+ * Read the MQTT 5 property at buffer[*pos], in a property list of length
+ * bytes, and advance *pos past it.
+ * Returns 1 if a property was read, 0 at the end of the list, -1 if the
+ * list is malformed or holds an unknown property.
+ */
+int mqtt_property_next(const uint8_t* buffer, uint32_t length, uint32_t* pos, mqtt_property_t* property)
+{
+    uint32_t id;
+    int strings = 0;
+
+    if (*pos >= length)
+        return 0;
+    if (decode_length(buffer, length, pos, &id) < 0)
+        return -1;
+
+    memset(property, 0, sizeof(mqtt_property_t));
+    property->id = id;
+    switch (id)
+    {
+        case MQTT_PROPERTY_PAYLOAD_FORMAT:
+        case MQTT_PROPERTY_REQUEST_PROBLEM_INFO:
+        case MQTT_PROPERTY_REQUEST_RESPONSE_INFO:
+        case MQTT_PROPERTY_MAXIMUM_QOS:
+        case MQTT_PROPERTY_RETAIN_AVAILABLE:
+        case MQTT_PROPERTY_WILDCARD_SUB_AVAILABLE:
+        case MQTT_PROPERTY_SUBSCRIPTION_ID_AVAILABLE:
+        case MQTT_PROPERTY_SHARED_SUB_AVAILABLE:
+            if (*pos + 1 > length)
+                return -1;
+            property->value = buffer[(*pos)++];
+            return 1;
+
+        case MQTT_PROPERTY_SERVER_KEEP_ALIVE:
+        case MQTT_PROPERTY_RECEIVE_MAXIMUM:
+        case MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM:
+        case MQTT_PROPERTY_TOPIC_ALIAS:
+            if (*pos + 2 > length)
+                return -1;
+            property->value = (buffer[*pos] << 8) | buffer[*pos + 1];
+            *pos += 2;
+            return 1;
+
+        case MQTT_PROPERTY_MESSAGE_EXPIRY:
+        case MQTT_PROPERTY_SESSION_EXPIRY:
+        case MQTT_PROPERTY_WILL_DELAY:
+        case MQTT_PROPERTY_MAXIMUM_PACKET_SIZE:
+            if (*pos + 4 > length)
+                return -1;
+            property->value = ((uint32_t)buffer[*pos] << 24) | ((uint32_t)buffer[*pos + 1] << 16) |
+                              (buffer[*pos + 2] << 8) | buffer[*pos + 3];
+            *pos += 4;
+            return 1;
+
+        case MQTT_PROPERTY_SUBSCRIPTION_ID:
+            return decode_length(buffer, length, pos, &property->value) < 0 ? -1 : 1;
+
+        case MQTT_PROPERTY_USER_PROPERTY:
+            strings = 2;
+            break;
+
+        case MQTT_PROPERTY_CONTENT_TYPE:
+        case MQTT_PROPERTY_RESPONSE_TOPIC:
+        case MQTT_PROPERTY_CORRELATION_DATA:
+        case MQTT_PROPERTY_ASSIGNED_CLIENT_ID:
+        case MQTT_PROPERTY_AUTH_METHOD:
+        case MQTT_PROPERTY_AUTH_DATA:
+        case MQTT_PROPERTY_RESPONSE_INFO:
+        case MQTT_PROPERTY_SERVER_REFERENCE:
+        case MQTT_PROPERTY_REASON_STRING:
+            strings = 1;
+            break;
+
+        default:
+            return -1;
+    }
+
+    // String, binary data or, for a user property, a pair of strings
+    if (*pos + 2 > length)
+        return -1;
+    property->length = (buffer[*pos] << 8) | buffer[*pos + 1];
+    property->data = buffer + *pos + 2;
+    *pos += 2 + property->length;
+    if (*pos > length)
+        return -1;
+    if (strings == 2)
+    {
+        if (*pos + 2 > length)
+            return -1;
+        property->value_length = (buffer[*pos] << 8) | buffer[*pos + 1];
+        property->value_data = buffer + *pos + 2;
+        *pos += 2 + property->value_length;
+        if (*pos > length)
+            return -1;
+    }
+    return 1;
+}
+
 void mqtt_msg_init(mqtt_connection_t* connection, uint8_t* buffer, uint16_t buffer_length)
 {
     memset(connection, 0, sizeof(mqtt_connection_t));
@@ -130,160 +354,327 @@ void mqtt_msg_init(mqtt_connection_t* connection, uint8_t* buffer, uint16_t buff
     connection->buffer_length = buffer_length;
 }
 
-int mqtt_get_total_length(uint8_t* buffer, uint16_t length)
+/*
+ * Buffer size mqtt_msg_publish needs for this message, fixed header slack
+ * included.
+ */
+int mqtt_msg_publish_length(const char* topic, int data_length, int qos)
 {
-    int i;
-    int totlen = 0;
+    int remaining_length = 2 + (topic ? strlen(topic) : 0) + (qos > 0 ? 2 : 0) +
+                           MQTT_EMPTY_PROPERTIES_SIZE + data_length;
 
-    for (i = 1; i < length; ++i)
-    {
-        totlen += (buffer[i] & 0x7f) << (7 * (i - 1));
-        if ((buffer[i] & 0x80) == 0)
-        {
-            ++i;
-            break;
-        }
-    }
-    totlen += i;
+    return MQTT_MAX_FIXED_HEADER_SIZE + fixed_header_slack(remaining_length) + remaining_length;
+}
 
-    return totlen;
+/*
+ * Buffer size mqtt_msg_publish_header needs for this message.
+ */
+int mqtt_msg_publish_header_length(const char* topic, int qos)
+{
+    return MQTT_MAX_LONG_HEADER_SIZE + 2 + (topic ? strlen(topic) : 0) + (qos > 0 ? 2 : 0) +
+           MQTT_EMPTY_PROPERTIES_SIZE;
 }
 
-const char* mqtt_get_publish_topic(uint8_t* buffer, uint16_t* length)
+/*
+ * Bytes to allocate for the prepared form of topic, -1 if it cannot be
+ * published to.
+ */
+int mqtt_msg_prepared_topic_size(const char* topic)
 {
-    int i;
-    int totlen = 0;
-    int topiclen;
+    int len;
 
-    for (i = 1; i < *length; ++i)
-    {
-        totlen += (buffer[i] & 0x7f) << (7 * (i - 1));
-        if ((buffer[i] & 0x80) == 0)
-        {
-            ++i;
-            break;
-        }
-    }
-    totlen += i;
+    if (topic == NULL || topic[0] == '\0')
+        return -1;
+    len = strlen(topic);
+    if (len > 0xffff - 2)
+        return -1;
+    return sizeof(mqtt_prepared_topic_t) + 2 + len + 1;
+}
 
-    if (i + 2 >= *length)
-        return NULL;
-    topiclen = buffer[i++] << 8;
-    topiclen |= buffer[i++];
+void mqtt_msg_prepare_topic(mqtt_prepared_topic_t* prepared, const char* topic, int qos, int retain)
+{
+    int len = strlen(topic);
+
+    prepared->qos = qos;
+    prepared->retain = retain;
+    prepared->length = len + 2;
+    prepared->data[0] = len >> 8;
+    prepared->data[1] = len & 0xff;
+    memcpy(prepared->data + 2, topic, len + 1);
+}
 
-    if (i + topiclen > *length)
-        return NULL;
+/*
+ * Buffer size mqtt_msg_publish_prepared needs for this message.
+ */
+int mqtt_msg_publish_prepared_length(const mqtt_prepared_topic_t* prepared, int data_length)
+{
+    int remaining_length = prepared->length + (prepared->qos > 0 ? 2 : 0) +
+                           MQTT_EMPTY_PROPERTIES_SIZE + data_length;
 
-    *length = topiclen;
-    return (const char*)(buffer + i);
+    return MQTT_MAX_FIXED_HEADER_SIZE + fixed_header_slack(remaining_length) + remaining_length;
 }
 
-const char* mqtt_get_publish_data(uint8_t* buffer, uint16_t* length)
+/*
+ * Decode the fixed header at the start of buffer. Returns its size and sets
+ * *remaining_length, -1 if it is malformed or cut short.
+ */
+static int decode_fixed_header(const uint8_t* buffer, uint32_t length, uint32_t* remaining_length)
 {
-    int i;
-    int totlen = 0;
-    int topiclen;
-    int blength = *length;
-    *length = 0;
+    uint32_t pos = 1;
 
-    for (i = 1; i < blength; ++i)
-    {
-        totlen += (buffer[i] & 0x7f) << (7 * (i - 1));
-        if ((buffer[i] & 0x80) == 0)
-        {
-            ++i;
-            break;
-        }
-    }
-    totlen += i;
+    if (length < 2 || decode_length(buffer, length, &pos, remaining_length) < 0)
+        return -1;
+    return pos;
+}
 
-    if (i + 2 >= blength)
-        return NULL;
-    topiclen = buffer[i++] << 8;
-    topiclen |= buffer[i++];
+/*
+ * Run the packet decoder over a buffer holding at least the packet headers.
+ */
+static const mqtt_packet_t* parse_headers(mqtt_parser_t* parser, const uint8_t* buffer, uint32_t length)
+{
+    mqtt_parser_init(parser);
+    return mqtt_parse(parser, buffer, length) == 0 ? &parser->packet : NULL;
+}
 
-    if (i + topiclen >= blength)
+int mqtt_get_total_length(uint8_t* buffer, uint16_t length)
+{
+    uint32_t remaining_length;
+    int header_length = decode_fixed_header(buffer, length, &remaining_length);
+
+    if (header_length < 0)
+        return -1;
+    return header_length + remaining_length;
+}
+
+const char* mqtt_get_publish_topic(uint8_t* buffer, uint16_t* length)
+{
+    mqtt_parser_t parser;
+    const mqtt_packet_t* packet = parse_headers(&parser, buffer, *length);
+
+    if (packet == NULL || packet->type != MQTT_MSG_TYPE_PUBLISH)
         return NULL;
 
-    i += topiclen;
+    *length = packet->topic_length;
+    return packet->topic;
+}
 
-    if (mqtt_get_qos(buffer) > 0)
-    {
-        if (i + 2 >= blength)
-            return NULL;
-        i += 2;
-    }
+const char* mqtt_get_publish_data(uint8_t* buffer, uint16_t* length)
+{
+    mqtt_parser_t parser;
+    const mqtt_packet_t* packet = parse_headers(&parser, buffer, *length);
+    uint32_t end;
 
-    if (totlen < i)
+    if (packet == NULL || packet->type != MQTT_MSG_TYPE_PUBLISH)
+    {
+        *length = 0;
         return NULL;
+    }
 
-    if (totlen <= blength)
-        *length = totlen - i;
-    else
-        *length = blength - i;
-    return (const char*)(buffer + i);
+    // The payload may continue past the buffer
+    end = packet->total_length < *length ? packet->total_length : *length;
+    *length = end - packet->payload_offset;
+    return (const char*)(buffer + packet->payload_offset);
 }
 
 uint16_t mqtt_get_id(uint8_t* buffer, uint16_t length)
 {
-    if (length < 1)
-        return 0;
+    mqtt_parser_t parser;
+    const mqtt_packet_t* packet = parse_headers(&parser, buffer, length);
+
+    return packet == NULL ? 0 : packet->msg_id;
+}
 
-    switch (mqtt_get_type(buffer))
+/*
+ * Move on from the variable header fields of a packet: to its properties
+ * under MQTT 5 if it has any, otherwise to the end of the headers.
+ */
+static void parse_properties_next(mqtt_parser_t* parser)
+{
+    parser->state = MQTT_PARSE_DONE;
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+    switch (parser->packet.type)
     {
+        case MQTT_MSG_TYPE_CONNACK:
         case MQTT_MSG_TYPE_PUBLISH:
+        case MQTT_MSG_TYPE_SUBSCRIBE:
+        case MQTT_MSG_TYPE_SUBACK:
+        case MQTT_MSG_TYPE_UNSUBSCRIBE:
+        case MQTT_MSG_TYPE_UNSUBACK:
+            // A missing property length means no properties
+            if (parser->pos < parser->packet.total_length)
             {
-                int i;
-                int topiclen;
+                parser->state = MQTT_PARSE_PROPERTIES_LENGTH;
+                parser->shift = 0;
+            }
+            break;
+    }
+#endif
+}
 
-                for (i = 1; i < length; ++i)
-                {
-                    if ((buffer[i] & 0x80) == 0)
-                    {
-                        ++i;
-                        break;
-                    }
-                }
+/*
+ * Check the property list of a packet and pick out the properties the
+ * client acts on.
+ */
+static int parse_properties(mqtt_packet_t* packet, const uint8_t* buffer)
+{
+    mqtt_property_t property;
+    uint32_t pos = 0;
+    int result;
 
-                if (i + 2 >= length)
-                    return 0;
-                topiclen = buffer[i++] << 8;
-                topiclen |= buffer[i++];
+    while ((result = mqtt_property_next(buffer + packet->properties_offset, packet->properties_length,
+                                        &pos, &property)) > 0)
+    {
+        if (property.id == MQTT_PROPERTY_TOPIC_ALIAS)
+            packet->topic_alias = property.value;
+    }
+    return result;
+}
 
-                if (i + topiclen >= length)
-                    return 0;
-                i += topiclen;
+void mqtt_parser_init(mqtt_parser_t* parser)
+{
+    memset(parser, 0, sizeof(mqtt_parser_t));
+}
 
-                if (mqtt_get_qos(buffer) > 0)
+/*
+ * Decode the headers of the packet at the start of buffer, of which length
+ * bytes have arrived so far. Calling again with the same buffer and a larger
+ * length resumes without rescanning. Returns 0 once parser->packet is
+ * complete, the number of bytes still needed before it can be, or -1 if the
+ * packet is malformed.
+ */
+int mqtt_parse(mqtt_parser_t* parser, const uint8_t* buffer, uint32_t length)
+{
+    mqtt_packet_t* packet = &parser->packet;
+    uint8_t byte;
+
+    while (parser->state != MQTT_PARSE_DONE)
+    {
+        switch (parser->state)
+        {
+            case MQTT_PARSE_FIXED:
+                if (length < 1)
+                    return 1;
+                packet->type = buffer[0] >> 4;
+                packet->flags = buffer[0] & 0x0f;
+                if (packet->type == 0)
+                    return -1;
+                parser->pos = 1;
+                parser->state = MQTT_PARSE_LENGTH;
+                break;
+
+            case MQTT_PARSE_LENGTH:
+                if (length <= parser->pos)
+                    return 1;
+                byte = buffer[parser->pos++];
+                packet->remaining_length |= (uint32_t)(byte & 0x7f) << parser->shift;
+                parser->shift += 7;
+                if (byte & 0x80)
                 {
-                    if (i + 2 >= length)
-                        return 0;
-                    //i += 2;
-                } else {
-                    return 0;
+                    if (parser->shift >= 28)
+                        return -1;
+                    break;
                 }
-
-                return (buffer[i] << 8) | buffer[i + 1];
-            }
-        case MQTT_MSG_TYPE_PUBACK:
-        case MQTT_MSG_TYPE_PUBREC:
-        case MQTT_MSG_TYPE_PUBREL:
-        case MQTT_MSG_TYPE_PUBCOMP:
-        case MQTT_MSG_TYPE_SUBACK:
-        case MQTT_MSG_TYPE_UNSUBACK:
-        case MQTT_MSG_TYPE_SUBSCRIBE:
-            {
-                // This requires the remaining length to be encoded in 1 byte,
-                // which it should be.
-                if (length >= 4 && (buffer[1] & 0x80) == 0)
-                    return (buffer[2] << 8) | buffer[3];
+                packet->header_length = parser->pos;
+                packet->total_length = parser->pos + packet->remaining_length;
+                switch (packet->type)
+                {
+                    case MQTT_MSG_TYPE_PUBLISH:
+                        if (mqtt_packet_qos(packet) == 3)
+                            return -1;
+                        parser->state = MQTT_PARSE_TOPIC_LENGTH;
+                        break;
+                    case MQTT_MSG_TYPE_CONNACK:
+                        parser->state = MQTT_PARSE_CONNACK;
+                        break;
+                    case MQTT_MSG_TYPE_PUBACK:
+                    case MQTT_MSG_TYPE_PUBREC:
+                    case MQTT_MSG_TYPE_PUBREL:
+                    case MQTT_MSG_TYPE_PUBCOMP:
+                    case MQTT_MSG_TYPE_SUBSCRIBE:
+                    case MQTT_MSG_TYPE_SUBACK:
+                    case MQTT_MSG_TYPE_UNSUBSCRIBE:
+                    case MQTT_MSG_TYPE_UNSUBACK:
+                        parser->state = MQTT_PARSE_ID;
+                        break;
+                    default:
+                        parser->state = MQTT_PARSE_DONE;
+                        break;
+                }
+                break;
+
+            case MQTT_PARSE_TOPIC_LENGTH:
+                if (length < parser->pos + 2)
+                    return parser->pos + 2 - length;
+                packet->topic_length = (buffer[parser->pos] << 8) | buffer[parser->pos + 1];
+                parser->pos += 2;
+                if (parser->pos + packet->topic_length > packet->total_length)
+                    return -1;
+                parser->topic_offset = parser->pos;
+                parser->state = MQTT_PARSE_TOPIC;
+                break;
+
+            case MQTT_PARSE_TOPIC:
+                if (length < parser->pos + packet->topic_length)
+                    return parser->pos + packet->topic_length - length;
+                parser->pos += packet->topic_length;
+                if (mqtt_packet_qos(packet) > 0)
+                    parser->state = MQTT_PARSE_ID;
                 else
-                    return 0;
-            }
+                    parse_properties_next(parser);
+                break;
+
+            case MQTT_PARSE_ID:
+                if (length < parser->pos + 2)
+                    return parser->pos + 2 - length;
+                packet->msg_id = (buffer[parser->pos] << 8) | buffer[parser->pos + 1];
+                parser->pos += 2;
+                parse_properties_next(parser);
+                break;
+
+            case MQTT_PARSE_CONNACK:
+                if (length < parser->pos + 2)
+                    return parser->pos + 2 - length;
+                parser->pos += 2;
+                parse_properties_next(parser);
+                break;
+
+            case MQTT_PARSE_PROPERTIES_LENGTH:
+                if (length <= parser->pos)
+                    return 1;
+                byte = buffer[parser->pos++];
+                packet->properties_length |= (uint32_t)(byte & 0x7f) << parser->shift;
+                parser->shift += 7;
+                if (byte & 0x80)
+                {
+                    if (parser->shift >= 28)
+                        return -1;
+                    break;
+                }
+                packet->properties_offset = parser->pos;
+                if (parser->pos + packet->properties_length > packet->total_length)
+                    return -1;
+                parser->state = MQTT_PARSE_PROPERTIES;
+                break;
+
+            case MQTT_PARSE_PROPERTIES:
+                if (length < parser->pos + packet->properties_length)
+                    return parser->pos + packet->properties_length - length;
+                if (parse_properties(packet, buffer) < 0)
+                    return -1;
+                parser->pos += packet->properties_length;
+                parser->state = MQTT_PARSE_DONE;
+                break;
+        }
 
-        default:
-            return 0;
+        if (parser->pos > packet->total_length && parser->state != MQTT_PARSE_LENGTH)
+            return -1;
     }
+
+    if (packet->type == MQTT_MSG_TYPE_PUBLISH)
+        packet->topic = (const char*)(buffer + parser->topic_offset);
+    packet->payload_offset = parser->pos;
+    packet->payload_length = packet->total_length - parser->pos;
+    return 0;
 }
 
 mqtt_message_t* mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_info_t* info)
@@ -298,7 +689,11 @@ mqtt_message_t* mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_inf
     connection->message.length += sizeof(*variable_header);
 
     variable_header->lengthMsb = 0;
-#if defined(CONFIG_MQTT_PROTOCOL_311)
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+    variable_header->lengthLsb = 4;
+    memcpy(variable_header->magic, "MQTT", 4);
+    variable_header->version = 5;
+#elif defined(CONFIG_MQTT_PROTOCOL_311)
     variable_header->lengthLsb = 4;
     memcpy(variable_header->magic, "MQTT", 4);
     variable_header->version = 4;
@@ -315,6 +710,19 @@ mqtt_message_t* mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_inf
     if (info->clean_session)
         variable_header->flags |= MQTT_CONNECT_FLAG_CLEAN_SESSION;
 
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+    // Let the server alias the topics it sends us
+    if (connection->message.length + 4 > connection->buffer_length)
+        return fail_message(connection);
+    connection->buffer[connection->message.length++] = CONFIG_MQTT_MAX_TOPIC_ALIAS > 0 ? 3 : 0;
+    if (CONFIG_MQTT_MAX_TOPIC_ALIAS > 0)
+    {
+        connection->buffer[connection->message.length++] = MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM;
+        connection->buffer[connection->message.length++] = CONFIG_MQTT_MAX_TOPIC_ALIAS >> 8;
+        connection->buffer[connection->message.length++] = CONFIG_MQTT_MAX_TOPIC_ALIAS & 0xff;
+    }
+#endif
+
     if (info->client_id != NULL && info->client_id[0] != '\0')
     {
         if (append_string(connection, info->client_id, strlen(info->client_id)) < 0)
@@ -325,6 +733,9 @@ mqtt_message_t* mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_inf
 
     if (info->will_topic != NULL && info->will_topic[0] != '\0')
     {
+        if (append_empty_properties(connection) < 0)
+            return fail_message(connection);
+
         if (append_string(connection, info->will_topic, strlen(info->will_topic)) < 0)
             return fail_message(connection);
 
@@ -368,12 +779,15 @@ mqtt_message_t* mqtt_msg_publish(mqtt_connection_t* connection, const char* topi
 
     if (qos > 0)
     {
-        if ((*message_id = append_message_id(connection, 0)) == 0)
+        if ((*message_id = append_message_id(connection, *message_id)) == 0)
             return fail_message(connection);
     }
     else
         *message_id = 0;
 
+    if (append_empty_properties(connection) < 0)
+        return fail_message(connection);
+
     if (connection->message.length + data_length > connection->buffer_length)
         return fail_message(connection);
     memcpy(connection->buffer + connection->message.length, data, data_length);
@@ -382,6 +796,65 @@ mqtt_message_t* mqtt_msg_publish(mqtt_connection_t* connection, const char* topi
     return fini_message(connection, MQTT_MSG_TYPE_PUBLISH, 0, qos, retain);
 }
 
+/*
+ * mqtt_msg_publish with the topic taken ready-encoded from prepared.
+ */
+mqtt_message_t* mqtt_msg_publish_prepared(mqtt_connection_t* connection, const mqtt_prepared_topic_t* prepared, const char* data, int data_length, uint16_t* message_id)
+{
+    init_message(connection);
+
+    if (connection->message.length + prepared->length > connection->buffer_length)
+        return fail_message(connection);
+    memcpy(connection->buffer + connection->message.length, prepared->data, prepared->length);
+    connection->message.length += prepared->length;
+
+    if (prepared->qos > 0)
+    {
+        if ((*message_id = append_message_id(connection, *message_id)) == 0)
+            return fail_message(connection);
+    }
+    else
+        *message_id = 0;
+
+    if (append_empty_properties(connection) < 0)
+        return fail_message(connection);
+
+    if (connection->message.length + data_length > connection->buffer_length)
+        return fail_message(connection);
+    memcpy(connection->buffer + connection->message.length, data, data_length);
+    connection->message.length += data_length;
+
+    return fini_message(connection, MQTT_MSG_TYPE_PUBLISH, 0, prepared->qos, prepared->retain);
+}
+
+/*
+ * Encode the fixed header, topic and message id of a PUBLISH whose
+ * data_length bytes of payload the caller sends separately, right after.
+ */
+mqtt_message_t* mqtt_msg_publish_header(mqtt_connection_t* connection, const char* topic, uint32_t data_length, int qos, int retain, uint16_t* message_id)
+{
+    connection->message.length = MQTT_MAX_LONG_HEADER_SIZE;
+
+    if (topic == NULL || topic[0] == '\0')
+        return fail_message(connection);
+
+    if (append_string(connection, topic, strlen(topic)) < 0)
+        return fail_message(connection);
+
+    if (qos > 0)
+    {
+        if ((*message_id = append_message_id(connection, *message_id)) == 0)
+            return fail_message(connection);
+    }
+    else
+        *message_id = 0;
+
+    if (append_empty_properties(connection) < 0)
+        return fail_message(connection);
+
+    return fini_long_message(connection, MQTT_MSG_TYPE_PUBLISH, 0, qos, retain, data_length);
+}
+
 mqtt_message_t* mqtt_msg_puback(mqtt_connection_t* connection, uint16_t message_id)
 {
     init_message(connection);
@@ -414,42 +887,136 @@ mqtt_message_t* mqtt_msg_pubcomp(mqtt_connection_t* connection, uint16_t message
     return fini_message(connection, MQTT_MSG_TYPE_PUBCOMP, 0, 0, 0);
 }
 
-mqtt_message_t* mqtt_msg_subscribe(mqtt_connection_t* connection, const char* topic, int qos, uint16_t* message_id)
+/*
+ * Buffer size for as many of the filters as fit in max_length bytes, each
+ * taking filter_extra bytes besides its string; *packed is set to their
+ * number. Returns -1 if one of them is empty or the first does not fit.
+ */
+static int filters_length(const mqtt_topic_t* topics, int count, int max_length, int filter_extra, int* packed)
 {
+    int length = MQTT_MAX_FIXED_HEADER_SIZE + 2 + MQTT_EMPTY_PROPERTIES_SIZE;
+    int i, len;
+
+    for (i = 0; i < count; i++)
+    {
+        if (topics[i].topic == NULL || topics[i].topic[0] == '\0')
+            break;
+        len = 2 + strlen(topics[i].topic) + filter_extra;
+        if (length + len > max_length)
+            break;
+        length += len;
+    }
+
+    *packed = i;
+    if (i == 0 || (i < count && (topics[i].topic == NULL || topics[i].topic[0] == '\0')))
+        return -1;
+    return length + fixed_header_slack(length - MQTT_MAX_FIXED_HEADER_SIZE);
+}
+
+/*
+ * Buffer size mqtt_msg_subscribe_multiple needs for the filters it would
+ * pack into a buffer of max_length bytes, their number set in *packed; -1
+ * if it would fail.
+ */
+int mqtt_msg_subscribe_length(const mqtt_topic_t* topics, int count, int max_length, int* packed)
+{
+    return filters_length(topics, count, max_length, 1, packed);
+}
+
+/*
+ * mqtt_msg_subscribe_length for mqtt_msg_unsubscribe_multiple.
+ */
+int mqtt_msg_unsubscribe_length(const mqtt_topic_t* topics, int count, int max_length, int* packed)
+{
+    return filters_length(topics, count, max_length, 0, packed);
+}
+
+/*
+ * Pack topics[0], topics[1], ... into one SUBSCRIBE until the buffer is
+ * full. *packed is set to the number of filters in the packet; the caller
+ * sends the rest in further packets.
+ */
+mqtt_message_t* mqtt_msg_subscribe_multiple(mqtt_connection_t* connection, const mqtt_topic_t* topics, int count, int* packed, uint16_t* message_id)
+{
+    int i, len;
+
     init_message(connection);
+    *packed = 0;
 
-    if (topic == NULL || topic[0] == '\0')
+    if ((*message_id = append_message_id(connection, *message_id)) == 0)
         return fail_message(connection);
 
-    if ((*message_id = append_message_id(connection, 0)) == 0)
+    if (append_empty_properties(connection) < 0)
         return fail_message(connection);
 
-    if (append_string(connection, topic, strlen(topic)) < 0)
-        return fail_message(connection);
+    for (i = 0; i < count; i++)
+    {
+        if (topics[i].topic == NULL || topics[i].topic[0] == '\0')
+            return fail_message(connection);
 
-    if (connection->message.length + 1 > connection->buffer_length)
+        len = strlen(topics[i].topic);
+        if (connection->message.length + len + 3 > connection->buffer_length)
+            break;
+        append_string(connection, topics[i].topic, len);
+        connection->buffer[connection->message.length++] = topics[i].qos;
+    }
+
+    if (i == 0)
         return fail_message(connection);
-    connection->buffer[connection->message.length++] = qos;
+    *packed = i;
 
     return fini_message(connection, MQTT_MSG_TYPE_SUBSCRIBE, 0, 1, 0);
 }
 
-mqtt_message_t* mqtt_msg_unsubscribe(mqtt_connection_t* connection, const char* topic, uint16_t* message_id)
+mqtt_message_t* mqtt_msg_subscribe(mqtt_connection_t* connection, const char* topic, int qos, uint16_t* message_id)
 {
+    mqtt_topic_t filter = { topic, qos };
+    int packed;
+
+    return mqtt_msg_subscribe_multiple(connection, &filter, 1, &packed, message_id);
+}
+
+/*
+ * UNSUBSCRIBE counterpart of mqtt_msg_subscribe_multiple, qos is ignored.
+ */
+mqtt_message_t* mqtt_msg_unsubscribe_multiple(mqtt_connection_t* connection, const mqtt_topic_t* topics, int count, int* packed, uint16_t* message_id)
+{
+    int i, len;
+
     init_message(connection);
+    *packed = 0;
 
-    if (topic == NULL || topic[0] == '\0')
+    if ((*message_id = append_message_id(connection, *message_id)) == 0)
         return fail_message(connection);
 
-    if ((*message_id = append_message_id(connection, 0)) == 0)
+    if (append_empty_properties(connection) < 0)
         return fail_message(connection);
 
-    if (append_string(connection, topic, strlen(topic)) < 0)
+    for (i = 0; i < count; i++)
+    {
+        if (topics[i].topic == NULL || topics[i].topic[0] == '\0')
+            return fail_message(connection);
+
+        len = strlen(topics[i].topic);
+        if (append_string(connection, topics[i].topic, len) < 0)
+            break;
+    }
+
+    if (i == 0)
         return fail_message(connection);
+    *packed = i;
 
     return fini_message(connection, MQTT_MSG_TYPE_UNSUBSCRIBE, 0, 1, 0);
 }
 
+mqtt_message_t* mqtt_msg_unsubscribe(mqtt_connection_t* connection, const char* topic, uint16_t* message_id)
+{
+    mqtt_topic_t filter = { topic, 0 };
+    int packed;
+
+    return mqtt_msg_unsubscribe_multiple(connection, &filter, 1, &packed, message_id);
+}
+
 mqtt_message_t* mqtt_msg_pingreq(mqtt_connection_t* connection)
 {
     init_message(connection);
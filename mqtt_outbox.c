@@ -0,0 +1,483 @@
+/**
+* \file
+*   Outbound packet queue, one record per packet on top of RINGBUF
+*/
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mqtt_outbox.h"
+
+#define OUTBOX_HEADER_SIZE offsetof(mqtt_outbox_record_t, data)
+// 4 bytes on the ESP32, 8 on 64-bit hosts
+#define OUTBOX_ALIGNMENT __alignof__(mqtt_outbox_record_t)
+#define OUTBOX_ALIGN(n) (((n) + OUTBOX_ALIGNMENT - 1) & ~(OUTBOX_ALIGNMENT - 1))
+
+static bool outbox_set_state(mqtt_outbox_record_t* rec, uint32_t from, uint32_t to)
+{
+    return __atomic_compare_exchange_n(&rec->state, &from, to, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/*
+ * Hand an external payload back to the task waiting on it. The waiter may
+ * return as soon as done is set, so nothing in payload is touched after.
+ */
+static void outbox_complete(mqtt_outbox_record_t* rec, int result)
+{
+    mqtt_outbox_payload_t* payload = rec->payload;
+    TaskHandle_t waiter;
+
+    if (payload == NULL)
+        return;
+    waiter = payload->waiter;
+    payload->result = result;
+    __atomic_store_n(&payload->done, 1, __ATOMIC_RELEASE);
+    xTaskNotifyGive(waiter);
+}
+
+/*
+ * Lane a record was reserved in.
+ */
+static RINGBUF* outbox_lane_of(mqtt_outbox_t* ob, mqtt_outbox_record_t* rec)
+{
+    RINGBUF* urgent = &ob->lanes[OUTBOX_LANE_URGENT];
+    uint8_t* ptr = (uint8_t*)rec;
+
+    return ptr >= urgent->p_o && ptr < urgent->p_o + urgent->size ? urgent : &ob->lanes[OUTBOX_LANE_BULK];
+}
+
+/*
+ * Take over the record at read index pos by moving its state from from to
+ * to. Fails if it is not in state from, or no longer at the read index.
+ */
+static bool outbox_take(RINGBUF* rb, mqtt_outbox_record_t* rec, uint32_t pos, uint32_t from, uint32_t to)
+{
+    if (!outbox_set_state(rec, from, to))
+        return false;
+    // The record may have been freed and its bytes claimed again since pos
+    // was read; only whoever owns the record at the read index moves it
+    if (__atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE) != pos) {
+        __atomic_store_n(&rec->state, from, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Oldest live record of a lane, freeing the skipped ends of buffer and
+ * discarded records found in front of it. pos is set to its read index.
+ * Returns NULL if the lane is empty, or its oldest record is not written yet
+ * or being freed.
+ */
+static mqtt_outbox_record_t* outbox_head(mqtt_outbox_t* ob, RINGBUF* rb, uint32_t* pos)
+{
+    mqtt_outbox_record_t* rec;
+    uint32_t state;
+    uint8_t* ptr;
+    int32_t n;
+
+    while ((n = rb_peek_at(rb, pos, &ptr)) > 0) {
+        rec = (mqtt_outbox_record_t*)ptr;
+        state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if (state == OUTBOX_PENDING || state == OUTBOX_CLAIMED)
+            return rec;
+        if (state == OUTBOX_SKIPPED) {
+            // Skipped ends of buffer run to the end of it
+            if (outbox_take(rb, rec, *pos, OUTBOX_SKIPPED, OUTBOX_FREEING))
+                rb_release(rb, n);
+        } else if (state == OUTBOX_DISCARDED) {
+            if (outbox_take(rb, rec, *pos, OUTBOX_DISCARDED, OUTBOX_FREEING))
+                rb_release(rb, rec->size);
+        } else {
+            return NULL;
+        }
+        // The sending task may have found the record being freed and gone to sleep
+        xSemaphoreGive(ob->ready);
+    }
+    return NULL;
+}
+
+/**
+* \brief init an outbox on top of a byte array
+* \param ob pointer to the outbox
+* \param buf pointer to a byte array, aligned as mqtt_outbox_record_t
+* \param size size of buf
+* \param urgent_size bytes of buf, at its end, given to the urgent lane
+* \return 0 if successfull, otherwise failed
+*/
+int outbox_init(mqtt_outbox_t* ob, uint8_t* buf, int size, int urgent_size)
+{
+    int bulk_size = (size - urgent_size) & ~(OUTBOX_ALIGNMENT - 1);
+
+    memset(ob, 0, sizeof(*ob));
+    // rb_claim relies on free ring bytes being zero
+    memset(buf, 0, size);
+    ob->ready = xSemaphoreCreateBinary();
+    if (ob->ready == NULL)
+        return -1;
+    if (rb_init(&ob->lanes[OUTBOX_LANE_BULK], buf, bulk_size) != 0 ||
+        rb_init(&ob->lanes[OUTBOX_LANE_URGENT], buf + bulk_size,
+                (size - bulk_size) & ~(OUTBOX_ALIGNMENT - 1)) != 0) {
+        outbox_deinit(ob);
+        return -1;
+    }
+    return 0;
+}
+
+void outbox_deinit(mqtt_outbox_t* ob)
+{
+    rb_deinit(&ob->lanes[OUTBOX_LANE_BULK]);
+    rb_deinit(&ob->lanes[OUTBOX_LANE_URGENT]);
+    if (ob->ready != NULL)
+        vSemaphoreDelete(ob->ready);
+    ob->ready = NULL;
+}
+
+/**
+* \brief largest packet, encoder slack included, a record of lane can hold
+*/
+int outbox_max_length(mqtt_outbox_t* ob, int lane)
+{
+    int size = ob->lanes[lane].size < 0xfffc ? ob->lanes[lane].size : 0xfffc;
+    return size - (int)OUTBOX_HEADER_SIZE;
+}
+
+/**
+* \brief reserve a record able to hold len bytes of packet
+* \param lane OUTBOX_LANE_BULK or OUTBOX_LANE_URGENT
+* \return where the packet should be encoded, NULL on timeout
+* The record must then be passed to outbox_commit, even if encoding failed.
+*/
+uint8_t* outbox_reserve(mqtt_outbox_t* ob, int lane, int len, TickType_t ticks_to_wait)
+{
+    mqtt_outbox_record_t* rec;
+    int size = OUTBOX_ALIGN(OUTBOX_HEADER_SIZE + len);
+
+    if (len > outbox_max_length(ob, lane))
+        return NULL;
+    rec = (mqtt_outbox_record_t*)rb_claim(&ob->lanes[lane], size, ticks_to_wait);
+    if (rec == NULL)
+        return NULL;
+    rec->size = size;
+    return rec->data;
+}
+
+/**
+* \brief queue the packet encoded in a reserved record
+* \param ob pointer to the outbox
+* \param data pointer returned by outbox_reserve
+* \param msg packet encoded at or after data, of length 0 to give the record back
+* \param msg_id packet identifier, 0 if none
+* \param payload payload sent after the packet, NULL if none
+*/
+void outbox_commit(mqtt_outbox_t* ob, uint8_t* data, mqtt_message_t* msg, uint16_t msg_id,
+                   mqtt_outbox_payload_t* payload)
+{
+    mqtt_outbox_record_t* rec = (mqtt_outbox_record_t*)(data - OUTBOX_HEADER_SIZE);
+
+    if (msg->length == 0) {
+        __atomic_store_n(&rec->state, OUTBOX_DISCARDED, __ATOMIC_RELEASE);
+    } else {
+        rec->offset = msg->data - data;
+        rec->length = msg->length;
+        rec->header = msg->data[0];
+        rec->msg_id = msg_id;
+        rec->payload = payload;
+        rec->timestamp = xTaskGetTickCount();
+        __atomic_add_fetch(&ob->count, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&rec->state, OUTBOX_PENDING, __ATOMIC_RELEASE);
+    }
+    xSemaphoreGive(ob->ready);
+}
+
+/**
+* \brief sleep until the record carrying payload is released or discarded
+* \return 0 if the payload was sent, -1 otherwise
+* Uses the calling task's notification.
+*/
+int outbox_wait_payload(mqtt_outbox_payload_t* payload)
+{
+    while (!__atomic_load_n(&payload->done, __ATOMIC_ACQUIRE))
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    return payload->result;
+}
+
+/**
+* \brief oldest queued record of a lane, left in the queue
+*/
+mqtt_outbox_record_t* outbox_front(mqtt_outbox_t* ob, int lane)
+{
+    uint32_t pos;
+
+    return outbox_head(ob, &ob->lanes[lane], &pos);
+}
+
+/**
+* \brief take the next record for sending, sleeping while the outbox is empty
+* \return the record, NULL on timeout or after outbox_wake
+* The urgent lane is drained before the bulk one. There is a single sending
+* task, so a record still claimed here was left behind by a previous one and
+* is taken over.
+*/
+mqtt_outbox_record_t* outbox_claim(mqtt_outbox_t* ob, TickType_t ticks_to_wait)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed;
+    mqtt_outbox_record_t* rec;
+    uint32_t pos;
+    int lane;
+
+    while (1) {
+        for (lane = OUTBOX_LANE_URGENT; lane >= OUTBOX_LANE_BULK; lane--) {
+            while ((rec = outbox_head(ob, &ob->lanes[lane], &pos)) != NULL) {
+                if (rec->state == OUTBOX_CLAIMED ||
+                    outbox_take(&ob->lanes[lane], rec, pos, OUTBOX_PENDING, OUTBOX_CLAIMED))
+                    return rec;
+            }
+        }
+        if (__atomic_exchange_n(&ob->woken, 0, __ATOMIC_ACQUIRE))
+            return NULL;
+        // ready may have been given for a record claimed since, so keep
+        // waiting out the whole timeout
+        elapsed = xTaskGetTickCount() - start;
+        if (ticks_to_wait != portMAX_DELAY && elapsed >= ticks_to_wait)
+            return NULL;
+        xSemaphoreTake(ob->ready, ticks_to_wait == portMAX_DELAY ? portMAX_DELAY : ticks_to_wait - elapsed);
+    }
+}
+
+/**
+* \brief have outbox_claim return NULL now if it is waiting, or on its next call
+* if nothing is queued by then, e.g. for the sending task to see it must exit
+*/
+void outbox_wake(mqtt_outbox_t* ob)
+{
+    __atomic_store_n(&ob->woken, 1, __ATOMIC_RELEASE);
+    xSemaphoreGive(ob->ready);
+}
+
+/**
+* \brief record reserved right after rec in its lane, whatever its state
+* Only meaningful while rec is claimed, so that the ring cannot move under it.
+*/
+mqtt_outbox_record_t* outbox_next(mqtt_outbox_t* ob, mqtt_outbox_record_t* rec)
+{
+    RINGBUF* rb = outbox_lane_of(ob, rec);
+    uint8_t* ptr = (uint8_t*)rec + rec->size;
+
+    if (ptr == rb->p_o + rb->size)
+        ptr = rb->p_o;
+    return (mqtt_outbox_record_t*)ptr;
+}
+
+/**
+* \brief claim the record queued right after a claimed one, to send them together
+* \param ob pointer to the outbox
+* \param rec record claimed by the caller
+* \param max_length longest packet wanted; a record with an external payload never is
+* \param ticks_to_wait how long to wait for the next record to be queued
+* \return the record, NULL if there is none or it is not wanted
+* Only the bulk lane is waited on, and the wait ends early once a record
+* is queued in the urgent lane.
+*/
+mqtt_outbox_record_t* outbox_claim_next(mqtt_outbox_t* ob, mqtt_outbox_record_t* rec, int max_length,
+                                        TickType_t ticks_to_wait)
+{
+    RINGBUF* rb = outbox_lane_of(ob, rec);
+    mqtt_outbox_record_t* next = outbox_next(ob, rec);
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed;
+    uint32_t state;
+
+    if (rb != &ob->lanes[OUTBOX_LANE_BULK])
+        ticks_to_wait = 0;
+    while (1) {
+        state = __atomic_load_n(&next->state, __ATOMIC_ACQUIRE);
+        if (state == OUTBOX_PENDING) {
+            if (next->payload != NULL || next->length > max_length)
+                return NULL;
+            // Only the sending task claims, so the record is still pending
+            // unless an evicting producer holds it for a moment
+            return outbox_set_state(next, OUTBOX_PENDING, OUTBOX_CLAIMED) ? next : NULL;
+        }
+        // Any other state than not written yet cannot turn into a record
+        // to send behind rec
+        if (state != OUTBOX_FREE)
+            return NULL;
+        elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= ticks_to_wait || outbox_front(ob, OUTBOX_LANE_URGENT) != NULL)
+            return NULL;
+        xSemaphoreTake(ob->ready, ticks_to_wait - elapsed);
+    }
+}
+
+/**
+* \brief drop a claimed record once it has been sent
+* Records claimed together must be released in the order they were claimed.
+*/
+void outbox_release(mqtt_outbox_t* ob, mqtt_outbox_record_t* rec)
+{
+    // For evicting producers reading the record, see outbox_evict
+    __atomic_store_n(&rec->state, OUTBOX_FREEING, __ATOMIC_RELAXED);
+    outbox_complete(rec, 0);
+    __atomic_sub_fetch(&ob->count, 1, __ATOMIC_RELAXED);
+    rb_release(outbox_lane_of(ob, rec), rec->size);
+}
+
+/**
+* \brief hand claimed but unsent records back, e.g. after a write error
+*/
+void outbox_unclaim(mqtt_outbox_t* ob)
+{
+    mqtt_outbox_record_t* rec;
+    int lane;
+
+    for (lane = OUTBOX_LANE_BULK; lane < OUTBOX_LANES; lane++) {
+        rec = outbox_front(ob, lane);
+        // Claimed records run back to back from the front of the lane
+        while (rec != NULL && outbox_set_state(rec, OUTBOX_CLAIMED, OUTBOX_PENDING))
+            rec = outbox_next(ob, rec);
+    }
+}
+
+/*
+ * Whether a record may be evicted. Its header is only stable once the
+ * caller holds it in OUTBOX_FREEING.
+ */
+static bool outbox_evictable(mqtt_outbox_record_t* rec, int max_qos)
+{
+    return outbox_type(rec) == MQTT_MSG_TYPE_PUBLISH && outbox_qos(rec) <= max_qos;
+}
+
+/*
+ * Drop an evicted record held in OUTBOX_FREEING from the count, and hand
+ * its payload back.
+ */
+static void outbox_discard(mqtt_outbox_t* ob, mqtt_outbox_record_t* rec, mqtt_outbox_record_t* evicted)
+{
+    if (evicted != NULL)
+        *evicted = *rec;
+    outbox_complete(rec, -1);
+    __atomic_sub_fetch(&ob->count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Bytes from read index from on to read index to.
+ */
+static uint32_t outbox_distance(RINGBUF* rb, uint32_t from, uint32_t to)
+{
+    return to >= from ? to - from : to + 2 * rb->size - from;
+}
+
+/*
+ * Whether read index pos is still behind the oldest record, so that the
+ * record there has not been freed.
+ */
+static bool outbox_behind(RINGBUF* rb, uint32_t pos)
+{
+    uint32_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+    uint32_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+
+    return pos != tail && outbox_distance(rb, tail, pos) < outbox_distance(rb, tail, head);
+}
+
+/*
+ * Size of the record at pos, 0 if it is being freed or still being
+ * written, in which case the records after it are not looked at. Freeing
+ * sets the state before the record is zeroed, see rb_release, so a state
+ * read after the size tells whether the size was intact.
+ */
+static int outbox_size_at(RINGBUF* rb, mqtt_outbox_record_t* rec, uint32_t* state)
+{
+    int size = rec->size;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    *state = __atomic_load_n(&rec->state, __ATOMIC_RELAXED);
+    if (*state == OUTBOX_SKIPPED)
+        return rb->size - ((uint8_t*)rec - rb->p_o);
+    if (*state == OUTBOX_FREE || size == 0)
+        return 0;
+    return size;
+}
+
+/**
+* \brief discard the oldest PUBLISH of at most max_qos queued in a lane and not being sent
+* \param ob pointer to the outbox
+* \param lane lane to discard from
+* \param max_qos highest QoS that may be discarded
+* \param evicted set to the discarded record's header, may be NULL
+* \return number of ring bytes the record took, 0 if nothing could be discarded
+* The oldest record is freed right away. One queued behind records being sent
+* or kept is discarded in place, its bytes freed once the sending task gets
+* past those, so the caller may have to wait for the room. Records behind one
+* still being written are not looked at.
+*/
+int outbox_evict(mqtt_outbox_t* ob, int lane, int max_qos, mqtt_outbox_record_t* evicted)
+{
+    RINGBUF* rb = &ob->lanes[lane];
+    mqtt_outbox_record_t* rec;
+    uint32_t pos, state;
+    int size;
+
+    rec = outbox_head(ob, rb, &pos);
+    if (rec == NULL)
+        return 0;
+    if (outbox_take(rb, rec, pos, OUTBOX_PENDING, OUTBOX_FREEING)) {
+        if (outbox_evictable(rec, max_qos)) {
+            size = rec->size;
+            outbox_discard(ob, rec, evicted);
+            rb_release(rb, size);
+            // The sending task may have found the record being freed and gone to sleep
+            xSemaphoreGive(ob->ready);
+            return size;
+        }
+        __atomic_store_n(&rec->state, OUTBOX_PENDING, __ATOMIC_RELEASE);
+    }
+    size = outbox_size_at(rb, rec, &state);
+    if (size == 0 || state == OUTBOX_FREEING || __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE) != pos)
+        return 0;
+
+    while (1) {
+        pos += size;
+        if (pos >= 2 * (uint32_t)rb->size)
+            pos -= 2 * (uint32_t)rb->size;
+        rec = (mqtt_outbox_record_t*)(rb->p_o + (pos < (uint32_t)rb->size ? pos : pos - rb->size));
+        if (!outbox_behind(rb, pos))
+            return 0;
+        size = outbox_size_at(rb, rec, &state);
+        // The record may have been freed while being read
+        if (size == 0 || !outbox_behind(rb, pos))
+            return 0;
+        if (state != OUTBOX_PENDING || !outbox_set_state(rec, OUTBOX_PENDING, OUTBOX_FREEING))
+            continue;
+        if (outbox_behind(rb, pos) && outbox_evictable(rec, max_qos)) {
+            outbox_discard(ob, rec, evicted);
+            __atomic_store_n(&rec->state, OUTBOX_DISCARDED, __ATOMIC_RELEASE);
+            xSemaphoreGive(ob->ready);
+            return size;
+        }
+        __atomic_store_n(&rec->state, OUTBOX_PENDING, __ATOMIC_RELEASE);
+        xSemaphoreGive(ob->ready);
+    }
+}
+
+/**
+* \brief discard every record, claimed ones included
+* Only safe once the sending task is gone.
+*/
+void outbox_clear(mqtt_outbox_t* ob)
+{
+    mqtt_outbox_record_t* rec;
+    uint32_t pos;
+    int lane;
+
+    for (lane = OUTBOX_LANE_BULK; lane < OUTBOX_LANES; lane++) {
+        while ((rec = outbox_head(ob, &ob->lanes[lane], &pos)) != NULL) {
+            outbox_complete(rec, -1);
+            __atomic_sub_fetch(&ob->count, 1, __ATOMIC_RELAXED);
+            rb_release(&ob->lanes[lane], rec->size);
+        }
+    }
+}
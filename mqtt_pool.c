@@ -0,0 +1,117 @@
+/**
+* \file
+*   Reference counted receive buffers
+*/
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "mqtt_pool.h"
+
+static mqtt_buffer_t* pool_buffer(mqtt_pool_t* pool, int i)
+{
+    return (mqtt_buffer_t*)(pool->buffers + i * pool->stride);
+}
+
+static void pool_unuse(mqtt_pool_t* pool)
+{
+    if (__atomic_sub_fetch(&pool->users, 1, __ATOMIC_ACQ_REL) == 0) {
+        vSemaphoreDelete(pool->released);
+        free(pool);
+    }
+}
+
+/**
+* \brief allocate a pool of free buffers
+* \param count number of buffers
+* \param size bytes of data in each buffer
+* \return the pool, NULL if memory is short
+*/
+mqtt_pool_t* pool_create(int count, int size)
+{
+    // Aligned for the buffer header: 4 bytes on the ESP32, 8 on 64-bit hosts
+    int stride = (offsetof(mqtt_buffer_t, data) + size + __alignof__(mqtt_buffer_t) - 1) &
+                 ~(__alignof__(mqtt_buffer_t) - 1);
+    mqtt_pool_t* pool;
+    int i;
+
+    pool = malloc(sizeof(mqtt_pool_t) + count * stride);
+    if (pool == NULL)
+        return NULL;
+    memset(pool, 0, sizeof(mqtt_pool_t));
+    pool->released = xSemaphoreCreateBinary();
+    if (pool->released == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->users = 1;
+    pool->count = count;
+    pool->size = size;
+    pool->stride = stride;
+    for (i = 0; i < count; i++) {
+        pool_buffer(pool, i)->pool = pool;
+        pool_buffer(pool, i)->refs = 0;
+    }
+    return pool;
+}
+
+/**
+* \brief give up the pool, freed once every buffer has been released
+*/
+void pool_destroy(mqtt_pool_t* pool)
+{
+    if (pool != NULL)
+        pool_unuse(pool);
+}
+
+/**
+* \brief take a free buffer, sleeping while every one is in use
+* \return the buffer, holding one reference, NULL on timeout
+*/
+mqtt_buffer_t* pool_get(mqtt_pool_t* pool, TickType_t ticks_to_wait)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed;
+    mqtt_buffer_t* buffer;
+    uint32_t free_refs;
+    int i;
+
+    while (1) {
+        for (i = 0; i < pool->count; i++) {
+            buffer = pool_buffer(pool, i);
+            free_refs = 0;
+            if (__atomic_compare_exchange_n(&buffer->refs, &free_refs, 1, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                __atomic_add_fetch(&pool->users, 1, __ATOMIC_RELAXED);
+                return buffer;
+            }
+        }
+        elapsed = xTaskGetTickCount() - start;
+        if (ticks_to_wait != portMAX_DELAY && elapsed >= ticks_to_wait)
+            return NULL;
+        xSemaphoreTake(pool->released, ticks_to_wait == portMAX_DELAY ? portMAX_DELAY : ticks_to_wait - elapsed);
+    }
+}
+
+/**
+* \brief take one more reference to a buffer in use
+*/
+void pool_retain(mqtt_buffer_t* buffer)
+{
+    __atomic_add_fetch(&buffer->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+* \brief drop a reference, putting the buffer back in the pool with the last one
+*/
+void pool_release(mqtt_buffer_t* buffer)
+{
+    mqtt_pool_t* pool = buffer->pool;
+
+    if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    xSemaphoreGive(pool->released);
+    pool_unuse(pool);
+}
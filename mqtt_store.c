@@ -0,0 +1,527 @@
+/**
+* \file
+*   Persistent queue of QoS 1 and 2 publishes, as segment files
+*/
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mqtt_msg.h"
+#include "mqtt_store.h"
+
+#define STORE_MAGIC 0xa5
+#define STORE_LIVE 0xff
+#define STORE_ACKED 0x00
+#define STORE_HEADER_SIZE 6
+#define STORE_PATH_SIZE (sizeof(CONFIG_MQTT_STORE_PATH) + 16)
+
+/*
+ * Record header: magic, state, packet length and offset of the packet
+ * identifier in the packet, both big endian.
+ */
+typedef struct store_record
+{
+  uint8_t state;
+  uint16_t length;
+  uint16_t id_offset;
+} store_record_t;
+
+static void store_path(char* path, uint32_t number)
+{
+    snprintf(path, STORE_PATH_SIZE, "%s/%08x.seg", CONFIG_MQTT_STORE_PATH, (unsigned)number);
+}
+
+static int store_read_header(FILE* file, store_record_t* rec)
+{
+    uint8_t header[STORE_HEADER_SIZE];
+
+    if (fread(header, 1, STORE_HEADER_SIZE, file) != STORE_HEADER_SIZE || header[0] != STORE_MAGIC)
+        return -1;
+    rec->state = header[1];
+    rec->length = header[2] << 8 | header[3];
+    rec->id_offset = header[4] << 8 | header[5];
+    return rec->id_offset + 2 <= rec->length ? 0 : -1;
+}
+
+static mqtt_store_segment_t* store_segment(mqtt_store_t* store, int index)
+{
+    return &store->segments[(store->first + index) % CONFIG_MQTT_STORE_MAX_SEGMENTS];
+}
+
+static mqtt_store_segment_t* store_find(mqtt_store_t* store, uint32_t number, int* index)
+{
+    int i;
+
+    for (i = 0; i < store->count; i++) {
+        if (store_segment(store, i)->number == number) {
+            if (index != NULL)
+                *index = i;
+            return store_segment(store, i);
+        }
+    }
+    return NULL;
+}
+
+static void store_close(FILE** file)
+{
+    if (*file != NULL)
+        fclose(*file);
+    *file = NULL;
+}
+
+static FILE* store_seek(mqtt_store_t* store, uint32_t number, uint32_t offset)
+{
+    char path[STORE_PATH_SIZE];
+
+    if (store->seek_file == NULL || store->seek_file_number != number) {
+        store_close(&store->seek_file);
+        store_path(path, number);
+        store->seek_file = fopen(path, "r+b");
+        store->seek_file_number = number;
+    }
+    if (store->seek_file == NULL || fseek(store->seek_file, offset, SEEK_SET) != 0)
+        return NULL;
+    return store->seek_file;
+}
+
+/*
+ * Position read_file at the read cursor, keeping its buffer when it is
+ * there already.
+ */
+static FILE* store_reader(mqtt_store_t* store)
+{
+    char path[STORE_PATH_SIZE];
+
+    if (store->read_file == NULL || store->read_file_number != store->read_number) {
+        store_close(&store->read_file);
+        store_path(path, store->read_number);
+        store->read_file = fopen(path, "rb");
+        store->read_file_number = store->read_number;
+        if (store->read_file == NULL)
+            return NULL;
+        if (store->read_buffer != NULL)
+            setvbuf(store->read_file, (char*)store->read_buffer, _IOFBF, CONFIG_MQTT_STORE_READ_BUFFER);
+    }
+    // Appends since the last read may have left the stream at end of file
+    clearerr(store->read_file);
+    if (ftell(store->read_file) != (long)store->read_offset &&
+        fseek(store->read_file, store->read_offset, SEEK_SET) != 0)
+        return NULL;
+    return store->read_file;
+}
+
+/*
+ * A write to the newest segment failed: give up on the records not known
+ * to be written, and have the next append start a new segment, as the
+ * file may end with a torn record.
+ */
+static void store_write_failed(mqtt_store_t* store)
+{
+    mqtt_store_segment_t* seg = store_segment(store, store->count - 1);
+
+    seg->size = store->synced_size;
+    seg->live -= store->unsynced;
+    store->lost += store->unsynced;
+    store->unsynced = 0;
+    store_close(&store->write_file);
+}
+
+/*
+ * Write the records appended so far through to the file system.
+ */
+static void store_flush(mqtt_store_t* store)
+{
+    if (store->write_file == NULL || store->unsynced == 0)
+        return;
+    if (fflush(store->write_file) != 0) {
+        store_write_failed(store);
+        return;
+    }
+    store->synced_size = store_segment(store, store->count - 1)->size;
+    store->unsynced = 0;
+}
+
+static int store_create(mqtt_store_t* store)
+{
+    char path[STORE_PATH_SIZE];
+    mqtt_store_segment_t* seg;
+
+    if (store->count == CONFIG_MQTT_STORE_MAX_SEGMENTS)
+        return STORE_FULL;
+    store_flush(store);
+    store_close(&store->write_file);
+    store_path(path, store->next_number);
+    store->write_file = fopen(path, "wb");
+    if (store->write_file == NULL)
+        return -1;
+    seg = store_segment(store, store->count++);
+    seg->number = store->next_number++;
+    seg->size = 0;
+    seg->live = 0;
+    store->synced_size = 0;
+    store->unsynced = 0;
+    return 0;
+}
+
+/*
+ * Delete the oldest segments once read through and fully acked. The
+ * segment being appended to is kept.
+ */
+static void store_trim(mqtt_store_t* store)
+{
+    char path[STORE_PATH_SIZE];
+    mqtt_store_segment_t* seg;
+
+    while (store->count > 1) {
+        seg = store_segment(store, 0);
+        if (seg->live > 0 || seg->number == store->read_number)
+            break;
+        if (store->read_file_number == seg->number)
+            store_close(&store->read_file);
+        if (store->seek_file_number == seg->number)
+            store_close(&store->seek_file);
+        store_path(path, seg->number);
+        remove(path);
+        store->first = (store->first + 1) % CONFIG_MQTT_STORE_MAX_SEGMENTS;
+        store->count--;
+    }
+}
+
+/*
+ * Count the records of a segment left by a previous run, up to the first
+ * one cut short. One with records not acked is never deleted, even when
+ * there is no room left to take it.
+ */
+static void store_scan(mqtt_store_t* store, uint32_t number)
+{
+    char path[STORE_PATH_SIZE];
+    mqtt_store_segment_t* seg;
+    store_record_t rec;
+    uint32_t size = 0, live = 0;
+    long end;
+    FILE* file;
+
+    store_path(path, number);
+    file = fopen(path, "rb");
+    if (file == NULL)
+        return;
+    fseek(file, 0, SEEK_END);
+    end = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    while (store_read_header(file, &rec) == 0 &&
+           size + STORE_HEADER_SIZE + rec.length <= (uint32_t)end) {
+        if (rec.state == STORE_LIVE)
+            live++;
+        size += STORE_HEADER_SIZE + rec.length;
+        fseek(file, size, SEEK_SET);
+    }
+    fclose(file);
+
+    if (live == 0) {
+        remove(path);
+        return;
+    }
+    if (store->count == CONFIG_MQTT_STORE_MAX_SEGMENTS)
+        return;
+    seg = store_segment(store, store->count++);
+    seg->number = number;
+    seg->size = size;
+    seg->live = live;
+}
+
+/**
+* \brief open the store, picking up the records a previous run left unacked
+* \return 0 if successfull, otherwise failed
+*/
+int store_init(mqtt_store_t* store)
+{
+    struct dirent* entry;
+    unsigned number, min = 0xffffffff, max = 0;
+    bool found = false;
+    uint32_t n;
+    DIR* dir;
+
+    memset(store, 0, sizeof(*store));
+    store->lock = xSemaphoreCreateMutex();
+    store->read_buffer = malloc(CONFIG_MQTT_STORE_READ_BUFFER);
+    if (store->lock == NULL) {
+        store_deinit(store);
+        return -1;
+    }
+
+    mkdir(CONFIG_MQTT_STORE_PATH, 0755);
+    dir = opendir(CONFIG_MQTT_STORE_PATH);
+    if (dir != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (strlen(entry->d_name) != 12 || strcmp(entry->d_name + 8, ".seg") != 0 ||
+                sscanf(entry->d_name, "%8x", &number) != 1)
+                continue;
+            min = number < min ? number : min;
+            max = number > max ? number : max;
+            found = true;
+        }
+        closedir(dir);
+    }
+    for (n = min; found; n++) {
+        store_scan(store, n);
+        if (n == max)
+            break;
+    }
+
+    store->next_number = found ? max + 1 : 0;
+    store->read_number = store->count > 0 ? store_segment(store, 0)->number : store->next_number;
+    // Never append to a segment that may end with a torn record. With every
+    // segment taken, store_append creates it once one is trimmed.
+    if (store_create(store) == -1) {
+        store_deinit(store);
+        return -1;
+    }
+    return 0;
+}
+
+void store_deinit(mqtt_store_t* store)
+{
+    store_close(&store->write_file);
+    store_close(&store->read_file);
+    store_close(&store->seek_file);
+    free(store->read_buffer);
+    if (store->lock != NULL)
+        vSemaphoreDelete(store->lock);
+    memset(store, 0, sizeof(*store));
+}
+
+/**
+* \brief take the store for a sequence of calls; every other function requires it
+*/
+void store_lock(mqtt_store_t* store)
+{
+    xSemaphoreTake(store->lock, portMAX_DELAY);
+}
+
+void store_unlock(mqtt_store_t* store)
+{
+    xSemaphoreGive(store->lock);
+}
+
+/**
+* \brief append an encoded QoS 1 or 2 PUBLISH
+* \return 0 if successfull, STORE_FULL while every segment holds records
+* not acked, -1 if the packet is not one or on a write error
+*/
+int store_append(mqtt_store_t* store, const uint8_t* packet, int length)
+{
+    mqtt_store_segment_t* seg = store_segment(store, store->count - 1);
+    mqtt_parser_t parser;
+    uint8_t header[STORE_HEADER_SIZE];
+    uint32_t id_offset;
+    int result;
+
+    mqtt_parser_init(&parser);
+    if (mqtt_parse(&parser, packet, length) != 0 || parser.packet.type != MQTT_MSG_TYPE_PUBLISH ||
+        parser.packet.msg_id == 0 || length > 0xffff)
+        return -1;
+    id_offset = (const uint8_t*)parser.packet.topic - packet + parser.packet.topic_length;
+
+    // After a failed write the segment may end with a torn record, so a
+    // fresh one is started
+    if (store->write_file == NULL ||
+        (seg->size > 0 && seg->size + STORE_HEADER_SIZE + length > CONFIG_MQTT_STORE_SEGMENT_SIZE)) {
+        result = store_create(store);
+        if (result != 0)
+            return result;
+        seg = store_segment(store, store->count - 1);
+    }
+
+    header[0] = STORE_MAGIC;
+    header[1] = STORE_LIVE;
+    header[2] = length >> 8;
+    header[3] = length & 0xff;
+    header[4] = id_offset >> 8;
+    header[5] = id_offset & 0xff;
+    if (fwrite(header, 1, STORE_HEADER_SIZE, store->write_file) != STORE_HEADER_SIZE ||
+        fwrite(packet, 1, length, store->write_file) != (size_t)length) {
+        // Whatever made it out is cut off by the next scan
+        store_write_failed(store);
+        return -1;
+    }
+    seg->size += STORE_HEADER_SIZE + length;
+    seg->live++;
+    store->unsynced++;
+    return 0;
+}
+
+/**
+* \brief write the records appended so far through to the file system, e.g. before power goes
+* \return how many records were given up on by failed writes since the last call
+*/
+int store_sync(mqtt_store_t* store)
+{
+    store_flush(store);
+    return store_lost(store);
+}
+
+/**
+* \brief how many records were given up on by failed writes since the last call, without writing any
+*/
+int store_lost(mqtt_store_t* store)
+{
+    int lost = store->lost;
+
+    store->lost = 0;
+    return lost;
+}
+
+static mqtt_store_pending_t* store_pending(mqtt_store_t* store, uint16_t msg_id, bool used)
+{
+    int i;
+
+    for (i = 0; i < CONFIG_MQTT_INFLIGHT_WINDOW; i++) {
+        if (store->pending[i].used == used && (!used || store->pending[i].msg_id == msg_id))
+            return &store->pending[i];
+    }
+    return NULL;
+}
+
+/*
+ * Find the next record to send: one that has to go out again first, then
+ * the next not acked in sequence. The file is left at its packet.
+ */
+static FILE* store_locate(mqtt_store_t* store, store_record_t* rec, mqtt_store_pending_t** retry)
+{
+    mqtt_store_segment_t* seg;
+    FILE* file;
+    int index;
+
+    *retry = store_pending(store, 0, true);
+    if (*retry != NULL) {
+        file = store_seek(store, (*retry)->number, (*retry)->offset);
+        if (file != NULL && store_read_header(file, rec) == 0)
+            return file;
+        // Unreadable, give up on it
+        memset(*retry, 0, sizeof(**retry));
+        return NULL;
+    }
+    if (store_pending(store, 0, false) == NULL)
+        return NULL;
+
+    while ((seg = store_find(store, store->read_number, &index)) != NULL) {
+        if (store->read_offset >= seg->size) {
+            if (index == store->count - 1)
+                return NULL;
+            store->read_number = store_segment(store, index + 1)->number;
+            store->read_offset = 0;
+            store_trim(store);
+            continue;
+        }
+        // Appends still in the stream buffer cannot be read back
+        if (index == store->count - 1 && store->unsynced > 0) {
+            store_flush(store);
+            continue;
+        }
+        file = store_reader(store);
+        if (file == NULL || store_read_header(file, rec) != 0) {
+            // Cut short, move on to the next segment
+            store->read_offset = seg->size;
+            continue;
+        }
+        if (rec->state == STORE_LIVE)
+            return file;
+        store->read_offset += STORE_HEADER_SIZE + rec->length;
+    }
+    return NULL;
+}
+
+/**
+* \brief length of the packet store_next would return
+* \return 0 if there is nothing to send, or the window of records is full
+*/
+int store_next_length(mqtt_store_t* store)
+{
+    mqtt_store_pending_t* retry;
+    store_record_t rec;
+
+    if (store_locate(store, &rec, &retry) == NULL)
+        return 0;
+    return rec.length;
+}
+
+/**
+* \brief read the next packet to send and mark it in flight
+* \param store pointer to the store
+* \param buffer where to read the packet, of store_next_length bytes
+* \param length size of buffer
+* \param msg_id packet identifier to send it with, written into the packet
+* \return packet length, 0 if there is nothing to send or on a read error
+*/
+int store_next(mqtt_store_t* store, uint8_t* buffer, int length, uint16_t msg_id)
+{
+    mqtt_store_pending_t* pending;
+    store_record_t rec;
+    uint32_t number, offset;
+    FILE* file;
+
+    file = store_locate(store, &rec, &pending);
+    if (file == NULL || rec.length > length)
+        return 0;
+    if (pending != NULL) {
+        number = pending->number;
+        offset = pending->offset;
+    } else {
+        number = store->read_number;
+        offset = store->read_offset;
+    }
+    if (fread(buffer, 1, rec.length, file) != rec.length)
+        return 0;
+
+    buffer[rec.id_offset] = msg_id >> 8;
+    buffer[rec.id_offset + 1] = msg_id & 0xff;
+    if (pending == NULL) {
+        pending = store_pending(store, 0, false);
+        store->read_offset += STORE_HEADER_SIZE + rec.length;
+    }
+    pending->used = 1;
+    pending->msg_id = msg_id;
+    pending->number = number;
+    pending->offset = offset;
+    return rec.length;
+}
+
+/**
+* \brief mark the record sent with msg_id as acked
+* \return 0 if it was one of the store's, -1 otherwise
+*/
+int store_ack(mqtt_store_t* store, uint16_t msg_id)
+{
+    mqtt_store_pending_t* pending = store_pending(store, msg_id, true);
+    mqtt_store_segment_t* seg;
+    FILE* file;
+
+    if (msg_id == 0 || pending == NULL)
+        return -1;
+    file = store_seek(store, pending->number, pending->offset + 1);
+    if (file != NULL) {
+        fputc(STORE_ACKED, file);
+        fflush(file);
+    }
+    seg = store_find(store, pending->number, NULL);
+    if (seg != NULL && seg->live > 0)
+        seg->live--;
+    memset(pending, 0, sizeof(*pending));
+    store_trim(store);
+    return 0;
+}
+
+/**
+* \brief have the record sent with msg_id go out again, its packet having been dropped
+*/
+void store_cancel(mqtt_store_t* store, uint16_t msg_id)
+{
+    mqtt_store_pending_t* pending = store_pending(store, msg_id, true);
+
+    if (msg_id != 0 && pending != NULL)
+        pending->msg_id = 0;
+}
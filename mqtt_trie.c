@@ -0,0 +1,243 @@
+/**
+* \file
+*   Topic filter trie of subscription callbacks
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_trie.h"
+
+static mqtt_trie_node_t* trie_node_new(const char* level, int length)
+{
+    mqtt_trie_node_t* node = malloc(sizeof(mqtt_trie_node_t) + length);
+
+    if (node == NULL)
+        return NULL;
+    memset(node, 0, sizeof(mqtt_trie_node_t));
+    memcpy(node->level, level, length);
+    node->length = length;
+    return node;
+}
+
+static void trie_node_free(mqtt_trie_node_t* node)
+{
+    mqtt_trie_node_t* next;
+
+    for (; node != NULL; node = next) {
+        next = node->next;
+        trie_node_free(node->children);
+        trie_node_free(node->plus);
+        trie_node_free(node->hash);
+        free(node);
+    }
+}
+
+static int trie_level_length(const char* level)
+{
+    const char* end = strchr(level, '/');
+
+    return end != NULL ? end - level : strlen(level);
+}
+
+/*
+ * Where the child of node for a filter level hangs, or is to be added
+ */
+static mqtt_trie_node_t** trie_slot(mqtt_trie_node_t* node, const char* level, int length)
+{
+    mqtt_trie_node_t** slot;
+
+    if (length == 1 && level[0] == '+')
+        return &node->plus;
+    if (length == 1 && level[0] == '#')
+        return &node->hash;
+    for (slot = &node->children; *slot != NULL; slot = &(*slot)->next) {
+        if ((*slot)->length == length && memcmp((*slot)->level, level, length) == 0)
+            break;
+    }
+    return slot;
+}
+
+/*
+ * Free the nodes of filter below node left with neither a callback nor
+ * children, deepest first, after dropping the callback of the filter itself
+ * if clear is set.
+ */
+static void trie_prune(mqtt_trie_node_t* node, const char* filter, bool clear)
+{
+    int length = trie_level_length(filter);
+    mqtt_trie_node_t** slot = trie_slot(node, filter, length);
+    mqtt_trie_node_t* child = *slot;
+
+    if (child == NULL)
+        return;
+    if (filter[length] != '\0')
+        trie_prune(child, filter + length + 1, clear);
+    else if (clear)
+        child->callback = NULL;
+
+    if (child->callback == NULL && child->children == NULL && child->plus == NULL && child->hash == NULL) {
+        *slot = child->next;
+        free(child);
+    }
+}
+
+static void trie_add(const mqtt_trie_node_t* node, mqtt_trie_match_t* matches, int max, int* count)
+{
+    if (node == NULL || node->callback == NULL)
+        return;
+    if (*count < max) {
+        matches[*count].callback = node->callback;
+        matches[*count].context = node->context;
+    }
+    (*count)++;
+}
+
+static void trie_match_level(const mqtt_trie_node_t* node, const char* level, const char* end, bool wildcards,
+                             mqtt_trie_match_t* matches, int max, int* count);
+
+/*
+ * Go on matching below child, which matched the topic level ending at
+ * level_end
+ */
+static void trie_match_child(const mqtt_trie_node_t* child, const char* level_end, const char* end,
+                             mqtt_trie_match_t* matches, int max, int* count)
+{
+    if (level_end == end) {
+        // Also a/# for topic a
+        trie_add(child, matches, max, count);
+        trie_add(child->hash, matches, max, count);
+    } else {
+        trie_match_level(child, level_end + 1, end, true, matches, max, count);
+    }
+}
+
+static void trie_match_level(const mqtt_trie_node_t* node, const char* level, const char* end, bool wildcards,
+                             mqtt_trie_match_t* matches, int max, int* count)
+{
+    const char* level_end = memchr(level, '/', end - level);
+    const mqtt_trie_node_t* child;
+
+    if (level_end == NULL)
+        level_end = end;
+
+    for (child = node->children; child != NULL; child = child->next) {
+        if (child->length == level_end - level && memcmp(child->level, level, child->length) == 0) {
+            trie_match_child(child, level_end, end, matches, max, count);
+            break;
+        }
+    }
+    if (!wildcards)
+        return;
+    trie_add(node->hash, matches, max, count);
+    if (node->plus != NULL)
+        trie_match_child(node->plus, level_end, end, matches, max, count);
+}
+
+/**
+* \brief init an empty trie
+* \return 0 if successfull, otherwise failed
+*/
+int trie_init(mqtt_trie_t* trie)
+{
+    trie->lock = xSemaphoreCreateMutex();
+    trie->root = trie_node_new("", 0);
+    if (trie->lock == NULL || trie->root == NULL) {
+        trie_deinit(trie);
+        return -1;
+    }
+    return 0;
+}
+
+void trie_deinit(mqtt_trie_t* trie)
+{
+    if (trie->lock != NULL)
+        vSemaphoreDelete(trie->lock);
+    trie_node_free(trie->root);
+    trie->lock = NULL;
+    trie->root = NULL;
+}
+
+/**
+* \brief whether a topic filter is well formed: not empty, + and # making up
+*        a whole level, # only as the last one
+*/
+bool trie_filter_valid(const char* filter)
+{
+    int length;
+
+    if (filter == NULL || filter[0] == '\0')
+        return false;
+    while (1) {
+        length = trie_level_length(filter);
+        if (length > 1 && (memchr(filter, '+', length) != NULL || memchr(filter, '#', length) != NULL))
+            return false;
+        if (filter[length] == '\0')
+            return true;
+        if (length == 1 && filter[0] == '#')
+            return false;
+        filter += length + 1;
+    }
+}
+
+/**
+* \brief have messages matching filter handed to callback, replacing the
+*        callback the same filter had
+* \return 0 if successfull, -1 if the filter is malformed or memory is short
+*/
+int trie_set(mqtt_trie_t* trie, const char* filter, mqtt_message_callback callback, void* context)
+{
+    const char* level = filter;
+    mqtt_trie_node_t* node = trie->root;
+    mqtt_trie_node_t** slot;
+    int length;
+
+    if (!trie_filter_valid(filter))
+        return -1;
+
+    xSemaphoreTake(trie->lock, portMAX_DELAY);
+    while (1) {
+        length = trie_level_length(level);
+        slot = trie_slot(node, level, length);
+        if (*slot == NULL && (*slot = trie_node_new(level, length)) == NULL) {
+            trie_prune(trie->root, filter, false);
+            xSemaphoreGive(trie->lock);
+            return -1;
+        }
+        node = *slot;
+        if (level[length] == '\0')
+            break;
+        level += length + 1;
+    }
+    node->callback = callback;
+    node->context = context;
+    xSemaphoreGive(trie->lock);
+    return 0;
+}
+
+/**
+* \brief forget the callback of filter, if any
+*/
+void trie_remove(mqtt_trie_t* trie, const char* filter)
+{
+    if (!trie_filter_valid(filter))
+        return;
+    xSemaphoreTake(trie->lock, portMAX_DELAY);
+    trie_prune(trie->root, filter, true);
+    xSemaphoreGive(trie->lock);
+}
+
+/**
+* \brief callbacks of the filters matching a topic; topics starting with $
+*        are not matched by filters starting with a wildcard
+* \param matches where to copy up to max of them
+* \return the number of filters matching, which may be more than max
+*/
+int trie_match(mqtt_trie_t* trie, const char* topic, int length, mqtt_trie_match_t* matches, int max)
+{
+    int count = 0;
+
+    xSemaphoreTake(trie->lock, portMAX_DELAY);
+    trie_match_level(trie->root, topic, topic + length, length == 0 || topic[0] != '$',
+                     matches, max, &count);
+    xSemaphoreGive(trie->lock);
+    return count;
+}
@@ -4,103 +4,203 @@
 */
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "ringbuf.h"
 
+#define RB_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static inline uint32_t rb_load_acquire(volatile uint32_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t rb_advance(RINGBUF *r, uint32_t idx, uint32_t n)
+{
+    idx += n;
+    if (idx >= 2 * (uint32_t)r->size)
+        idx -= 2 * (uint32_t)r->size;
+    return idx;
+}
+
+static inline uint32_t rb_offset(RINGBUF *r, uint32_t idx)
+{
+    return idx < (uint32_t)r->size ? idx : idx - (uint32_t)r->size;
+}
+
+static inline int32_t rb_count(RINGBUF *r, uint32_t head, uint32_t tail)
+{
+    return head >= tail ? head - tail : head + 2 * r->size - tail;
+}
+
 /**
 * \brief init a RINGBUF object
 * \param r pointer to a RINGBUF object
 * \param buf pointer to a byte array
 * \param size size of buf
-* \param block_size is size of data as block
 * \return 0 if successfull, otherwise failed
 */
-int32_t rb_init(RINGBUF *r, uint8_t* buf, int32_t size, int32_t block_size)
+int32_t rb_init(RINGBUF *r, uint8_t* buf, int32_t size)
 {
     if (r == 0 || buf == 0 || size < 2) return -1;
 
-    if (size % block_size != 0) return -1;
-
-    r->p_o = r->p_r = r->p_w = buf;
-    r->fill_cnt = 0;
+    r->p_o = buf;
+    r->head = r->tail = 0;
+    r->waiters = 0;
     r->size = size;
-    r->block_size = block_size;
+    r->space_sem = xSemaphoreCreateBinary();
+    if (r->space_sem == NULL) {
+        rb_deinit(r);
+        return -1;
+    }
     return 0;
 }
+
 /**
-* \brief put a character into ring buffer
-* \param r pointer to a ringbuf object
-* \param c character to be put
-* \return 0 if successfull, otherwise failed
+* \brief release the semaphores owned by a RINGBUF object
+* \param r pointer to a RINGBUF object
+* The byte array given to rb_init is left to the caller.
 */
-int32_t rb_put(RINGBUF *r, uint8_t *c)
+void rb_deinit(RINGBUF *r)
 {
-    int32_t i;
-    uint8_t *data = c;
-    if (r->fill_cnt >= r->size)
-        return -1; // ring buffer is full, this should be atomic operation
-
-
-    r->fill_cnt += r->block_size;             // increase filled slots count, this should be atomic operation
-
-    for (i = 0; i < r->block_size; i++) {
-        *r->p_w = *data;              // put character into buffer
-
-        r->p_w ++;
-        data ++;
-    }
-
-    if (r->p_w >= r->p_o + r->size)     // rollback if write pointer go pass
-        r->p_w = r->p_o;          // the physical boundary
-
-    return 0;
+    if (r->space_sem != NULL)
+        vSemaphoreDelete(r->space_sem);
+    r->space_sem = NULL;
 }
+
 /**
-* \brief get a character from ring buffer
-* \param r pointer to a ringbuf object
-* \param c read character
-* \return 0 if successfull, otherwise failed
+* \brief number of filled bytes, as seen by the consumer
 */
-int32_t rb_get(RINGBUF *r, uint8_t *c)
+int32_t rb_fill(RINGBUF *r)
 {
-    int32_t i;
-    uint8_t *data = c;
-    if (r->fill_cnt <= 0)return -1;     // ring buffer is empty, this should be atomic operation
-
-    r->fill_cnt -= r->block_size;              // decrease filled slots count
+    return rb_count(r, rb_load_acquire(&r->head), rb_load_acquire(&r->tail));
+}
 
-    for (i = 0; i < r->block_size; i++)
-        *data++ = *r->p_r++;               // get the character out
+static TickType_t rb_ticks_left(TickType_t start, TickType_t ticks_to_wait)
+{
+    TickType_t elapsed;
 
-    if (r->p_r >= r->p_o + r->size)       // rollback if write pointer go pass
-        r->p_r = r->p_o;            // the physical boundary
+    if (ticks_to_wait == portMAX_DELAY)
+        return portMAX_DELAY;
+    elapsed = xTaskGetTickCount() - start;
+    return elapsed >= ticks_to_wait ? 0 : ticks_to_wait - elapsed;
+}
 
-    return 0;
+static int32_t rb_available(RINGBUF *r)
+{
+    return r->size - rb_count(r, rb_load_acquire(&r->head), __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST));
 }
 
-int32_t rb_available(RINGBUF *r)
+/*
+ * Sleep until at least len bytes are free, or ticks_to_wait is over.
+ * waiters is raised before free space is looked at, and a release moves
+ * tail before it looks at waiters, so one of the two always sees the other.
+ */
+static int32_t rb_wait_space(RINGBUF *r, int32_t len, TickType_t start, TickType_t ticks_to_wait)
 {
-    return (r->size - r->fill_cnt);
+    TickType_t left;
+    int32_t result = 0;
+
+    __atomic_fetch_add(&r->waiters, 1, __ATOMIC_SEQ_CST);
+    while (rb_available(r) < len) {
+        left = rb_ticks_left(start, ticks_to_wait);
+        if (left == 0) {
+            result = -1;
+            break;
+        }
+        xSemaphoreTake(r->space_sem, left);
+    }
+    __atomic_fetch_sub(&r->waiters, 1, __ATOMIC_SEQ_CST);
+    return result;
 }
 
-uint32_t rb_read(RINGBUF *r, uint8_t *buf, int len)
+/**
+* \brief claim a contiguous region, safe against other producers doing the same
+* \param r pointer to a ringbuf object, its free bytes all zero
+* \param len size of the region
+* \param ticks_to_wait maximum time to sleep for space, portMAX_DELAY for no timeout
+* \return pointer to the region, NULL on timeout or if len can never fit
+* head is moved with compare-and-swap, so the region is counted by rb_fill
+* right away and the consumer must tell from its content whether it has been
+* written yet; it reads zero until then. If the end of the buffer is shorter
+* than len it is claimed first, its first word set to RB_SKIPPED.
+*/
+uint8_t *rb_claim(RINGBUF *r, int32_t len, TickType_t ticks_to_wait)
 {
-    int n = 0;
-    uint8_t data;
-    while (len > 0) {
-        while (rb_get(r, &data) != 0);
-        *buf++ = data;
-        n ++;
-        len --;
+    TickType_t start = 0;
+    bool waited = false;
+    uint32_t head, off;
+    int32_t contig, avail;
+
+    if (len > r->size)
+        return NULL;
+
+    while (1) {
+        head = rb_load_acquire(&r->head);
+        avail = r->size - rb_count(r, head, rb_load_acquire(&r->tail));
+        off = rb_offset(r, head);
+        contig = r->size - (int32_t)off;
+        if (contig < len && avail >= contig) {
+            if (__atomic_compare_exchange_n(&r->head, &head, rb_advance(r, head, contig),
+                                            false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                __atomic_store_n((uint32_t *)(r->p_o + off), RB_SKIPPED, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (contig >= len && avail >= len) {
+            if (!__atomic_compare_exchange_n(&r->head, &head, rb_advance(r, head, len),
+                                             false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                continue;
+            // space_sem only wakes one waiter; pass it on if room is left
+            if (avail > len && __atomic_load_n(&r->waiters, __ATOMIC_SEQ_CST) > 0)
+                xSemaphoreGive(r->space_sem);
+            return r->p_o + off;
+        }
+        if (ticks_to_wait == 0)
+            return NULL;
+        // The clock is only read by claims that have to wait
+        if (!waited) {
+            start = xTaskGetTickCount();
+            waited = true;
+        }
+        if (rb_wait_space(r, contig < len ? contig : len, start, ticks_to_wait) != 0)
+            return NULL;
     }
+}
+
+/**
+* \brief get the queued bytes that are contiguous in memory, without copying
+* \param r pointer to a ringbuf object
+* \param pos set to the read index
+* \param ptr set to the first queued byte
+* \return number of contiguous bytes at ptr
+*/
+int32_t rb_peek_at(RINGBUF *r, uint32_t *pos, uint8_t **ptr)
+{
+    uint32_t tail = rb_load_acquire(&r->tail);
+    uint32_t off = rb_offset(r, tail);
+    int32_t n = rb_count(r, rb_load_acquire(&r->head), tail);
 
-    return n;
+    *pos = tail;
+    *ptr = r->p_o + off;
+    return RB_MIN(n, r->size - (int32_t)off);
 }
 
-uint32_t rb_write(RINGBUF *r, uint8_t *buf, int len)
+/**
+* \brief zero and release the len bytes at the read index
+* Keeps the free bytes zero for rb_claim. Several parties may release, as
+* long as only one of them owns the data at the read index at a time. A
+* reader that finds any of the bytes zeroed sees what the releaser wrote
+* before the call, e.g. a mark that the data is being freed.
+*/
+void rb_release(RINGBUF *r, int32_t len)
 {
-    uint32_t wi;
-    for (wi = 0; wi < len; wi++) {
-        while (rb_put(r, &buf[wi]) != 0);
-    }
-    return 0;
+    uint32_t tail = rb_load_acquire(&r->tail);
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(r->p_o + rb_offset(r, tail), 0, len);
+    __atomic_store_n(&r->tail, rb_advance(r, tail, len), __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->waiters, __ATOMIC_SEQ_CST) > 0)
+        xSemaphoreGive(r->space_sem);
 }
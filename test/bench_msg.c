@@ -0,0 +1,243 @@
+/**
+* \file
+*   Encode and decode rate of each packet type
+*
+* Packets are encoded into a fresh connection each time, as the client
+* does, and decoded with mqtt_parse, then read with each mqtt_get_* helper.
+* Decoding reads them from the end of a page followed by an inaccessible
+* one, so that a read past the packet, whole or cut short anywhere, faults
+* and is reported rather than going unnoticed in an optimized build.
+*/
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mqtt_msg.h"
+#include "test.h"
+
+#define RUN_PACKETS 2000000
+
+static uint8_t* page_end;
+static sigjmp_buf fault_jump;
+static volatile uint32_t sink;
+
+typedef struct
+{
+  const char* name;
+  int type;
+} packet_kind_t;
+
+static const packet_kind_t kinds[] = {
+    { "PUBLISH QoS 0, 16 B", 0 },
+    { "PUBLISH QoS 1, 256 B", 1 },
+    { "PUBACK", 2 },
+    { "SUBSCRIBE, 4 filters", 3 },
+    { "SUBACK, 4 filters", 4 },
+    { "CONNACK", 5 },
+    { "PINGRESP", 6 },
+};
+
+/*
+ * One way of reading a packet of length bytes, returning something of it
+ * for sink so that the call is not optimized out
+ */
+typedef uint32_t (* reader_t)(uint8_t* packet, int length);
+
+static uint32_t read_parse(uint8_t* packet, int length)
+{
+    mqtt_parser_t parser;
+
+    mqtt_parser_init(&parser);
+    return mqtt_parse(&parser, packet, length);
+}
+
+static uint32_t read_total_length(uint8_t* packet, int length)
+{
+    return mqtt_get_total_length(packet, length);
+}
+
+static uint32_t read_topic(uint8_t* packet, int length)
+{
+    uint16_t n = length;
+
+    return mqtt_get_publish_topic(packet, &n) != NULL ? n : 0;
+}
+
+static uint32_t read_data(uint8_t* packet, int length)
+{
+    uint16_t n = length;
+
+    return mqtt_get_publish_data(packet, &n) != NULL ? n : 0;
+}
+
+static uint32_t read_id(uint8_t* packet, int length)
+{
+    return mqtt_get_id(packet, length);
+}
+
+typedef struct
+{
+  const char* name;
+  reader_t read;
+  int kind;                   /* Index in kinds of the packet read */
+} helper_t;
+
+static const helper_t helpers[] = {
+    { "mqtt_get_total_length", read_total_length, 1 },
+    { "mqtt_get_publish_topic", read_topic, 1 },
+    { "mqtt_get_publish_data", read_data, 1 },
+    { "mqtt_get_id", read_id, 1 },
+    { "mqtt_get_id", read_id, 2 },
+};
+
+static void on_fault(int sig)
+{
+    siglongjmp(fault_jump, 1);
+}
+
+/*
+ * Encode a packet of kind into buffer. Returns its length. The client does
+ * not encode acks from the server, so those are laid out here.
+ */
+static int encode(int kind, uint8_t* buffer, int size, uint8_t** packet)
+{
+    static const char payload[256];
+    static const mqtt_topic_t topics[] = {
+        { "sensors/+/temperature", 1 }, { "sensors/+/humidity", 1 },
+        { "config/#", 2 }, { "commands/device-0042", 0 },
+    };
+    static const uint8_t suback[] = { 0x90, 6, 0x12, 0x34, 1, 1, 2, 0 };
+    static const uint8_t connack[] = { 0x20, 2, 0, 0 };
+    static const uint8_t pingresp[] = { 0xd0, 0 };
+    mqtt_connection_t connection;
+    mqtt_message_t* msg;
+    uint16_t msg_id = 0x1234;
+    int packed;
+
+    mqtt_msg_init(&connection, buffer, size);
+    switch (kind) {
+    case 0:
+        msg = mqtt_msg_publish(&connection, "sensors/device-0042/temperature", payload, 16, 0, 0, &msg_id);
+        break;
+    case 1:
+        msg = mqtt_msg_publish(&connection, "sensors/device-0042/temperature", payload, 256, 1, 0, &msg_id);
+        break;
+    case 2:
+        msg = mqtt_msg_puback(&connection, msg_id);
+        break;
+    case 3:
+        msg = mqtt_msg_subscribe_multiple(&connection, topics, 4, &packed, &msg_id);
+        break;
+    case 4:
+        memcpy(buffer, suback, sizeof(suback));
+        *packet = buffer;
+        return sizeof(suback);
+    case 5:
+        memcpy(buffer, connack, sizeof(connack));
+        *packet = buffer;
+        return sizeof(connack);
+    default:
+        memcpy(buffer, pingresp, sizeof(pingresp));
+        *packet = buffer;
+        return sizeof(pingresp);
+    }
+    *packet = msg->data;
+    return msg->length;
+}
+
+/*
+ * Read every prefix of the packet from the end of the readable page.
+ * Returns the number of prefixes read past, 0 if none was.
+ */
+static int check_bounds(const uint8_t* packet, int length, reader_t read)
+{
+    volatile int faults = 0;
+    int n;
+
+    for (n = 0; n <= length; n++) {
+        memcpy(page_end - n, packet, n);
+        if (sigsetjmp(fault_jump, 1) != 0) {
+            faults++;
+            continue;
+        }
+        sink += read(page_end - n, n);
+    }
+    return faults;
+}
+
+static void bench(const packet_kind_t* kind)
+{
+    uint8_t buffer[512];
+    uint8_t* packet;
+    mqtt_parser_t parser;
+    uint64_t start, encode_ns, decode_ns;
+    int length = 0, faults, i;
+
+    start = shim_now_ns();
+    for (i = 0; i < RUN_PACKETS; i++) {
+        length = encode(kind->type, buffer, sizeof(buffer), &packet);
+        sink += packet[length - 1];
+    }
+    encode_ns = shim_now_ns() - start;
+    CHECK(length > 0);
+
+    faults = check_bounds(packet, length, read_parse);
+    memcpy(page_end - length, packet, length);
+    start = shim_now_ns();
+    for (i = 0; i < RUN_PACKETS; i++) {
+        mqtt_parser_init(&parser);
+        sink += mqtt_parse(&parser, page_end - length, length);
+    }
+    decode_ns = shim_now_ns() - start;
+    CHECK_EQ(mqtt_parse(&parser, page_end - length, length), 0);
+
+    printf("%-22s %4d  %8.2f %8.1f  %8.2f %8.1f  %s\n", kind->name, length,
+           RUN_PACKETS * 1000.0 / encode_ns, (double)RUN_PACKETS * length * 1000.0 / encode_ns,
+           RUN_PACKETS * 1000.0 / decode_ns, (double)RUN_PACKETS * length * 1000.0 / decode_ns,
+           faults == 0 ? "in bounds" : "READ PAST THE PACKET");
+    CHECK_EQ(faults, 0);
+}
+
+static void bench_helper(const helper_t* helper)
+{
+    uint8_t buffer[512];
+    uint8_t* packet;
+    uint64_t start, elapsed;
+    int length, faults, i;
+
+    length = encode(kinds[helper->kind].type, buffer, sizeof(buffer), &packet);
+    faults = check_bounds(packet, length, helper->read);
+    memcpy(page_end - length, packet, length);
+    start = shim_now_ns();
+    for (i = 0; i < RUN_PACKETS; i++)
+        sink += helper->read(page_end - length, length);
+    elapsed = shim_now_ns() - start;
+
+    printf("%-22s %-22s %8.2f  %s\n", helper->name, kinds[helper->kind].name,
+           RUN_PACKETS * 1000.0 / elapsed, faults == 0 ? "in bounds" : "READ PAST THE PACKET");
+    CHECK_EQ(faults, 0);
+}
+
+int main(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uint8_t* pages = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    unsigned int i;
+
+    CHECK(pages != MAP_FAILED && mprotect(pages + page, page, PROT_NONE) == 0);
+    page_end = pages + page;
+    signal(SIGSEGV, on_fault);
+    signal(SIGBUS, on_fault);
+
+    printf("%d packets per run\n", RUN_PACKETS);
+    printf("%-22s %4s  %8s %8s  %8s %8s\n", "packet", "len", "enc M/s", "enc MB/s", "dec M/s", "dec MB/s");
+    for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+        bench(&kinds[i]);
+    printf("\n%-22s %-22s %8s\n", "helper", "packet", "M/s");
+    for (i = 0; i < sizeof(helpers) / sizeof(helpers[0]); i++)
+        bench_helper(&helpers[i]);
+    munmap(pages, 2 * page);
+    TEST_DONE();
+}
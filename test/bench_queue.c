@@ -0,0 +1,149 @@
+/**
+* \file
+*   Cost of a publish from mqtt_publish to write_cb
+*
+* The client runs its real tasks against callbacks standing in for the
+* network: connect_cb succeeds, read_cb hands out a CONNACK then blocks,
+* and write_cb and writev_cb drop what they get into a memory sink, which
+* can be paused. For each payload size the outbox is first filled with the
+* sink paused; publishes then run with the sink going again, until all of
+* them are written. Copies per byte count every memcpy of the packets on the
+* way, against the bytes written.
+*
+* Enqueue costs come from the client's stats, so this is built with
+* CONFIG_MQTT_STATS_ON; on the host its "cycles" are nanoseconds.
+*/
+#include <string.h>
+#include "mqtt.h"
+#include "test.h"
+
+#define RUN_MESSAGES 20000
+
+static mqtt_settings settings;
+static volatile bool sink_paused;
+static volatile bool connack_read;
+static volatile uint64_t sink_bytes;
+
+static bool fake_connect(mqtt_client *client)
+{
+    connack_read = false;
+    client->socket = -1;
+    return true;
+}
+
+static void fake_disconnect(mqtt_client *client)
+{
+}
+
+static int fake_read(mqtt_client *client, void *buffer, int len, int timeout_ms)
+{
+    static const uint8_t connack[] = { 0x20, 2, 0, 0 };
+
+    if (!connack_read && len >= (int)sizeof(connack)) {
+        connack_read = true;
+        memcpy(buffer, connack, sizeof(connack));
+        return sizeof(connack);
+    }
+    while (!client->terminate)
+        vTaskDelay(10);
+    return -1;
+}
+
+static void sink_wait(mqtt_client *client)
+{
+    while (sink_paused && !client->terminate)
+        vTaskDelay(1);
+}
+
+static int sink_write(mqtt_client *client, const void *buffer, int len, int timeout_ms)
+{
+    sink_wait(client);
+    sink_bytes += len;
+    return len;
+}
+
+static int sink_writev(mqtt_client *client, const mqtt_segment_t *segments, int count, int timeout_ms)
+{
+    int len = 0, i;
+
+    sink_wait(client);
+    for (i = 0; i < count; i++)
+        len += segments[i].len;
+    sink_bytes += len;
+    return len;
+}
+
+static int outbox_percent(mqtt_client *client)
+{
+    RINGBUF *lane = &client->outbox.lanes[OUTBOX_LANE_BULK];
+
+    return rb_fill(lane) * 100 / lane->size;
+}
+
+/*
+ * Publish payloads of length bytes from a queue filled to fill percent.
+ */
+static void bench(mqtt_client *client, int length, int fill)
+{
+    static char payload[4096];
+    mqtt_stats_t stats;
+    uint64_t start, elapsed, sunk = sink_bytes;
+    int prefilled = 0, i;
+
+    // Payloads too large for the outbox wait to be written, so the queue
+    // is then filled with smaller ones
+    sink_paused = true;
+    mqtt_reset_stats(client);
+    while (outbox_percent(client) < fill &&
+           mqtt_publish(client, "bench/queue", payload, length < 1024 ? length : 1024, 0, 0) == MQTT_OK)
+        prefilled++;
+    fill = outbox_percent(client);
+
+    start = shim_now_ns();
+    sink_paused = false;
+    for (i = 0; i < RUN_MESSAGES; i++)
+        CHECK_EQ(mqtt_publish(client, "bench/queue", payload, length, 0, 0), MQTT_OK);
+    WAIT_FOR(client->outbox.count == 0, 10000);
+    elapsed = shim_now_ns() - start;
+
+    mqtt_get_stats(client, &stats);
+    CHECK_EQ(stats.sent, prefilled + RUN_MESSAGES);
+    CHECK_EQ(sink_bytes - sunk, stats.sent_bytes);
+    printf("%5d  %3d%%  %8.0f  %8.1f  %6.2f  %8u  %8u\n", length, fill,
+           (double)elapsed / RUN_MESSAGES, stats.sent_bytes * 1000.0 / elapsed,
+           (double)stats.copied_bytes / stats.sent_bytes,
+           mqtt_stats_percentile(&stats, 50), mqtt_stats_percentile(&stats, 99));
+}
+
+int main(void)
+{
+    static const int lengths[] = { 8, 64, 256, 1024, 4096 };
+    static const int fills[] = { 0, 50, 90 };
+    mqtt_client *client;
+    unsigned int i, j;
+
+    strcpy(settings.host, "sink");
+    strcpy(settings.client_id, "bench_queue");
+    settings.keepalive = 0;
+    settings.clean_session = 1;
+    settings.connect_cb = fake_connect;
+    settings.disconnect_cb = fake_disconnect;
+    settings.read_cb = fake_read;
+    settings.write_cb = sink_write;
+    settings.writev_cb = sink_writev;
+    client = mqtt_start(&settings);
+    CHECK(client != NULL);
+    WAIT_FOR(client->sending_task != NULL, 2000);
+
+    printf("%d QoS 0 publishes per run, to a memory sink\n", RUN_MESSAGES);
+    printf("bytes  fill  ns/msg      MB/s  copies  p50 ns    p99 ns\n");
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        for (j = 0; j < sizeof(fills) / sizeof(fills[0]); j++)
+            bench(client, lengths[i], fills[j]);
+    }
+
+    mqtt_stop(client);
+    WAIT_FOR(shim_tasks() == 0, 3000);
+    CHECK_EQ(shim_tasks(), 0);
+    TEST_DONE();
+}
@@ -0,0 +1,280 @@
+/**
+* \file
+*   Throughput of the outbox ring, against the byte-at-a-time ring it replaced
+*
+* Each run moves the same bytes through a 4 KB ring in chunks, writing a
+* chunk and reading it back from one thread, as mqtt_queue and the sending
+* task used to. The ring then runs with producer and consumer threads, its
+* byte stream checked on the way.
+*/
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "ringbuf.h"
+#include "test.h"
+
+#define RING_SIZE 4096
+#define RUN_BYTES (32 * 1024 * 1024)
+#define THREAD_RECORDS 1000000
+
+/*
+ * The ring as it was before the bulk copies, rb_write/rb_read pushing each
+ * byte through rb_put/rb_get.
+ */
+typedef struct
+{
+  uint8_t* p_o;
+  uint8_t* volatile p_r;
+  uint8_t* volatile p_w;
+  volatile int32_t fill_cnt;
+  int32_t size;
+  int32_t block_size;
+} legacy_ring_t;
+
+static void legacy_init(legacy_ring_t* r, uint8_t* buf, int32_t size)
+{
+    r->p_o = r->p_r = r->p_w = buf;
+    r->fill_cnt = 0;
+    r->size = size;
+    r->block_size = 1;
+}
+
+static int32_t legacy_put(legacy_ring_t* r, uint8_t* c)
+{
+    int32_t i;
+
+    if (r->fill_cnt >= r->size)
+        return -1;
+    r->fill_cnt += r->block_size;
+    for (i = 0; i < r->block_size; i++)
+        *r->p_w++ = *c++;
+    if (r->p_w >= r->p_o + r->size)
+        r->p_w = r->p_o;
+    return 0;
+}
+
+static int32_t legacy_get(legacy_ring_t* r, uint8_t* c)
+{
+    int32_t i;
+
+    if (r->fill_cnt <= 0)
+        return -1;
+    r->fill_cnt -= r->block_size;
+    for (i = 0; i < r->block_size; i++)
+        *c++ = *r->p_r++;
+    if (r->p_r >= r->p_o + r->size)
+        r->p_r = r->p_o;
+    return 0;
+}
+
+static void legacy_write(legacy_ring_t* r, uint8_t* buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        while (legacy_put(r, &buf[i]) != 0)
+            ;
+    }
+}
+
+static void legacy_read(legacy_ring_t* r, uint8_t* buf, int len)
+{
+    while (len-- > 0) {
+        while (legacy_get(r, buf) != 0)
+            ;
+        buf++;
+    }
+}
+
+/*
+ * Records on the ring as the outbox lays them out: a header word written
+ * last, which reads zero until then, and the chunk padded to a word.
+ */
+static int record_length(int chunk)
+{
+    return 4 + ((chunk + 3) & ~3);
+}
+
+static void ring_write(RINGBUF* ring, const uint8_t* chunk, int length, uint32_t tag)
+{
+    uint8_t* region = rb_claim(ring, record_length(length), portMAX_DELAY);
+
+    memcpy(region + 4, chunk, length);
+    __atomic_store_n((uint32_t*)region, (uint32_t)length << 8 | tag, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy the oldest record out and release it. Returns its header word, 0 if
+ * there is none yet.
+ */
+static uint32_t ring_read(RINGBUF* ring, uint8_t* chunk)
+{
+    uint8_t* ptr;
+    uint32_t pos, word;
+    int32_t n;
+
+    while ((n = rb_peek_at(ring, &pos, &ptr)) > 0) {
+        word = __atomic_load_n((uint32_t*)ptr, __ATOMIC_ACQUIRE);
+        if (word == 0)
+            return 0;
+        if (word != RB_SKIPPED) {
+            memcpy(chunk, ptr + 4, word >> 8);
+            rb_release(ring, record_length(word >> 8));
+            return word;
+        }
+        rb_release(ring, n);
+    }
+    return 0;
+}
+
+static double mb_per_s(uint64_t bytes, uint64_t ns)
+{
+    return bytes * 1000.0 / ns;
+}
+
+static double bench_legacy(int chunk)
+{
+    static uint8_t mem[RING_SIZE];
+    uint8_t in[1024], out[1024];
+    legacy_ring_t ring;
+    uint64_t start, moved;
+
+    legacy_init(&ring, mem, sizeof(mem));
+    memset(in, 0x5a, sizeof(in));
+    start = shim_now_ns();
+    for (moved = 0; moved < RUN_BYTES; moved += chunk) {
+        legacy_write(&ring, in, chunk);
+        legacy_read(&ring, out, chunk);
+    }
+    return mb_per_s(moved, shim_now_ns() - start);
+}
+
+static double bench_ring(int chunk)
+{
+    static uint32_t mem[RING_SIZE / 4];
+    uint8_t in[1024], out[1024];
+    RINGBUF ring;
+    uint64_t start, moved;
+    double result;
+    int lost = 0;
+
+    CHECK(rb_init(&ring, (uint8_t*)mem, sizeof(mem)) == 0);
+    memset(in, 0x5a, sizeof(in));
+    start = shim_now_ns();
+    for (moved = 0; moved < RUN_BYTES; moved += chunk) {
+        ring_write(&ring, in, chunk, 1);
+        lost += ring_read(&ring, out) == 0;
+    }
+    result = mb_per_s(moved, shim_now_ns() - start);
+    CHECK_EQ(lost, 0);
+    CHECK(memcmp(in, out, chunk) == 0);
+    CHECK_EQ(rb_fill(&ring), 0);
+    rb_deinit(&ring);
+    return result;
+}
+
+typedef struct
+{
+  RINGBUF* ring;
+  int producer;
+} producer_t;
+
+static uint8_t expected_byte(int producer, uint32_t seq, int i)
+{
+    return (uint8_t)(producer * 31 + seq * 7 + i);
+}
+
+static int chunk_length(uint32_t seq)
+{
+    return 4 + (seq * 2654435761u >> 22) % 297;
+}
+
+static void* producer_run(void* arg)
+{
+    producer_t* p = arg;
+    uint8_t chunk[300];
+    uint32_t seq;
+    int i, length;
+
+    for (seq = 0; seq < THREAD_RECORDS; seq++) {
+        length = chunk_length(seq);
+        memcpy(chunk, &seq, 4);
+        for (i = 4; i < length; i++)
+            chunk[i] = expected_byte(p->producer, seq, i);
+        ring_write(p->ring, chunk, length, p->producer + 1);
+    }
+    return NULL;
+}
+
+/*
+ * Records of each producer must come out whole and in the order they went
+ * in, however the claims interleave.
+ */
+static void bench_threads(int producers)
+{
+    static uint32_t mem[RING_SIZE / 4];
+    producer_t args[2];
+    pthread_t threads[2];
+    uint32_t next[2] = { 0, 0 };
+    uint8_t chunk[300];
+    RINGBUF ring;
+    uint64_t start, bytes = 0;
+    uint32_t word, seq;
+    int received = 0, bad = 0;
+    int i, p, length;
+
+    CHECK(rb_init(&ring, (uint8_t*)mem, sizeof(mem)) == 0);
+    start = shim_now_ns();
+    for (p = 0; p < producers; p++) {
+        args[p].ring = &ring;
+        args[p].producer = p;
+        pthread_create(&threads[p], NULL, producer_run, &args[p]);
+    }
+    while (received < producers * THREAD_RECORDS) {
+        word = ring_read(&ring, chunk);
+        if (word == 0) {
+            // Let the producers run on a single CPU
+            sched_yield();
+            continue;
+        }
+        p = (word & 0xff) - 1;
+        length = word >> 8;
+        memcpy(&seq, chunk, 4);
+        if (p < 0 || p >= producers || seq != next[p] || length != chunk_length(seq)) {
+            bad++;
+        } else {
+            for (i = 4; i < length; i++)
+                bad += chunk[i] != expected_byte(p, seq, i);
+            next[p]++;
+        }
+        bytes += length;
+        received++;
+    }
+    for (p = 0; p < producers; p++)
+        pthread_join(threads[p], NULL);
+    printf("ring, %d producer%s:  %8.1f MB/s, %d records checked\n", producers, producers > 1 ? "s" : " ",
+           mb_per_s(bytes, shim_now_ns() - start), received);
+    CHECK_EQ(bad, 0);
+    CHECK_EQ(rb_fill(&ring), 0);
+    rb_deinit(&ring);
+}
+
+int main(void)
+{
+    static const int chunks[] = { 16, 64, 256, 1024 };
+    double legacy, ring;
+    unsigned int i;
+
+    printf("%d KB ring, one thread writing then reading back each chunk\n", RING_SIZE / 1024);
+    printf("chunk   byte-at-a-time         ring\n");
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        legacy = bench_legacy(chunks[i]);
+        ring = bench_ring(chunks[i]);
+        printf("%5d  %10.1f MB/s  %10.1f MB/s  x%.1f\n", chunks[i], legacy, ring, ring / legacy);
+    }
+    bench_threads(1);
+    bench_threads(2);
+    TEST_DONE();
+}
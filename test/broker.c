@@ -0,0 +1,254 @@
+/**
+* \file
+*   Loopback MQTT server the host tests run the client against
+*/
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "broker.h"
+
+#define BROKER_MAX_PACKET 65536
+
+static int broker_read(broker_t* broker, uint8_t* buffer, int length)
+{
+    int done = 0, n;
+
+    while (done < length) {
+        n = recv(broker->client, buffer + done, length - done, 0);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * Read the next packet whole into buffer. Returns its length, -1 once the
+ * connection is closed or the packet too large.
+ */
+static int broker_read_packet(broker_t* broker, uint8_t* buffer)
+{
+    uint32_t remaining = 0;
+    int pos = 1, shift = 0;
+
+    if (broker_read(broker, buffer, 1) != 0)
+        return -1;
+    do {
+        if (pos > 4 || broker_read(broker, buffer + pos, 1) != 0)
+            return -1;
+        remaining |= (uint32_t)(buffer[pos] & 0x7f) << shift;
+        shift += 7;
+    } while (buffer[pos++] & 0x80);
+    if (pos + remaining > BROKER_MAX_PACKET || broker_read(broker, buffer + pos, remaining) != 0)
+        return -1;
+    return pos + remaining;
+}
+
+static void broker_reply(broker_t* broker, uint8_t header, const uint8_t* id)
+{
+    uint8_t reply[4] = { header, 2, id[0], id[1] };
+
+    broker_send(broker, reply, sizeof(reply));
+}
+
+/*
+ * Ack a SUBSCRIBE, granting each filter the QoS asked for.
+ */
+static void broker_suback(broker_t* broker, const uint8_t* body, int length)
+{
+    uint8_t reply[2 + 2 + 64];
+    int pos = 2, count = 0;
+
+    while (pos + 2 < length && count < 64) {
+        pos += 2 + (body[pos] << 8 | body[pos + 1]);
+        if (pos < length)
+            reply[4 + count++] = body[pos] & 0x03;
+        pos++;
+    }
+    reply[0] = 0x90;
+    reply[1] = 2 + count;
+    reply[2] = body[0];
+    reply[3] = body[1];
+    broker_send(broker, reply, 4 + count);
+}
+
+/*
+ * Handle one packet. Returns -1 if the connection is to be closed.
+ */
+static int broker_handle(broker_t* broker, uint8_t* packet, int length)
+{
+    static const uint8_t connack[] = { 0x20, 2, 0, 0 };
+    static const uint8_t pingresp[] = { 0xd0, 0 };
+    uint8_t* body = packet + 1;
+    int qos, topic_length;
+
+    while (*body++ & 0x80)
+        ;
+    length -= body - packet;
+    if (broker->on_packet != NULL)
+        broker->on_packet(broker, packet, length + (body - packet));
+
+    switch (packet[0] >> 4) {
+    case 1:
+        if (broker->refuse)
+            return -1;
+        broker_send(broker, connack, sizeof(connack));
+        return broker->close_after_connack ? -1 : 0;
+    case 3:
+        __atomic_add_fetch(&broker->publishes, 1, __ATOMIC_RELAXED);
+        if (packet[0] & 0x08)
+            __atomic_add_fetch(&broker->duplicates, 1, __ATOMIC_RELAXED);
+        qos = (packet[0] >> 1) & 0x03;
+        topic_length = body[0] << 8 | body[1];
+        if (qos > 0 && !broker->ignore_acks && length >= 2 + topic_length + 2)
+            broker_reply(broker, qos == 1 ? 0x40 : 0x50, body + 2 + topic_length);
+        return 0;
+    case 4:
+    case 7:
+        __atomic_add_fetch(&broker->acks, 1, __ATOMIC_RELAXED);
+        return 0;
+    case 5:
+        __atomic_add_fetch(&broker->acks, 1, __ATOMIC_RELAXED);
+        broker_reply(broker, 0x62, body);
+        return 0;
+    case 6:
+        __atomic_add_fetch(&broker->pubrels, 1, __ATOMIC_RELAXED);
+        if (!broker->ignore_acks)
+            broker_reply(broker, 0x70, body);
+        return 0;
+    case 8:
+        __atomic_add_fetch(&broker->subscribes, 1, __ATOMIC_RELAXED);
+        broker_suback(broker, body, length);
+        return 0;
+    case 10:
+        __atomic_add_fetch(&broker->unsubscribes, 1, __ATOMIC_RELAXED);
+        broker_reply(broker, 0xb0, body);
+        return 0;
+    case 12:
+        __atomic_add_fetch(&broker->pings, 1, __ATOMIC_RELAXED);
+        broker_send(broker, pingresp, sizeof(pingresp));
+        return 0;
+    case 14:
+        __atomic_add_fetch(&broker->disconnects, 1, __ATOMIC_RELAXED);
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+static void* broker_run(void* arg)
+{
+    broker_t* broker = arg;
+    uint8_t* packet = malloc(BROKER_MAX_PACKET);
+    struct pollfd pfd = { broker->listener, POLLIN, 0 };
+    int fd, length, one = 1;
+
+    while (!broker->stop) {
+        if (poll(&pfd, 1, 20) <= 0)
+            continue;
+        fd = accept(broker->listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_mutex_lock(&broker->write_lock);
+        broker->client = fd;
+        pthread_mutex_unlock(&broker->write_lock);
+        __atomic_add_fetch(&broker->connections, 1, __ATOMIC_RELAXED);
+
+        while (!broker->stop && (length = broker_read_packet(broker, packet)) > 0) {
+            if (broker_handle(broker, packet, length) != 0)
+                break;
+        }
+
+        pthread_mutex_lock(&broker->write_lock);
+        broker->client = -1;
+        pthread_mutex_unlock(&broker->write_lock);
+        close(fd);
+    }
+    free(packet);
+    return NULL;
+}
+
+/**
+* \brief listen on a free loopback port, set in port, and serve from a new thread
+* \return 0 if successfull, otherwise failed
+*/
+int broker_start(broker_t* broker)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    int one = 1;
+
+    broker->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (broker->listener < 0)
+        return -1;
+    setsockopt(broker->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(broker->listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(broker->listener, 4) != 0 ||
+        getsockname(broker->listener, (struct sockaddr*)&addr, &addr_length) != 0) {
+        close(broker->listener);
+        return -1;
+    }
+    broker->port = ntohs(addr.sin_port);
+    broker->client = -1;
+    broker->stop = false;
+    pthread_mutex_init(&broker->write_lock, NULL);
+    if (pthread_create(&broker->thread, NULL, broker_run, broker) != 0) {
+        close(broker->listener);
+        return -1;
+    }
+    return 0;
+}
+
+void broker_stop(broker_t* broker)
+{
+    broker->stop = true;
+    broker_drop(broker);
+    pthread_join(broker->thread, NULL);
+    close(broker->listener);
+    pthread_mutex_destroy(&broker->write_lock);
+}
+
+/**
+* \brief write a packet to the client connected, in pieces of split bytes if set
+* \return 0 if written, -1 if no client is connected or the write failed
+*/
+int broker_send(broker_t* broker, const uint8_t* packet, int length)
+{
+    int done = 0, n, piece;
+    int result = 0;
+
+    pthread_mutex_lock(&broker->write_lock);
+    while (broker->client >= 0 && done < length) {
+        piece = broker->split > 0 && broker->split < length - done ? broker->split : length - done;
+        n = send(broker->client, packet + done, piece, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        done += n;
+        if (done < length && broker->split > 0 && broker->split_ms > 0)
+            usleep(broker->split_ms * 1000);
+    }
+    if (done < length)
+        result = -1;
+    pthread_mutex_unlock(&broker->write_lock);
+    return result;
+}
+
+/**
+* \brief close the connection of the client, which the broker then waits to come back
+*/
+void broker_drop(broker_t* broker)
+{
+    pthread_mutex_lock(&broker->write_lock);
+    if (broker->client >= 0)
+        shutdown(broker->client, SHUT_RDWR);
+    pthread_mutex_unlock(&broker->write_lock);
+}
@@ -0,0 +1,56 @@
+#ifndef _BROKER_H_
+#define _BROKER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Loopback MQTT 3.1.1 server for the host tests. It serves one connection
+ * at a time from its own thread, acks what the client sends and counts it.
+ * The behaviour fields may be changed while it runs.
+ */
+
+typedef struct broker broker_t;
+
+/* Every packet from the client, whole, called from the broker thread before it is acked */
+typedef void (* broker_packet_callback)(broker_t* broker, const uint8_t* packet, int length);
+
+struct broker
+{
+  /* Behaviour */
+  volatile bool ignore_acks;         /* No PUBACK, PUBREC nor PUBCOMP */
+  volatile bool refuse;              /* Close each connection before the CONNACK */
+  volatile bool close_after_connack; /* Close each connection right after the CONNACK */
+  volatile int split;                /* Write to the client this many bytes at a time, 0 for whole packets */
+  volatile int split_ms;             /* Pause between those pieces */
+  broker_packet_callback on_packet;
+  void* context;
+
+  /* Set by broker_start */
+  uint16_t port;
+
+  /* Counted by the broker thread */
+  volatile int connections;
+  volatile int publishes;
+  volatile int duplicates;           /* PUBLISH with DUP set, counted in publishes too */
+  volatile int pubrels;
+  volatile int subscribes;
+  volatile int unsubscribes;
+  volatile int pings;
+  volatile int disconnects;
+  volatile int acks;                 /* PUBACK, PUBREC and PUBCOMP */
+
+  int listener;
+  volatile int client;
+  volatile bool stop;
+  pthread_t thread;
+  pthread_mutex_t write_lock;
+};
+
+int broker_start(broker_t* broker);
+void broker_stop(broker_t* broker);
+int broker_send(broker_t* broker, const uint8_t* packet, int length);
+void broker_drop(broker_t* broker);
+
+#endif
@@ -0,0 +1,235 @@
+/**
+* \file
+*   Packet codec against random and mutated input
+*
+* Packets from each encoder of the client, with random topics, payloads and
+* buffer sizes, are decoded as they are, with random bytes changed or cut
+* short, and as plain random bytes. Each input sits in a heap block of
+* its exact size, so that ASan reports any read past it, and is decoded
+* whole as well as one byte at a time. What the decoder reports must lie
+* within the input, and unchanged packets must read back as encoded.
+* Built under MQTT 5 as fuzz_msg_v5, with its property lists.
+*
+*   fuzz_msg [iterations]
+*/
+#include <stdint.h>
+#include <string.h>
+#include "mqtt_msg.h"
+#include "test.h"
+
+#define MAX_INPUT 512
+
+// Packet type of each encoder encode picks from
+static const int encoded_types[] = {
+    MQTT_MSG_TYPE_PUBLISH, MQTT_MSG_TYPE_PUBLISH, MQTT_MSG_TYPE_SUBSCRIBE, MQTT_MSG_TYPE_UNSUBSCRIBE,
+    MQTT_MSG_TYPE_PUBACK, MQTT_MSG_TYPE_CONNECT, MQTT_MSG_TYPE_PINGREQ, MQTT_MSG_TYPE_PUBREL,
+    MQTT_MSG_TYPE_PUBREC, MQTT_MSG_TYPE_PUBCOMP, MQTT_MSG_TYPE_PINGRESP, MQTT_MSG_TYPE_DISCONNECT,
+    MQTT_MSG_TYPE_PUBLISH, MQTT_MSG_TYPE_SUBSCRIBE, MQTT_MSG_TYPE_UNSUBSCRIBE,
+};
+
+static uint32_t random_state = 12345;
+
+static uint32_t next_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+/*
+ * Decode n bytes every way the client does, checking the spans the
+ * decoder reports. Returns the whole-input parse result, setting decoded
+ * if it is 0.
+ */
+static int decode(const uint8_t* input, int n, mqtt_packet_t* decoded)
+{
+    uint8_t* buffer = malloc(n > 0 ? n : 1);
+    mqtt_parser_t parser;
+    mqtt_packet_t* packet = &parser.packet;
+    mqtt_property_t property;
+    uint32_t pos = 0;
+    uint16_t length;
+    int result, resumed, k;
+
+    memcpy(buffer, input, n);
+    mqtt_parser_init(&parser);
+    result = mqtt_parse(&parser, buffer, n);
+    if (result == 0) {
+        CHECK(packet->header_length <= (uint32_t)n);
+        CHECK(packet->total_length == packet->header_length + packet->remaining_length);
+        CHECK(packet->payload_offset <= (uint32_t)n && packet->payload_offset <= packet->total_length);
+        CHECK(packet->payload_offset + packet->payload_length == packet->total_length);
+        CHECK(packet->properties_offset + packet->properties_length <= (uint32_t)n);
+        if (packet->topic != NULL)
+            CHECK(packet->topic >= (const char*)buffer &&
+                  packet->topic + packet->topic_length <= (const char*)buffer + n);
+        while (mqtt_property_next(buffer + packet->properties_offset, packet->properties_length,
+                                  &pos, &property) > 0)
+            CHECK(property.data == NULL || (property.data >= buffer && property.data + property.length <= buffer + n));
+        // Pointing into input, as buffer goes
+        *decoded = *packet;
+        if (packet->topic != NULL)
+            decoded->topic = (const char*)input + (packet->topic - (const char*)buffer);
+    }
+
+    // Resumed as the bytes come in, it must agree
+    mqtt_parser_init(&parser);
+    for (k = 0; k <= n; k++) {
+        resumed = mqtt_parse(&parser, buffer, k);
+        if (resumed <= 0)
+            break;
+    }
+    CHECK((resumed > 0) == (result > 0) && (resumed < 0) == (result < 0));
+
+    length = n;
+    mqtt_get_publish_topic(buffer, &length);
+    length = n;
+    if (mqtt_get_publish_data(buffer, &length) != NULL)
+        CHECK(length <= n);
+    mqtt_get_id(buffer, n);
+    mqtt_get_total_length(buffer, n);
+    free(buffer);
+    return result;
+}
+
+/*
+ * Encode a random packet into a buffer of random size. Returns its length,
+ * 0 if it did not fit.
+ */
+static int encode(uint8_t* packet, char* topic, char* data, int* type, uint16_t* msg_id, int* data_length)
+{
+    mqtt_connection_t connection;
+    mqtt_message_t* msg;
+    mqtt_topic_t topics[4];
+    mqtt_prepared_topic_t* prepared = NULL;
+    int buffer_length = next_random() % 400 + 1;
+    uint8_t* buffer = malloc(buffer_length);
+    int topic_length = next_random() % 70 + 1;
+    int i, packed, length;
+
+    for (i = 0; i < topic_length; i++)
+        topic[i] = 'a' + next_random() % 26;
+    topic[topic_length] = 0;
+    *data_length = next_random() % 300;
+    for (i = 0; i < *data_length; i++)
+        data[i] = next_random();
+    *msg_id = 0;
+    for (i = 0; i < 4; i++) {
+        topics[i].topic = topic;
+        topics[i].qos = next_random() % 3;
+    }
+
+    mqtt_msg_init(&connection, buffer, buffer_length);
+    *type = next_random() % (sizeof(encoded_types) / sizeof(encoded_types[0]));
+    switch (*type) {
+    case 0:
+        msg = mqtt_msg_publish(&connection, topic, data, *data_length, next_random() % 3, next_random() % 2, msg_id);
+        break;
+    case 1:
+        msg = mqtt_msg_publish_header(&connection, topic, next_random(), next_random() % 3, 0, msg_id);
+        break;
+    case 2:
+        msg = mqtt_msg_subscribe_multiple(&connection, topics, 4, &packed, msg_id);
+        break;
+    case 3:
+        msg = mqtt_msg_unsubscribe_multiple(&connection, topics, 4, &packed, msg_id);
+        break;
+    case 4:
+        *msg_id = next_random() % 0xffff + 1;
+        msg = mqtt_msg_puback(&connection, *msg_id);
+        break;
+    case 5: {
+        mqtt_connect_info_t info = { topic, topic, topic, topic, data, 60, *data_length, 1, 1, 1 };
+        msg = mqtt_msg_connect(&connection, &info);
+        break;
+    }
+    case 6:
+        msg = mqtt_msg_pingreq(&connection);
+        break;
+    case 7:
+        *msg_id = next_random() % 0xffff + 1;
+        msg = mqtt_msg_pubrel(&connection, *msg_id);
+        break;
+    case 8:
+        *msg_id = next_random() % 0xffff + 1;
+        msg = mqtt_msg_pubrec(&connection, *msg_id);
+        break;
+    case 9:
+        *msg_id = next_random() % 0xffff + 1;
+        msg = mqtt_msg_pubcomp(&connection, *msg_id);
+        break;
+    case 10:
+        msg = mqtt_msg_pingresp(&connection);
+        break;
+    case 11:
+        msg = mqtt_msg_disconnect(&connection);
+        break;
+    case 12:
+        prepared = malloc(mqtt_msg_prepared_topic_size(topic));
+        mqtt_msg_prepare_topic(prepared, topic, next_random() % 3, next_random() % 2);
+        msg = mqtt_msg_publish_prepared(&connection, prepared, data, *data_length, msg_id);
+        break;
+    case 13:
+        msg = mqtt_msg_subscribe(&connection, topic, next_random() % 3, msg_id);
+        break;
+    default:
+        msg = mqtt_msg_unsubscribe(&connection, topic, msg_id);
+        break;
+    }
+    length = msg->length < MAX_INPUT ? msg->length : MAX_INPUT;
+    if (length > 0)
+        memcpy(packet, msg->data, length);
+    free(prepared);
+    free(buffer);
+    return length;
+}
+
+int main(int argc, char** argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    uint8_t packet[MAX_INPUT], mutated[MAX_INPUT], noise[64];
+    char topic[80], data[300];
+    mqtt_packet_t decoded;
+    uint16_t msg_id;
+    int type, data_length;
+    int i, k, n, m, flips, packets = 0;
+    long it;
+
+    for (it = 0; it < iterations; it++) {
+        n = encode(packet, topic, data, &type, &msg_id, &data_length);
+        if (n > 0 && decode(packet, n, &decoded) == 0) {
+            packets++;
+            CHECK_EQ(decoded.type, encoded_types[type]);
+            // Unchanged, a whole PUBLISH reads back as encoded
+            if ((type == 0 || type == 12) && decoded.total_length == (uint32_t)n) {
+                CHECK(decoded.type == MQTT_MSG_TYPE_PUBLISH);
+                CHECK(decoded.topic_length == strlen(topic) && memcmp(decoded.topic, topic, decoded.topic_length) == 0);
+                CHECK_EQ(decoded.payload_length, data_length);
+                CHECK(memcmp(packet + decoded.payload_offset, data, data_length) == 0);
+                CHECK_EQ(decoded.msg_id, msg_id);
+            }
+            if (type == 4 || (type >= 7 && type <= 9))
+                CHECK_EQ(decoded.msg_id, msg_id);
+        }
+
+        for (k = 0; k < 8; k++) {
+            memcpy(mutated, packet, n);
+            m = n;
+            flips = next_random() % 4 + 1;
+            for (i = 0; i < flips && m > 0; i++)
+                mutated[next_random() % m] = next_random();
+            if (next_random() % 3 == 0 && m > 0)
+                m = next_random() % m;
+            decode(mutated, m, &decoded);
+        }
+
+        m = next_random() % sizeof(noise);
+        for (i = 0; i < m; i++)
+            noise[i] = next_random();
+        decode(noise, m, &decoded);
+    }
+    printf("%ld iterations, %d encoded packets read back\n", iterations, packets);
+    CHECK(packets > 0);
+    TEST_DONE();
+}
@@ -0,0 +1,4 @@
+#ifndef _SHIM_ESP_LOG_H_
+#define _SHIM_ESP_LOG_H_
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef _SHIM_ESP_SYSTEM_H_
+#define _SHIM_ESP_SYSTEM_H_
+
+#include <stdint.h>
+
+uint32_t esp_random(void);
+
+#endif
@@ -0,0 +1,253 @@
+/**
+* \file
+*   FreeRTOS and ESP-IDF calls of the component on POSIX threads
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "xtensa/hal.h"
+#include "shim.h"
+
+struct shim_semaphore
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint32_t count;
+  uint32_t max;
+};
+
+struct shim_task
+{
+  TaskFunction_t code;
+  void* parameters;
+  SemaphoreHandle_t notify;
+};
+
+static __thread TaskHandle_t shim_current;
+static volatile TickType_t shim_tick_offset;
+static volatile int shim_task_count;
+
+uint64_t shim_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+int shim_tasks(void)
+{
+    return __atomic_load_n(&shim_task_count, __ATOMIC_ACQUIRE);
+}
+
+void shim_advance_ticks(TickType_t ticks)
+{
+    __atomic_fetch_add(&shim_tick_offset, ticks, __ATOMIC_RELAXED);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(shim_now_ns() / 1000000u) + __atomic_load_n(&shim_tick_offset, __ATOMIC_RELAXED);
+}
+
+unsigned int xthal_get_ccount(void)
+{
+    return (unsigned int)shim_now_ns();
+}
+
+uint32_t esp_random(void)
+{
+    return ((uint32_t)random() << 16) ^ (uint32_t)random();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec delay = { ticks / 1000, (ticks % 1000) * 1000000L };
+
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR)
+        ;
+}
+
+static SemaphoreHandle_t shim_semaphore_new(uint32_t count, uint32_t max)
+{
+    SemaphoreHandle_t sem = calloc(1, sizeof(*sem));
+
+    if (sem == NULL)
+        return NULL;
+    pthread_mutex_init(&sem->mutex, NULL);
+    pthread_cond_init(&sem->cond, NULL);
+    sem->count = count;
+    sem->max = max;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return shim_semaphore_new(0, 1);
+}
+
+/* No priority inheritance nor recursion check, which the component does not rely on */
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return shim_semaphore_new(1, 1);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    pthread_mutex_destroy(&sem->mutex);
+    pthread_cond_destroy(&sem->cond);
+    free(sem);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks_to_wait)
+{
+    struct timespec deadline;
+    uint64_t ns;
+    int result = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    ns = (uint64_t)deadline.tv_nsec + (uint64_t)ticks_to_wait * 1000000u;
+    deadline.tv_sec += ns / 1000000000u;
+    deadline.tv_nsec = ns % 1000000000u;
+
+    pthread_mutex_lock(&sem->mutex);
+    while (sem->count == 0 && result != ETIMEDOUT) {
+        if (ticks_to_wait == 0)
+            result = ETIMEDOUT;
+        else if (ticks_to_wait == portMAX_DELAY)
+            pthread_cond_wait(&sem->cond, &sem->mutex);
+        else
+            result = pthread_cond_timedwait(&sem->cond, &sem->mutex, &deadline);
+    }
+    if (sem->count == 0) {
+        pthread_mutex_unlock(&sem->mutex);
+        return pdFALSE;
+    }
+    sem->count--;
+    pthread_mutex_unlock(&sem->mutex);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    BaseType_t given = pdFALSE;
+
+    pthread_mutex_lock(&sem->mutex);
+    if (sem->count < sem->max) {
+        sem->count++;
+        given = pdTRUE;
+        pthread_cond_signal(&sem->cond);
+    }
+    pthread_mutex_unlock(&sem->mutex);
+    return given;
+}
+
+static TaskHandle_t shim_task_new(TaskFunction_t code, void* parameters)
+{
+    TaskHandle_t task = calloc(1, sizeof(*task));
+
+    if (task == NULL)
+        return NULL;
+    task->code = code;
+    task->parameters = parameters;
+    task->notify = shim_semaphore_new(0, UINT32_MAX);
+    if (task->notify == NULL) {
+        free(task);
+        return NULL;
+    }
+    return task;
+}
+
+static void shim_task_free(TaskHandle_t task)
+{
+    vSemaphoreDelete(task->notify);
+    free(task);
+}
+
+static void* shim_task_run(void* arg)
+{
+    TaskHandle_t task = arg;
+
+    shim_current = task;
+    task->code(task->parameters);
+    fprintf(stderr, "shim: a task returned from its function\n");
+    abort();
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char* name, uint32_t stack_depth, void* parameters,
+                       UBaseType_t priority, TaskHandle_t* created)
+{
+    TaskHandle_t task = shim_task_new(code, parameters);
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    (void)name;
+    (void)stack_depth;
+    (void)priority;
+    if (task == NULL)
+        return pdFAIL;
+    // Set before the task runs, as FreeRTOS does
+    if (created != NULL)
+        *created = task;
+    __atomic_add_fetch(&shim_task_count, 1, __ATOMIC_RELAXED);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, shim_task_run, task) != 0) {
+        __atomic_sub_fetch(&shim_task_count, 1, __ATOMIC_RELAXED);
+        pthread_attr_destroy(&attr);
+        if (created != NULL)
+            *created = NULL;
+        shim_task_free(task);
+        return pdFAIL;
+    }
+    pthread_attr_destroy(&attr);
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task != NULL && task != shim_current) {
+        fprintf(stderr, "shim: a task may only delete itself\n");
+        abort();
+    }
+    task = shim_current;
+    shim_current = NULL;
+    if (task != NULL) {
+        if (task->code != NULL)
+            __atomic_sub_fetch(&shim_task_count, 1, __ATOMIC_RELEASE);
+        shim_task_free(task);
+    }
+    pthread_exit(NULL);
+}
+
+/* Threads not created by xTaskCreate, main among them, get a handle on first use */
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (shim_current == NULL)
+        shim_current = shim_task_new(NULL, NULL);
+    return shim_current;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    return xSemaphoreGive(task->notify);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    uint32_t count = 0;
+
+    if (xSemaphoreTake(task->notify, ticks_to_wait) != pdTRUE)
+        return 0;
+    count = 1;
+    while (clear_on_exit && xSemaphoreTake(task->notify, 0) == pdTRUE)
+        count++;
+    return count;
+}
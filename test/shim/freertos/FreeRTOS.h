@@ -0,0 +1,28 @@
+#ifndef _SHIM_FREERTOS_H_
+#define _SHIM_FREERTOS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * The parts of the FreeRTOS API the component uses, on POSIX threads, so
+ * that it builds and runs on a host. A tick is a millisecond.
+ */
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define portMAX_DELAY ((TickType_t)0xffffffffu)
+#define portTICK_RATE_MS 1
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+
+typedef struct shim_semaphore* SemaphoreHandle_t;
+typedef struct shim_task* TaskHandle_t;
+
+#endif
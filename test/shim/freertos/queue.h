@@ -0,0 +1,6 @@
+#ifndef _SHIM_QUEUE_H_
+#define _SHIM_QUEUE_H_
+
+#include "freertos/FreeRTOS.h"
+
+#endif
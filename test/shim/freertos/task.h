@@ -0,0 +1,18 @@
+#ifndef _SHIM_TASK_H_
+#define _SHIM_TASK_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef void (* TaskFunction_t)(void* parameters);
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char* name, uint32_t stack_depth, void* parameters,
+                       UBaseType_t priority, TaskHandle_t* created);
+/* Only a task may delete itself: a thread cannot be stopped from outside */
+void vTaskDelete(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+TickType_t xTaskGetTickCount(void);
+void vTaskDelay(TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait);
+
+#endif
@@ -0,0 +1,4 @@
+#ifndef _SHIM_LWIP_DNS_H_
+#define _SHIM_LWIP_DNS_H_
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef _SHIM_LWIP_SOCKETS_H_
+#define _SHIM_LWIP_SOCKETS_H_
+
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <strings.h>
+
+#define LWIP_IPV6 1
+
+#endif
@@ -0,0 +1,4 @@
+#ifndef _SHIM_SDKCONFIG_H_
+#define _SHIM_SDKCONFIG_H_
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef _SHIM_H_
+#define _SHIM_H_
+
+#include "freertos/FreeRTOS.h"
+
+/**
+ * Test hooks of the host shims.
+ */
+
+/* Move the tick count on without waiting, e.g. past a cache TTL */
+void shim_advance_ticks(TickType_t ticks);
+/* Wall clock in nanoseconds, for benchmarks */
+uint64_t shim_now_ns(void);
+/* Tasks created and not deleted yet, e.g. to wait for a stopped client to be gone */
+int shim_tasks(void);
+
+#endif
@@ -0,0 +1,4 @@
+#ifndef _SHIM_TCPIP_ADAPTER_H_
+#define _SHIM_TCPIP_ADAPTER_H_
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef _SHIM_XTENSA_HAL_H_
+#define _SHIM_XTENSA_HAL_H_
+
+/* Nanoseconds rather than CPU cycles on the host */
+unsigned int xthal_get_ccount(void);
+
+#endif
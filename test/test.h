@@ -0,0 +1,49 @@
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "shim.h"
+
+/**
+ * Checks of the host tests: a failed CHECK is reported and counted, and
+ * TEST_DONE makes the exit status tell whether any failed.
+ */
+
+static int test_failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        long long _a = (long long)(a), _b = (long long)(b); \
+        if (_a != _b) { \
+            fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", \
+                    __FILE__, __LINE__, #a, #b, _a, _b); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define TEST_DONE() \
+    do { \
+        printf("%s: %s\n", __FILE__, test_failures == 0 ? "ok" : "FAILED"); \
+        return test_failures == 0 ? 0 : 1; \
+    } while (0)
+
+/* Wait up to ms for cond, checking every millisecond */
+#define WAIT_FOR(cond, ms) \
+    do { \
+        int _left = (ms); \
+        while (!(cond) && _left-- > 0) \
+            vTaskDelay(1); \
+    } while (0)
+
+#endif
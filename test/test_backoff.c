@@ -0,0 +1,149 @@
+/**
+* \file
+*   Reconnect backoff on a clock the test moves
+*
+* backoff_next is fed tick counts and random numbers, so the delays it plans
+* are checked exactly: the first retry right away, then full jitter under a
+* ceiling growing up to max_ms, reset only by a connection that lasted. The
+* client is then run against a failing connect_cb and a broker dropping
+* every connection after the CONNACK, neither of which may reset it.
+*/
+#include <signal.h>
+#include <string.h>
+#include "mqtt.h"
+#include "broker.h"
+#include "test.h"
+
+static volatile int connect_calls;
+
+static bool connect_fails(mqtt_client *client)
+{
+    connect_calls++;
+    return false;
+}
+
+static uint32_t no_jitter(mqtt_client *client)
+{
+    return 0;
+}
+
+static void test_delays(void)
+{
+    static const uint32_t ceilings[] = { 100, 200, 400, 800, 1000, 1000 };
+    mqtt_backoff_t backoff;
+    TickType_t now = 5000;
+    int i;
+
+    backoff_init(&backoff, 100, 1000, 200);
+    CHECK_EQ(backoff_next(&backoff, now, 12345), 0);
+    CHECK_EQ(backoff.failures, 1);
+    CHECK_EQ(backoff.retry_at, now);
+
+    // Each delay is random modulo the ceiling plus one
+    for (i = 0; i < 6; i++) {
+        CHECK_EQ(backoff.ceiling_ms, ceilings[i]);
+        CHECK_EQ(backoff_next(&backoff, now, 1000003), 1000003 % (ceilings[i] + 1));
+        CHECK_EQ(backoff.retry_at, now + backoff.delay_ms / portTICK_RATE_MS);
+        now += backoff.delay_ms;
+    }
+    CHECK_EQ(backoff.failures, 7);
+    CHECK_EQ(backoff_next(&backoff, now, UINT32_MAX), UINT32_MAX % 1001);
+
+    // A connection dropped before initial_ms is one more failure
+    backoff_connected(&backoff, now);
+    now += 99;
+    CHECK_EQ(backoff_next(&backoff, now, 500), 500);
+    CHECK_EQ(backoff.failures, 9);
+    CHECK_EQ(backoff.ceiling_ms, 1000);
+
+    // One that lasted starts over, and only once
+    backoff_connected(&backoff, now);
+    now += 100;
+    CHECK_EQ(backoff_next(&backoff, now, 500), 0);
+    CHECK_EQ(backoff.failures, 1);
+    CHECK_EQ(backoff_next(&backoff, now, 500), 500 % 101);
+    CHECK_EQ(backoff.ceiling_ms, 200);
+
+    // Across the tick count wrapping
+    now = (TickType_t)-50;
+    backoff_connected(&backoff, now);
+    CHECK_EQ(backoff_next(&backoff, now + 20, 7), 7);
+    backoff_connected(&backoff, now);
+    CHECK_EQ(backoff_next(&backoff, now + 150, 7), 0);
+    CHECK_EQ(backoff.retry_at, now + 150);
+}
+
+static void test_defaults(void)
+{
+    mqtt_backoff_t backoff;
+
+    backoff_init(&backoff, 0, 0, 0);
+    CHECK_EQ(backoff.initial_ms, CONFIG_MQTT_RECONNECT_INITIAL_MS);
+    CHECK_EQ(backoff.max_ms, CONFIG_MQTT_RECONNECT_TIMEOUT * 1000);
+    CHECK_EQ(backoff.multiplier, CONFIG_MQTT_RECONNECT_MULTIPLIER);
+
+    // The ceiling never drops below the first one
+    backoff_init(&backoff, 500, 100, 150);
+    CHECK_EQ(backoff.max_ms, 500);
+    backoff_next(&backoff, 0, 0);
+    backoff_next(&backoff, 0, 0);
+    CHECK_EQ(backoff.ceiling_ms, 500);
+}
+
+static void test_client(void)
+{
+    static mqtt_settings settings;
+    static broker_t broker;
+    mqtt_backoff_t backoff;
+    mqtt_client *client;
+
+    // connect_cb failing
+    strcpy(settings.host, "127.0.0.1");
+    strcpy(settings.client_id, "test_backoff");
+    settings.keepalive = 30;
+    settings.clean_session = 1;
+    settings.auto_reconnect = true;
+    settings.reconnect_initial_ms = 100;
+    settings.random_cb = no_jitter;
+    settings.connect_cb = connect_fails;
+    client = mqtt_start(&settings);
+    CHECK(client != NULL);
+    WAIT_FOR(connect_calls >= 4, 2000);
+    mqtt_get_backoff(client, &backoff);
+    CHECK(backoff.failures >= 3);
+    mqtt_stop(client);
+    WAIT_FOR(shim_tasks() == 0, 3000);
+    CHECK_EQ(shim_tasks(), 0);
+
+    // Connections dropped right after the CONNACK
+    CHECK(broker_start(&broker) == 0);
+    broker.close_after_connack = true;
+    memset(&settings, 0, sizeof(settings));
+    strcpy(settings.host, "127.0.0.1");
+    settings.port = broker.port;
+    strcpy(settings.client_id, "test_backoff");
+    settings.keepalive = 30;
+    settings.clean_session = 1;
+    settings.auto_reconnect = true;
+    settings.reconnect_initial_ms = 1000;
+    settings.random_cb = no_jitter;
+    client = mqtt_start(&settings);
+    CHECK(client != NULL);
+    WAIT_FOR(broker.connections >= 4, 3000);
+    mqtt_get_backoff(client, &backoff);
+    CHECK(backoff.failures >= 3);
+    mqtt_stop(client);
+    WAIT_FOR(shim_tasks() == 0, 3000);
+    CHECK_EQ(shim_tasks(), 0);
+    broker_stop(&broker);
+}
+
+int main(void)
+{
+    // The client may still be writing when the broker drops it
+    signal(SIGPIPE, SIG_IGN);
+    test_delays();
+    test_defaults();
+    test_client();
+    TEST_DONE();
+}
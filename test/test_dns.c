@@ -0,0 +1,123 @@
+/**
+* \file
+*   Server addresses cached across reconnects
+*
+* The resolver hands out loopback addresses the broker does not listen on
+* ahead of the one it does. Reconnecting must reuse them while their TTL
+* lasts, starting with the one that worked, resolve again once it is over,
+* and also once none of them takes the connection.
+*/
+#include <string.h>
+#include "mqtt.h"
+#include "broker.h"
+#include "test.h"
+
+#define TTL_S 30
+
+static broker_t broker;
+static mqtt_settings settings;
+static volatile int connected;
+static volatile int resolves;
+static const char **volatile addresses;
+
+static const char *alive[] = { "127.0.0.2", "127.0.0.1", NULL };
+static const char *moved[] = { "127.0.0.3", "127.0.0.2", "127.0.0.1", NULL };
+static const char *dead[] = { "127.0.0.2", "127.0.0.3", NULL };
+
+static int resolve(mqtt_client *client, const char *host, struct sockaddr_storage *addrs, int max,
+                   uint32_t *ttl_s)
+{
+    const char **ip = addresses;
+    struct sockaddr_in *addr;
+    int count;
+
+    resolves++;
+    for (count = 0; ip[count] != NULL && count < max; count++) {
+        memset(&addrs[count], 0, sizeof(addrs[count]));
+        addr = (struct sockaddr_in *)&addrs[count];
+        addr->sin_family = AF_INET;
+        inet_pton(AF_INET, ip[count], &addr->sin_addr);
+    }
+    *ttl_s = TTL_S;
+    return count;
+}
+
+static void on_connected(mqtt_client *client, mqtt_event_data_t *event_data)
+{
+    connected++;
+}
+
+static bool last_is(mqtt_client *client, const char *ip)
+{
+    struct in_addr expected;
+
+    inet_pton(AF_INET, ip, &expected);
+    return client->dns.last.ss_family == AF_INET &&
+           ((struct sockaddr_in *)&client->dns.last)->sin_addr.s_addr == expected.s_addr;
+}
+
+int main(void)
+{
+    mqtt_client *client;
+
+    CHECK(broker_start(&broker) == 0);
+    addresses = alive;
+
+    strcpy(settings.host, "broker.test");
+    settings.port = broker.port;
+    strcpy(settings.client_id, "test_dns");
+    settings.keepalive = 30;
+    settings.clean_session = 1;
+    settings.auto_reconnect = true;
+    settings.reconnect_initial_ms = 10;
+    settings.reconnect_max_ms = 50;
+    settings.resolve_cb = resolve;
+    settings.connected_cb = on_connected;
+    client = mqtt_start(&settings);
+    CHECK(client != NULL);
+
+    // The second address takes the connection and is tried first from now on
+    WAIT_FOR(connected == 1, 2000);
+    CHECK_EQ(connected, 1);
+    CHECK_EQ(resolves, 1);
+    CHECK_EQ(client->dns.count, 2);
+    CHECK_EQ(client->dns.next, 1);
+    CHECK(last_is(client, "127.0.0.1"));
+
+    // Within the TTL the cache is used
+    broker_drop(&broker);
+    WAIT_FOR(connected == 2, 2000);
+    CHECK_EQ(connected, 2);
+    CHECK_EQ(resolves, 1);
+    CHECK_EQ(client->dns.next, 1);
+
+    // Past it the name is resolved again, the address that worked staying first
+    addresses = moved;
+    shim_advance_ticks((TTL_S + 1) * 1000);
+    broker_drop(&broker);
+    WAIT_FOR(connected == 3, 2000);
+    CHECK_EQ(connected, 3);
+    CHECK_EQ(resolves, 2);
+    CHECK_EQ(client->dns.count, 3);
+    CHECK_EQ(client->dns.next, 2);
+    CHECK(last_is(client, "127.0.0.1"));
+
+    // When no address takes the connection the cache is dropped, TTL or not
+    addresses = dead;
+    shim_advance_ticks((TTL_S + 1) * 1000);
+    broker_drop(&broker);
+    WAIT_FOR(resolves >= 5, 3000);
+    CHECK(resolves >= 5);
+    CHECK_EQ(connected, 3);
+
+    addresses = alive;
+    WAIT_FOR(connected == 4, 3000);
+    CHECK_EQ(connected, 4);
+    CHECK(last_is(client, "127.0.0.1"));
+
+    mqtt_stop(client);
+    WAIT_FOR(shim_tasks() == 0, 3000);
+    CHECK_EQ(shim_tasks(), 0);
+    broker_stop(&broker);
+    TEST_DONE();
+}
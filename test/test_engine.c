@@ -0,0 +1,131 @@
+/**
+* \file
+*   Client engine against a broker writing packets in small pieces
+*
+* Every packet from the broker, the CONNACK included, comes in pieces of a
+* few bytes. Acks and publishes must still be handled whole, and while a
+* packet is only partly in the client must go on sending. Built with
+* CONFIG_MQTT_SINGLE_TASK as test_engine_single, where the client task
+* reads only what select reported and returns to its loop in between.
+*/
+#include <string.h>
+#include "mqtt.h"
+#include "broker.h"
+#include "test.h"
+
+#define PAYLOAD_LENGTH 100
+
+static broker_t broker;
+static mqtt_settings settings;
+static volatile int connected;
+static volatile int subacks;
+static volatile int received;
+static volatile int damaged;
+
+static void on_connected(mqtt_client *client, mqtt_event_data_t *event_data)
+{
+    connected++;
+}
+
+static void on_subscribed(mqtt_client *client, mqtt_event_data_t *event_data)
+{
+    subacks++;
+}
+
+static void on_data(mqtt_client *client, mqtt_event_data_t *event_data)
+{
+    int i;
+
+    if (event_data->data_length != PAYLOAD_LENGTH || event_data->data_offset != 0 ||
+        event_data->topic_length != 3 || memcmp(event_data->topic, "a/b", 3) != 0)
+        damaged++;
+    for (i = 0; i < event_data->data_length; i++) {
+        if ((uint8_t)event_data->data[i] != (uint8_t)(i + received))
+            damaged++;
+    }
+    received++;
+}
+
+/*
+ * PUBLISH from the broker to topic a/b, its payload set from seq.
+ */
+static int encode_publish(uint8_t *packet, int qos, uint16_t msg_id, int seq)
+{
+    int pos = 0, i;
+
+    packet[pos++] = 0x30 | qos << 1;
+    packet[pos++] = 2 + 3 + (qos > 0 ? 2 : 0) + PAYLOAD_LENGTH;
+    packet[pos++] = 0;
+    packet[pos++] = 3;
+    memcpy(packet + pos, "a/b", 3);
+    pos += 3;
+    if (qos > 0) {
+        packet[pos++] = msg_id >> 8;
+        packet[pos++] = msg_id & 0xff;
+    }
+    for (i = 0; i < PAYLOAD_LENGTH; i++)
+        packet[pos++] = (uint8_t)(i + seq);
+    return pos;
+}
+
+int main(void)
+{
+    uint8_t packet[2 + 7 + PAYLOAD_LENGTH];
+    mqtt_client *client;
+    int i, length;
+
+    CHECK(broker_start(&broker) == 0);
+    broker.split = 3;
+    broker.split_ms = 2;
+
+    strcpy(settings.host, "127.0.0.1");
+    settings.port = broker.port;
+    strcpy(settings.client_id, "test_engine");
+    settings.keepalive = 30;
+    settings.clean_session = 1;
+    settings.auto_reconnect = true;
+    settings.connected_cb = on_connected;
+    settings.subscribe_cb = on_subscribed;
+    settings.data_cb = on_data;
+    client = mqtt_start(&settings);
+    CHECK(client != NULL);
+    WAIT_FOR(connected == 1, 3000);
+    CHECK_EQ(connected, 1);
+
+    CHECK_EQ(mqtt_subscribe(client, "a/#", 1, NULL, NULL), MQTT_OK);
+    WAIT_FOR(subacks == 1, 3000);
+    CHECK_EQ(subacks, 1);
+
+    // Publishes in pieces, each acked once whole
+    for (i = 0; i < 10; i++) {
+        length = encode_publish(packet, i & 1, i + 1, i);
+        CHECK_EQ(broker_send(&broker, packet, length), 0);
+    }
+    WAIT_FOR(received == 10 && broker.acks == 5, 3000);
+    CHECK_EQ(received, 10);
+    CHECK_EQ(broker.acks, 5);
+    CHECK_EQ(damaged, 0);
+
+    // Half a packet in: the client still sends, at QoS 0 so that no ack
+    // from the broker cuts the packet
+    broker.split = 0;
+    length = encode_publish(packet, 1, 100, 10);
+    CHECK_EQ(broker_send(&broker, packet, length / 2), 0);
+    vTaskDelay(20);
+    CHECK_EQ(mqtt_publish(client, "c/d", "meanwhile", 9, 0, 0), MQTT_OK);
+    WAIT_FOR(broker.publishes == 1, 2000);
+    CHECK_EQ(broker.publishes, 1);
+    CHECK_EQ(received, 10);
+    CHECK_EQ(broker_send(&broker, packet + length / 2, length - length / 2), 0);
+    WAIT_FOR(received == 11 && broker.acks == 6, 2000);
+    CHECK_EQ(received, 11);
+    CHECK_EQ(broker.acks, 6);
+    CHECK_EQ(damaged, 0);
+    CHECK_EQ(connected, 1);
+
+    mqtt_stop(client);
+    WAIT_FOR(shim_tasks() == 0, 3000);
+    CHECK_EQ(shim_tasks(), 0);
+    broker_stop(&broker);
+    TEST_DONE();
+}
@@ -0,0 +1,141 @@
+/**
+* \file
+*   QoS 1 and 2 publishes across lost acks and reconnects
+*
+* The broker first leaves the publishes unacked: they must go out again with
+* DUP set once the ack is late and once the connection is back, except the
+* one whose payload was written from the caller's buffer, which is dropped.
+* Every reconnect has the sending task exit on its own, and stopping the
+* client must leave no task behind. A packet identifier held for a
+* SUBSCRIBE must not go to a publish until released, and producers waiting
+* for a full window must all get the slots freed at once.
+*/
+#include <string.h>
+#include "mqtt.h"
+#include "broker.h"
+#include "test.h"
+
+static broker_t broker;
+static mqtt_settings settings;
+static volatile int connected;
+
+static void on_connected(mqtt_client *client, mqtt_event_data_t *event_data)
+{
+    connected++;
+}
+
+static mqtt_inflight_t waited;
+static volatile int reserved;
+
+static void reserve_task(void *arg)
+{
+    if (inflight_reserve(&waited, 5000) != 0)
+        __atomic_add_fetch(&reserved, 1, __ATOMIC_RELAXED);
+    vTaskDelete(NULL);
+}
+
+static void test_waiters(void)
+{
+    uint16_t first, second;
+    int tasks = shim_tasks();
+
+    CHECK_EQ(inflight_init(&waited, 2, 64), 0);
+    first = inflight_reserve(&waited, 0);
+    second = inflight_reserve(&waited, 0);
+    xTaskCreate(reserve_task, "reserve", 2048, NULL, 5, NULL);
+    xTaskCreate(reserve_task, "reserve", 2048, NULL, 5, NULL);
+    WAIT_FOR(waited.waiters == 2, 1000);
+    CHECK_EQ(waited.waiters, 2);
+
+    // Freed back to back, before either waiter runs
+    inflight_cancel(&waited, first);
+    inflight_cancel(&waited, second);
+    WAIT_FOR(reserved == 2, 1000);
+    CHECK_EQ(reserved, 2);
+    WAIT_FOR(shim_tasks() == tasks, 6000);
+    inflight_deinit(&waited);
+}
+
+static void test_held_ids(void)
+{
+    mqtt_inflight_t ifl;
+    uint16_t held, msg_id;
+    bool reused = false;
+    int i;
+
+    CHECK_EQ(inflight_init(&ifl, 0, 64), 0);
+    held = inflight_hold_id(&ifl);
+    for (i = 0; i < 0x20000; i++) {
+        msg_id = inflight_reserve(&ifl, 0);
+        CHECK(msg_id != 0 && msg_id != held);
+        inflight_cancel(&ifl, msg_id);
+    }
+    inflight_release_id(&ifl, held);
+    for (i = 0; i < 0x10000 && !reused; i++) {
+        msg_id = inflight_reserve(&ifl, 0);
+        reused = msg_id == held;
+        inflight_cancel(&ifl, msg_id);
+    }
+    CHECK(reused);
+    inflight_deinit(&ifl);
+}
+
+int main(void)
+{
+    static char big[6000];
+    mqtt_client *client;
+
+    test_held_ids();
+    test_waiters();
+    CHECK(broker_start(&broker) == 0);
+    broker.ignore_acks = true;
+
+    strcpy(settings.host, "127.0.0.1");
+    settings.port = broker.port;
+    strcpy(settings.client_id, "test_inflight");
+    settings.keepalive = 30;
+    settings.clean_session = 1;
+    settings.auto_reconnect = true;
+    settings.reconnect_initial_ms = 10;
+    settings.connected_cb = on_connected;
+    client = mqtt_start(&settings);
+    CHECK(client != NULL);
+    WAIT_FOR(connected == 1, 2000);
+    CHECK_EQ(connected, 1);
+
+    // Late ack: written again with DUP set
+    CHECK_EQ(mqtt_publish(client, "a/b", "late", 4, 1, 0), MQTT_OK);
+    WAIT_FOR(broker.publishes == 1, 2000);
+    CHECK_EQ(broker.duplicates, 0);
+    shim_advance_ticks(CONFIG_MQTT_RETRANSMIT_TIMEOUT * 1000);
+    WAIT_FOR(broker.duplicates == 1, 3000);
+    CHECK_EQ(broker.duplicates, 1);
+
+    // Lost connection: all unacked publishes go out again, bar the external one
+    CHECK_EQ(mqtt_publish(client, "a/b", "one", 3, 1, 0), MQTT_OK);
+    CHECK_EQ(mqtt_publish(client, "a/b", "two", 3, 2, 0), MQTT_OK);
+    CHECK_EQ(mqtt_publish(client, "a/b", big, sizeof(big), 1, 0), MQTT_OK);
+    WAIT_FOR(broker.publishes == 5, 2000);
+    CHECK_EQ(broker.publishes, 5);
+    CHECK_EQ(client->inflight.count, 4);
+
+    broker.ignore_acks = false;
+    broker_drop(&broker);
+    WAIT_FOR(connected == 2 && client->inflight.count == 0, 3000);
+    CHECK_EQ(connected, 2);
+    CHECK_EQ(client->inflight.count, 0);
+    CHECK_EQ(broker.publishes, 8);
+    CHECK_EQ(broker.duplicates, 4);
+    CHECK_EQ(broker.pubrels, 1);
+
+    // Still usable after
+    CHECK_EQ(mqtt_publish(client, "a/b", "after", 5, 1, 0), MQTT_OK);
+    WAIT_FOR(broker.publishes == 9 && client->inflight.count == 0, 2000);
+    CHECK_EQ(client->inflight.count, 0);
+
+    mqtt_stop(client);
+    WAIT_FOR(shim_tasks() == 0, 3000);
+    CHECK_EQ(shim_tasks(), 0);
+    broker_stop(&broker);
+    TEST_DONE();
+}
@@ -0,0 +1,121 @@
+/**
+* \file
+*   Acks and urgent publishes ahead of queued bulk publishes
+*
+* Writes are slowed down so that the bulk lane stays full of numbered
+* publishes. The PUBACK of a publish from the broker, and a publish queued
+* with mqtt_publish_urgent, must reach the broker before bulk publishes
+* that were queued ahead of them.
+*/
+#include <string.h>
+#include <unistd.h>
+#include "mqtt.h"
+#include "broker.h"
+#include "test.h"
+
+#define BULK_PUBLISHES 300
+#define BULK_LENGTH 300
+
+/* The client's own socket writes, slowed down here */
+int mqtt_write(mqtt_client *client, const void *buffer, int len, int timeout_ms);
+int mqtt_writev(mqtt_client *client, const mqtt_segment_t *segments, int count, int timeout_ms);
+
+static broker_t broker;
+static mqtt_settings settings;
+static volatile int connected;
+static volatile int last_bulk = -1;   /* Number of the last bulk publish the broker got */
+static volatile int bulk_at_ack = -1;
+static volatile int bulk_at_urgent = -1;
+
+static void on_connected(mqtt_client *client, mqtt_event_data_t *event_data)
+{
+    connected++;
+}
+
+static int slow_write(mqtt_client *client, const void *buffer, int len, int timeout_ms)
+{
+    if (len > 100)
+        usleep(1000);
+    return mqtt_write(client, buffer, len, timeout_ms);
+}
+
+static int slow_writev(mqtt_client *client, const mqtt_segment_t *segments, int count, int timeout_ms)
+{
+    usleep(1000);
+    return mqtt_writev(client, segments, count, timeout_ms);
+}
+
+static void on_packet(broker_t *b, const uint8_t *packet, int length)
+{
+    const uint8_t *body = packet + 1;
+    int topic_length, seq;
+
+    while (*body++ & 0x80)
+        ;
+    switch (packet[0] >> 4) {
+    case 3:
+        topic_length = body[0] << 8 | body[1];
+        if (topic_length == 4 && memcmp(body + 2, "bulk", 4) == 0) {
+            memcpy(&seq, body + 2 + 4, sizeof(seq));
+            last_bulk = seq;
+        } else if (topic_length == 6 && memcmp(body + 2, "urgent", 6) == 0) {
+            bulk_at_urgent = last_bulk;
+        }
+        break;
+    case 4:
+        bulk_at_ack = last_bulk;
+        break;
+    }
+}
+
+int main(void)
+{
+    static const uint8_t publish[] = { 0x32, 2 + 1 + 2 + 2, 0, 1, 'x', 0x12, 0x34, 'h', 'i' };
+    static char payload[BULK_LENGTH];
+    mqtt_client *client;
+    int seq, acked_at = -1, urgent_at = -1;
+
+    CHECK(broker_start(&broker) == 0);
+    broker.on_packet = on_packet;
+
+    strcpy(settings.host, "127.0.0.1");
+    settings.port = broker.port;
+    strcpy(settings.client_id, "test_lane");
+    settings.keepalive = 30;
+    settings.clean_session = 1;
+    settings.connected_cb = on_connected;
+    settings.write_cb = slow_write;
+    settings.writev_cb = slow_writev;
+    client = mqtt_start(&settings);
+    CHECK(client != NULL);
+    WAIT_FOR(connected == 1, 2000);
+    CHECK_EQ(connected, 1);
+
+    // The queue is full from early on, each publish waiting for room
+    for (seq = 0; seq < BULK_PUBLISHES; seq++) {
+        memcpy(payload, &seq, sizeof(seq));
+        CHECK_EQ(mqtt_publish(client, "bulk", payload, sizeof(payload), 0, 0), MQTT_OK);
+        if (seq == BULK_PUBLISHES / 3) {
+            CHECK_EQ(broker_send(&broker, publish, sizeof(publish)), 0);
+            acked_at = seq;
+        }
+        if (seq == 2 * BULK_PUBLISHES / 3) {
+            CHECK_EQ(mqtt_publish_urgent(client, "urgent", "!", 1, 0, 0), MQTT_OK);
+            urgent_at = seq;
+        }
+    }
+    WAIT_FOR(last_bulk == BULK_PUBLISHES - 1, 5000);
+    CHECK_EQ(last_bulk, BULK_PUBLISHES - 1);
+
+    // Only the bulk record being written, and one batched with it, go first
+    printf("ack queued behind bulk %d, sent after %d; urgent queued behind %d, sent after %d\n",
+           acked_at, bulk_at_ack, urgent_at, bulk_at_urgent);
+    CHECK(bulk_at_ack >= 0 && bulk_at_ack < acked_at - 1);
+    CHECK(bulk_at_urgent >= 0 && bulk_at_urgent < urgent_at - 1);
+
+    mqtt_stop(client);
+    WAIT_FOR(shim_tasks() == 0, 3000);
+    CHECK_EQ(shim_tasks(), 0);
+    broker_stop(&broker);
+    TEST_DONE();
+}
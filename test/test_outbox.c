@@ -0,0 +1,221 @@
+/**
+* \file
+*   Outbox under producers racing each other, evicting, and a sending task
+*
+* Bulk producers queue PUBLISH records and evict the oldest ones when the
+* lane is full; one producer queues acks in the urgent lane, which are never
+* evicted. The consumer claims records one by one or in batches, as the
+* sending task does. Each producer's records must come out whole and in
+* order, the urgent ones all of them, and the ring must be left all zero.
+* Before that, publishes queued behind one being sent are checked to be
+* discarded in place.
+*/
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include "mqtt_outbox.h"
+#include "test.h"
+
+#define BULK_PRODUCERS 3
+#define RECORDS 100000
+#define URGENT_RECORDS 20000
+#define URGENT_SIZE 512
+
+static mqtt_outbox_t outbox;
+static uint64_t memory[(4096 + URGENT_SIZE) / 8];
+static volatile int evicted;
+static volatile int producers_done;
+
+typedef struct
+{
+  int producer;
+  int lane;
+  int records;
+} producer_t;
+
+static int record_length(int producer, uint32_t seq)
+{
+    return 9 + (seq * 2654435761u >> 20 ^ producer) % 200;
+}
+
+static void fill(uint8_t* packet, int producer, uint32_t seq, int length)
+{
+    int i;
+
+    packet[0] = producer == BULK_PRODUCERS ? MQTT_MSG_TYPE_PUBACK << 4 : MQTT_MSG_TYPE_PUBLISH << 4;
+    packet[1] = producer;
+    memcpy(packet + 2, &seq, 4);
+    for (i = 6; i < length; i++)
+        packet[i] = (uint8_t)(seq * 13 + i + producer);
+}
+
+static void* producer_run(void* arg)
+{
+    producer_t* p = arg;
+    mqtt_outbox_record_t dropped;
+    mqtt_message_t msg;
+    uint8_t* region;
+    uint32_t seq;
+    int length;
+
+    for (seq = 0; seq < (uint32_t)p->records; seq++) {
+        length = record_length(p->producer, seq);
+        // Encoders may leave slack in front of the packet
+        while ((region = outbox_reserve(&outbox, p->lane, length + (seq & 1), 0)) == NULL) {
+            if (p->lane == OUTBOX_LANE_BULK && outbox_evict(&outbox, p->lane, 0, &dropped) > 0)
+                __atomic_add_fetch(&evicted, 1, __ATOMIC_RELAXED);
+            else
+                sched_yield();
+        }
+        msg.data = region + (seq & 1);
+        msg.length = length;
+        fill(msg.data, p->producer, seq, length);
+        outbox_commit(&outbox, region, &msg, seq & 0xffff, NULL);
+    }
+    __atomic_add_fetch(&producers_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Check a record against what its producer queued. Returns its producer, -1
+ * if it is damaged.
+ */
+static int check_record(mqtt_outbox_record_t* rec, uint32_t* next)
+{
+    uint8_t* packet = outbox_packet(rec);
+    uint32_t seq;
+    int producer = packet[1];
+    int i;
+
+    memcpy(&seq, packet + 2, 4);
+    if (producer > BULK_PRODUCERS || seq < next[producer] || rec->msg_id != (seq & 0xffff) ||
+        rec->length != record_length(producer, seq))
+        return -1;
+    // Bulk records may have been evicted in between, urgent ones not
+    if (producer == BULK_PRODUCERS && seq != next[producer])
+        return -1;
+    for (i = 6; i < rec->length; i++) {
+        if (packet[i] != (uint8_t)(seq * 13 + i + producer))
+            return -1;
+    }
+    next[producer] = seq + 1;
+    return producer;
+}
+
+static void queue(int qos, uint16_t msg_id)
+{
+    mqtt_message_t msg;
+    uint8_t* region;
+
+    region = outbox_reserve(&outbox, OUTBOX_LANE_BULK, 16, 0);
+    CHECK(region != NULL);
+    memset(region, 0, 16);
+    region[0] = MQTT_MSG_TYPE_PUBLISH << 4 | qos << 1;
+    msg.data = region;
+    msg.length = 16;
+    outbox_commit(&outbox, region, &msg, msg_id, NULL);
+}
+
+static void test_in_place(void)
+{
+    mqtt_outbox_record_t *rec, dropped;
+    int fill;
+
+    CHECK(outbox_init(&outbox, (uint8_t*)memory, sizeof(memory), URGENT_SIZE) == 0);
+    queue(0, 1);
+    queue(0, 2);
+    queue(1, 3);
+    queue(0, 4);
+    fill = rb_fill(&outbox.lanes[OUTBOX_LANE_BULK]);
+
+    // Behind the one being sent, the oldest of at most the QoS given goes,
+    // its room only once the sending task gets past it
+    rec = outbox_claim(&outbox, 0);
+    CHECK(rec != NULL && rec->msg_id == 1);
+    CHECK(outbox_evict(&outbox, OUTBOX_LANE_BULK, 0, &dropped) > 0);
+    CHECK_EQ(dropped.msg_id, 2);
+    CHECK(outbox_evict(&outbox, OUTBOX_LANE_BULK, 0, &dropped) > 0);
+    CHECK_EQ(dropped.msg_id, 4);
+    CHECK_EQ(outbox_evict(&outbox, OUTBOX_LANE_BULK, 0, &dropped), 0);
+    CHECK_EQ(outbox.count, 2);
+    CHECK_EQ(rb_fill(&outbox.lanes[OUTBOX_LANE_BULK]), fill);
+
+    // A batch stops at a discarded record, and the next claim frees it
+    CHECK(outbox_claim_next(&outbox, rec, 256, 0) == NULL);
+    outbox_release(&outbox, rec);
+    rec = outbox_claim(&outbox, 0);
+    CHECK(rec != NULL && rec->msg_id == 3);
+    CHECK(outbox_claim_next(&outbox, rec, 256, 0) == NULL);
+    outbox_release(&outbox, rec);
+    CHECK(outbox_claim(&outbox, 0) == NULL);
+    CHECK_EQ(outbox.count, 0);
+    CHECK_EQ(rb_fill(&outbox.lanes[OUTBOX_LANE_BULK]), 0);
+
+    // Pending at the front, it is freed right away
+    queue(0, 5);
+    CHECK(outbox_evict(&outbox, OUTBOX_LANE_BULK, 0, &dropped) > 0);
+    CHECK_EQ(dropped.msg_id, 5);
+    CHECK_EQ(rb_fill(&outbox.lanes[OUTBOX_LANE_BULK]), 0);
+    outbox_deinit(&outbox);
+}
+
+int main(void)
+{
+    producer_t args[BULK_PRODUCERS + 1];
+    pthread_t threads[BULK_PRODUCERS + 1];
+    uint32_t next[BULK_PRODUCERS + 1] = { 0 };
+    mqtt_outbox_record_t *rec, *batch[8];
+    int received[BULK_PRODUCERS + 1] = { 0 };
+    int bad = 0, total = 0;
+    int i, n, p;
+    unsigned int k;
+
+    test_in_place();
+    CHECK(outbox_init(&outbox, (uint8_t*)memory, sizeof(memory), URGENT_SIZE) == 0);
+    for (p = 0; p <= BULK_PRODUCERS; p++) {
+        args[p].producer = p;
+        args[p].lane = p == BULK_PRODUCERS ? OUTBOX_LANE_URGENT : OUTBOX_LANE_BULK;
+        args[p].records = p == BULK_PRODUCERS ? URGENT_RECORDS : RECORDS;
+        pthread_create(&threads[p], NULL, producer_run, &args[p]);
+    }
+
+    while (1) {
+        rec = outbox_claim(&outbox, 10);
+        if (rec == NULL) {
+            if (__atomic_load_n(&producers_done, __ATOMIC_ACQUIRE) == BULK_PRODUCERS + 1 && outbox.count == 0)
+                break;
+            continue;
+        }
+        // Every other time, batch up what is queued right behind
+        n = 0;
+        batch[n++] = rec;
+        while ((total & 1) && n < 8 && (rec = outbox_claim_next(&outbox, rec, 256, 0)) != NULL)
+            batch[n++] = rec;
+        for (i = 0; i < n; i++) {
+            p = check_record(batch[i], next);
+            if (p < 0)
+                bad++;
+            else
+                received[p]++;
+            outbox_release(&outbox, batch[i]);
+            total++;
+        }
+    }
+    for (p = 0; p <= BULK_PRODUCERS; p++)
+        pthread_join(threads[p], NULL);
+
+    CHECK_EQ(bad, 0);
+    CHECK_EQ(received[BULK_PRODUCERS], URGENT_RECORDS);
+    CHECK_EQ(received[0] + received[1] + received[2] + evicted, BULK_PRODUCERS * RECORDS);
+    CHECK(evicted > 0);
+    CHECK_EQ(outbox.count, 0);
+    CHECK_EQ(rb_fill(&outbox.lanes[OUTBOX_LANE_BULK]), 0);
+    CHECK_EQ(rb_fill(&outbox.lanes[OUTBOX_LANE_URGENT]), 0);
+    // rb_claim relies on the free bytes being zero
+    for (k = 0; k < sizeof(memory) / 8; k++)
+        bad += memory[k] != 0;
+    CHECK_EQ(bad, 0);
+    printf("%d records received, %d evicted\n", total, evicted);
+    outbox_deinit(&outbox);
+    TEST_DONE();
+}
@@ -0,0 +1,145 @@
+/**
+* \file
+*   Store of QoS 1 and 2 publishes across a failed write and a restart
+*
+* A file size limit makes the flush of an append fail halfway through its
+* record: it must be reported lost, the next append must go to a new
+* segment, and the torn record must be skipped both when reading on and
+* after the store is opened again. Records not flushed yet must still be
+* read back. A store with
+* every segment holding records not acked must refuse appends, and keep all
+* of them when opened again. Built with small segments, few of them.
+*/
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "mqtt_store.h"
+#include "mqtt_msg.h"
+#include "test.h"
+
+static int encode(int n, uint8_t *buffer, int size)
+{
+    mqtt_connection_t connection;
+    mqtt_message_t *msg;
+    char data[32];
+    uint16_t msg_id = 1;
+
+    snprintf(data, sizeof(data), "record %d", n);
+    mqtt_msg_init(&connection, buffer, size);
+    msg = mqtt_msg_publish(&connection, "store/test", data, strlen(data), 1, 0, &msg_id);
+    // The encoder may leave slack in front of the packet
+    memmove(buffer, msg->data, msg->length);
+    return msg->length;
+}
+
+static int append(mqtt_store_t *store, int n)
+{
+    uint8_t packet[64];
+
+    return store_append(store, packet, encode(n, packet, sizeof(packet)));
+}
+
+/*
+ * Send and ack what the store holds, checking it is the expected records
+ * in order. Returns how many there were.
+ */
+static int drain(mqtt_store_t *store, const int *expected, uint16_t msg_id)
+{
+    uint8_t packet[64];
+    char wanted[32];
+    const char *data;
+    uint16_t data_length;
+    int count = 0, length;
+
+    while ((length = store_next_length(store)) > 0) {
+        CHECK(length <= (int)sizeof(packet));
+        CHECK_EQ(store_next(store, packet, sizeof(packet), msg_id), length);
+        CHECK_EQ(mqtt_get_id(packet, length), msg_id);
+        snprintf(wanted, sizeof(wanted), "record %d", expected[count]);
+        data_length = length;
+        data = mqtt_get_publish_data(packet, &data_length);
+        CHECK(data != NULL && data_length == strlen(wanted) && memcmp(data, wanted, data_length) == 0);
+        CHECK_EQ(store_ack(store, msg_id), 0);
+        count++;
+        msg_id++;
+    }
+    return count;
+}
+
+/*
+ * Fill every segment, then open the store again: nothing may be lost, and
+ * appends wait for a segment to be trimmed.
+ */
+static void test_full(void)
+{
+    mqtt_store_t store;
+    int expected[CONFIG_MQTT_STORE_MAX_SEGMENTS * CONFIG_MQTT_STORE_SEGMENT_SIZE];
+    int count = 0;
+
+    CHECK(system("rm -rf " CONFIG_MQTT_STORE_PATH) == 0);
+    CHECK_EQ(store_init(&store), 0);
+    while (append(&store, count) == 0) {
+        expected[count] = count;
+        count++;
+    }
+    CHECK_EQ(append(&store, count), STORE_FULL);
+    CHECK_EQ(store.count, CONFIG_MQTT_STORE_MAX_SEGMENTS);
+    CHECK(count > CONFIG_MQTT_STORE_MAX_SEGMENTS);
+
+    store_deinit(&store);
+    CHECK_EQ(store_init(&store), 0);
+    CHECK_EQ(store.count, CONFIG_MQTT_STORE_MAX_SEGMENTS);
+    CHECK_EQ(append(&store, count), STORE_FULL);
+    CHECK_EQ(drain(&store, expected, 1), count);
+    CHECK_EQ(append(&store, count), 0);
+    CHECK_EQ(drain(&store, &count, 1), 1);
+    store_deinit(&store);
+}
+
+int main(void)
+{
+    struct rlimit limit;
+    mqtt_store_t store;
+    long size;
+
+    signal(SIGXFSZ, SIG_IGN);
+    CHECK(system("rm -rf " CONFIG_MQTT_STORE_PATH) == 0);
+
+    CHECK_EQ(store_init(&store), 0);
+    CHECK_EQ(store.count, 1);
+    CHECK_EQ(append(&store, 0), 0);
+    CHECK_EQ(append(&store, 1), 0);
+
+    // Record 2 is cut off by the file size limit
+    CHECK_EQ(store_sync(&store), 0);
+    size = store.segments[store.first].size;
+    getrlimit(RLIMIT_FSIZE, &limit);
+    limit.rlim_cur = size + 4;
+    CHECK_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+    CHECK_EQ(append(&store, 2), 0);
+    CHECK_EQ(store_sync(&store), 1);
+    limit.rlim_cur = limit.rlim_max;
+    CHECK_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+
+    // The next ones go to a new segment, and reading goes on past the torn record
+    CHECK_EQ(append(&store, 3), 0);
+    CHECK_EQ(append(&store, 4), 0);
+    CHECK_EQ(store.count, 2);
+    CHECK_EQ(drain(&store, (const int[]){ 0, 1, 3, 4 }, 10), 4);
+    CHECK_EQ(append(&store, 5), 0);
+    CHECK_EQ(append(&store, 6), 0);
+
+    // Opened again, only the records not acked are left
+    store_deinit(&store);
+    CHECK_EQ(store_init(&store), 0);
+    CHECK_EQ(drain(&store, (const int[]){ 5, 6 }, 20), 2);
+
+    // Fully acked segments are deleted, bar the one appended to
+    CHECK_EQ(store.count, 1);
+    store_deinit(&store);
+
+    test_full();
+    CHECK(system("rm -rf " CONFIG_MQTT_STORE_PATH) == 0);
+    TEST_DONE();
+}
@@ -0,0 +1,79 @@
+/**
+* \file
+*   Callback routes of subscription batches the send queue refuses
+*
+* With no connection the send queue fills up with publishes. A batch that
+* cannot be queued then must leave no route behind, an unsubscribe that
+* cannot be queued must keep the routes, and routes of a batch queued
+* before the queue filled up must stay.
+*/
+#include <string.h>
+#include "mqtt.h"
+#include "test.h"
+
+static mqtt_settings settings;
+
+static bool connect_fails(mqtt_client *client)
+{
+    vTaskDelay(10);
+    return false;
+}
+
+static void on_message(mqtt_client *client, mqtt_event_data_t *event_data, void *context)
+{
+}
+
+static bool routed(mqtt_client *client, const char *topic)
+{
+    mqtt_trie_match_t matches[4];
+
+    return trie_match(&client->subscriptions, topic, strlen(topic), matches, 4) > 0;
+}
+
+int main(void)
+{
+    static char payload[200];
+    const mqtt_topic_t queued[] = {
+        { "queued/a", 1, on_message, NULL },
+        { "queued/+/b", 0, on_message, NULL },
+    };
+    const mqtt_topic_t refused[] = {
+        { "refused/a", 1, on_message, NULL },
+        { "refused/#", 0, on_message, NULL },
+    };
+    mqtt_client *client;
+    int publishes = 0;
+
+    strcpy(settings.host, "127.0.0.1");
+    strcpy(settings.client_id, "test_subscribe");
+    settings.keepalive = 30;
+    settings.clean_session = 1;
+    settings.auto_reconnect = true;
+    settings.connect_cb = connect_fails;
+    settings.overflow_policy = MQTT_OVERFLOW_FAIL;
+    client = mqtt_start(&settings);
+    CHECK(client != NULL);
+
+    CHECK_EQ(mqtt_subscribe_multiple(client, queued, 2), MQTT_OK);
+    CHECK(routed(client, "queued/a"));
+    CHECK(routed(client, "queued/x/b"));
+
+    while (mqtt_publish(client, "fill", payload, sizeof(payload), 0, 0) == MQTT_OK)
+        publishes++;
+    CHECK(publishes > 0);
+
+    CHECK_EQ(mqtt_subscribe_multiple(client, refused, 2), MQTT_WOULD_BLOCK);
+    CHECK(!routed(client, "refused/a"));
+    CHECK(!routed(client, "refused/x"));
+    CHECK_EQ(mqtt_subscribe(client, "refused/one", 1, on_message, NULL), MQTT_WOULD_BLOCK);
+    CHECK(!routed(client, "refused/one"));
+
+    CHECK_EQ(mqtt_unsubscribe_multiple(client, queued, 2), MQTT_WOULD_BLOCK);
+    CHECK(routed(client, "queued/a"));
+    CHECK(routed(client, "queued/x/b"));
+
+    mqtt_stop(client);
+    WAIT_FOR(shim_tasks() == 0, 3000);
+    CHECK_EQ(shim_tasks(), 0);
+    TEST_DONE();
+}
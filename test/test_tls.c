@@ -0,0 +1,254 @@
+/**
+* \file
+*   TLS sessions resumed across reconnects
+*
+* A loopback TLS server, with a key and self-signed certificate made at
+* startup, answers CONNECT with a CONNACK and drops the connection when
+* told. Reconnecting must resume the session of the first handshake, and a
+* failed handshake must have the client start over with a new session.
+* Built with CONFIG_MQTT_SECURITY_ON against the host OpenSSL.
+*/
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include "mqtt.h"
+#include "test.h"
+
+#define MAX_CONNECTIONS 8
+
+typedef struct
+{
+  SSL_CTX* ctx;
+  int listener;
+  uint16_t port;
+  pthread_t thread;
+  volatile bool stop;
+  volatile bool drop;            /* Close the connection being served */
+  volatile bool fail_handshake;  /* Close the next connection before the handshake */
+  volatile int connections;      /* Handshakes completed */
+  volatile int failed;
+  volatile int reused[MAX_CONNECTIONS];
+} tls_server_t;
+
+static tls_server_t server;
+static mqtt_settings settings;
+static volatile int connected;
+
+/*
+ * Key and self-signed certificate for 127.0.0.1, set in ctx.
+ */
+static int tls_server_identity(SSL_CTX* ctx)
+{
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* cert = X509_new();
+    X509_NAME* name;
+    int result = -1;
+
+    if (key == NULL || cert == NULL)
+        goto done;
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+    name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    if (X509_sign(cert, key, EVP_sha256()) > 0 &&
+        SSL_CTX_use_certificate(ctx, cert) == 1 && SSL_CTX_use_PrivateKey(ctx, key) == 1)
+        result = 0;
+done:
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return result;
+}
+
+static int tls_read(SSL* ssl, uint8_t* buffer, int length)
+{
+    int done = 0, n;
+
+    while (done < length) {
+        n = SSL_read(ssl, buffer + done, length - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * Read the CONNECT and send the CONNACK. Returns -1 on failure.
+ */
+static int tls_accept_mqtt(SSL* ssl)
+{
+    static const uint8_t connack[] = { 0x20, 2, 0, 0 };
+    uint8_t packet[512];
+    uint32_t remaining = 0;
+    int pos = 1, shift = 0;
+
+    if (tls_read(ssl, packet, 1) != 0 || packet[0] >> 4 != 1)
+        return -1;
+    do {
+        if (pos > 4 || tls_read(ssl, packet + pos, 1) != 0)
+            return -1;
+        remaining |= (uint32_t)(packet[pos] & 0x7f) << shift;
+        shift += 7;
+    } while (packet[pos++] & 0x80);
+    if (pos + remaining > sizeof(packet) || tls_read(ssl, packet + pos, remaining) != 0)
+        return -1;
+    return SSL_write(ssl, connack, sizeof(connack)) == sizeof(connack) ? 0 : -1;
+}
+
+/*
+ * Serve one connection until it is closed or dropped, reading and ignoring
+ * what the client sends after the CONNECT.
+ */
+static void tls_serve(tls_server_t* s, int fd)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    uint8_t scratch[256];
+    SSL* ssl = SSL_new(s->ctx);
+
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) <= 0) {
+        __atomic_add_fetch(&s->failed, 1, __ATOMIC_RELAXED);
+        SSL_free(ssl);
+        return;
+    }
+    if (s->connections < MAX_CONNECTIONS)
+        s->reused[s->connections] = SSL_session_reused(ssl);
+    __atomic_add_fetch(&s->connections, 1, __ATOMIC_RELEASE);
+
+    if (tls_accept_mqtt(ssl) == 0) {
+        while (!s->stop && !s->drop) {
+            if (SSL_pending(ssl) == 0 && poll(&pfd, 1, 20) <= 0)
+                continue;
+            if (SSL_read(ssl, scratch, sizeof(scratch)) <= 0)
+                break;
+        }
+    }
+    s->drop = false;
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+}
+
+static void* tls_server_run(void* arg)
+{
+    tls_server_t* s = arg;
+    struct pollfd pfd = { s->listener, POLLIN, 0 };
+    int fd;
+
+    while (!s->stop) {
+        if (poll(&pfd, 1, 20) <= 0)
+            continue;
+        fd = accept(s->listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+        if (s->fail_handshake) {
+            s->fail_handshake = false;
+            __atomic_add_fetch(&s->failed, 1, __ATOMIC_RELAXED);
+        } else {
+            tls_serve(s, fd);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+static int tls_server_start(tls_server_t* s)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    int one = 1;
+
+    s->ctx = SSL_CTX_new(TLS_server_method());
+    if (s->ctx == NULL || tls_server_identity(s->ctx) != 0)
+        return -1;
+    SSL_CTX_set_session_id_context(s->ctx, (const unsigned char*)"test_tls", 8);
+
+    s->listener = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(s->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(s->listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s->listener, 4) != 0 ||
+        getsockname(s->listener, (struct sockaddr*)&addr, &addr_length) != 0)
+        return -1;
+    s->port = ntohs(addr.sin_port);
+    return pthread_create(&s->thread, NULL, tls_server_run, s);
+}
+
+static void tls_server_stop(tls_server_t* s)
+{
+    s->stop = true;
+    pthread_join(s->thread, NULL);
+    close(s->listener);
+    SSL_CTX_free(s->ctx);
+}
+
+static void on_connected(mqtt_client *client, mqtt_event_data_t *event_data)
+{
+    connected++;
+}
+
+int main(void)
+{
+    mqtt_client *client;
+
+    signal(SIGPIPE, SIG_IGN);
+    CHECK(tls_server_start(&server) == 0);
+
+    strcpy(settings.host, "127.0.0.1");
+    settings.port = server.port;
+    strcpy(settings.client_id, "test_tls");
+    settings.keepalive = 600;
+    settings.clean_session = 1;
+    settings.auto_reconnect = true;
+    settings.reconnect_initial_ms = 10;
+    settings.reconnect_max_ms = 50;
+    settings.connected_cb = on_connected;
+    client = mqtt_start(&settings);
+    CHECK(client != NULL);
+
+    // A full handshake first, then resumed ones
+    WAIT_FOR(connected == 1, 5000);
+    CHECK_EQ(connected, 1);
+    CHECK_EQ(server.reused[0], 0);
+    CHECK(client->session != NULL);
+
+    server.drop = true;
+    WAIT_FOR(connected == 2, 5000);
+    CHECK_EQ(connected, 2);
+    CHECK_EQ(server.reused[1], 1);
+
+    server.drop = true;
+    WAIT_FOR(connected == 3, 5000);
+    CHECK_EQ(connected, 3);
+    CHECK_EQ(server.reused[2], 1);
+
+    // A failed handshake drops the session
+    server.fail_handshake = true;
+    server.drop = true;
+    WAIT_FOR(connected == 4, 5000);
+    CHECK_EQ(connected, 4);
+    CHECK_EQ(server.failed, 1);
+    CHECK_EQ(server.connections, 4);
+    CHECK_EQ(server.reused[3], 0);
+
+    server.drop = true;
+    WAIT_FOR(connected == 5, 5000);
+    CHECK_EQ(connected, 5);
+    CHECK_EQ(server.reused[4], 1);
+
+    mqtt_stop(client);
+    WAIT_FOR(shim_tasks() == 0, 3000);
+    CHECK_EQ(shim_tasks(), 0);
+    tls_server_stop(&server);
+    TEST_DONE();
+}